@@ -0,0 +1,1097 @@
+
+#include <iostream>
+#include <cstdlib>
+#include <vector>
+#include <map>
+#include <string>
+#include <chrono>
+
+#include <boost/format.hpp>
+#include <random>
+#include <functional>
+
+#include "image/bigimage.h"
+
+using namespace std;
+using boost::format;
+
+using bigimage::BigImage;
+using bigimage::WorkerPool;
+using bigimage::ImageType;
+using bigimage::PixelTypeU32;
+using bigimage::PixelTypeRGBA32;
+using bigimage::PixelTypeRGBAf;
+using bigimage::TileBlockManager;
+using bigimage::TileQuadtreeManager;
+using bigimage::TileCacheManager;
+using bigimage::TileSwapManager;
+using bigimage::TileCompressedManager;
+using bigimage::ImageProcJob;
+using bigimage::kTileWidth;
+using bigimage::kTileHeight;
+using bigimage::kTilePixels;
+
+typedef BigImage<ImageType<PixelTypeRGBA32, TileBlockManager>> ImageRGBA32;
+typedef BigImage<ImageType<PixelTypeRGBA32, TileQuadtreeManager>> ImageRGBA32Q;
+typedef BigImage<ImageType<PixelTypeRGBA32, TileCacheManager>> ImageRGBA32C;
+typedef BigImage<ImageType<PixelTypeRGBA32, TileSwapManager>> ImageRGBA32S;
+typedef BigImage<ImageType<PixelTypeRGBAf, TileBlockManager>> ImageRGBAf;
+
+// Wall clock time of fn(), in seconds
+template<typename fnT>
+double Time(const fnT & fn)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    fn();
+    auto t1 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(t1 - t0).count();
+}
+
+// Best of several runs, to filter out scheduling noise
+template<typename fnT>
+double BestTime(int runs, const fnT & fn)
+{
+    double best = Time(fn);
+    for(int j = 1; j < runs; ++j)
+        best = std::min(best, Time(fn));
+    return best;
+}
+
+
+// *****************************************************************************
+// Tile dispatch scaling: a light per-pixel pass over a 16k x 16k RGBA32 image,
+// from 1 thread up to the machine's thread count. Light passes are where
+// dispatch overhead shows.
+void BenchEachTileScaling()
+{
+    const int32_t kSize = 16384;
+    ImageRGBA32 img(kSize, kSize, "");
+    img.EachPixel([](uint32_t & pix){pix = 0xFF000000;});
+    
+    int maxThreads = std::max(1, std::min<int>(std::thread::hardware_concurrency(), bigimage::kNThreads));
+    std::vector<int> threadCounts;
+    for(int nthreads = 1; nthreads < maxThreads; nthreads *= 2)
+        threadCounts.push_back(nthreads);
+    threadCounts.push_back(maxThreads);
+    
+    double mpix = double(kSize)*kSize/1e6;
+    double t1 = 0;
+    cout << format("EachTile scaling, %dx%d RGBA32\n")% kSize % kSize;
+    for(int nthreads : threadCounts)
+    {
+        WorkerPool::Shared().Resize(nthreads);
+        double t = BestTime(3, [&]{
+            img.EachPixel([](uint32_t & pix){pix = pix*3 + 1;});
+        });
+        if(nthreads == 1)
+            t1 = t;
+        cout << format("%3d threads: %8.3f ms, %8.1f Mpix/s, speedup %5.2f\n")
+            % nthreads % (t*1e3) % (mpix/t) % (t1/t);
+    }
+    WorkerPool::Shared().Resize(0);
+}
+
+
+// *****************************************************************************
+// Small viewport reads from a huge file-backed image. Cost should depend on the
+// size of the viewport, not of the image. A full scan of the tile list with an
+// overlap test per tile is timed for comparison.
+void BenchSmallRectGetPixels()
+{
+    const int32_t kSize = 100352;// 196 blocks of 512 pixels
+    const int32_t kViewSize = 256;
+    const int kReads = 200;
+    const char * kPath = "bench_huge.work";
+    
+    std::mt19937 rng;
+    std::uniform_int_distribution<int32_t> pos(0, kSize - kViewSize);
+    std::vector<uint32_t> view(kViewSize*kViewSize);
+    {
+        ImageRGBA32 img(kSize, kSize, kPath);
+        cout << format("Small rect GetPixels, %dx%d view of %dx%d RGBA32\n")% kViewSize % kViewSize % kSize % kSize;
+        
+        double t = Time([&]{
+            for(int j = 0; j < kReads; ++j) {
+                Rect r(pos(rng), pos(rng), kViewSize, kViewSize);
+                img.GetPixels<PixelTypeRGBA32>(r, &view[0]);
+            }
+        });
+        cout << format("rect traversal: %10.1f us/read\n")% (t*1e6/kReads);
+        
+        std::atomic<size_t> visited(0);
+        t = Time([&]{
+            for(int j = 0; j < kReads; ++j) {
+                Rect r(pos(rng), pos(rng), kViewSize, kViewSize);
+                img.EachTile([&](ImageRGBA32::TileInfo & ti){
+                    if(r.Overlaps(ti.x, ti.y, bigimage::kTileWidth, bigimage::kTileHeight))
+                        ++visited;
+                });
+            }
+        });
+        cout << format("full tile scan: %10.1f us/read\n")% (t*1e6/kReads);
+    }
+    std::remove(kPath);
+}
+
+
+// *****************************************************************************
+// Neighborhood access: each tile is combined with its 8 neighbors, as a blur or
+// resampling pass would. Compares the block and quadtree layouts on the same
+// file-backed image. The first pass after filling includes page faults on the
+// backing file, later passes are timed warm.
+template<typename imgT>
+double NeighborhoodPass(imgT & img, std::vector<uint32_t> & sums)
+{
+    typedef typename imgT::TileInfo TileInfo;
+    int32_t xtiles = img.Width()/kTileWidth, ytiles = img.Height()/kTileHeight;
+    return Time([&]{
+        img.EachTile([&](TileInfo & ti){
+            int32_t tx = ti.x/kTileWidth, ty = ti.y/kTileHeight;
+            uint32_t sum = 0;
+            for(int32_t ny = std::max(ty - 1, 0); ny <= std::min(ty + 1, ytiles - 1); ++ny)
+            for(int32_t nx = std::max(tx - 1, 0); nx <= std::min(tx + 1, xtiles - 1); ++nx)
+            {
+                TileInfo & nt = img.GetTiles()[ny*xtiles + nx];
+                for(uint32_t p : *nt.pixels)
+                    sum += p;
+            }
+            sums[ty*xtiles + tx] = sum;
+        });
+    });
+}
+
+template<typename imgT>
+void BenchNeighborhoodLayout(const char * name, int32_t size)
+{
+    const char * kPath = "bench_layout.work";
+    std::vector<uint32_t> sums((size/kTileWidth)*(size/kTileHeight));
+    {
+        imgT img(size, size, kPath);
+        img.EachPixelXY([](int32_t x, int32_t y, uint32_t & pix){pix = x ^ y;});
+        double tcold = NeighborhoodPass(img, sums);
+        double twarm = BestTime(3, [&]{NeighborhoodPass(img, sums);});
+        double mpix = double(size)*size/1e6;
+        cout << format("%-10s first pass %8.1f ms, warm %8.1f ms (%7.1f Mpix/s)\n")
+            % name % (tcold*1e3) % (twarm*1e3) % (mpix/twarm);
+    }
+    std::remove(kPath);
+}
+
+void BenchNeighborhood()
+{
+    const int32_t kSize = 8192;
+    cout << format("3x3 tile neighborhood, %dx%d RGBA32\n")% kSize % kSize;
+    BenchNeighborhoodLayout<ImageRGBA32>("block", kSize);
+    BenchNeighborhoodLayout<ImageRGBA32Q>("quadtree", kSize);
+}
+
+
+// *****************************************************************************
+// Out of core streaming: passes over a 1 GB image with a 64 MB tile cache, with
+// and without read-ahead. Throughput is bounded by the disk once the page cache
+// is cold, so results depend heavily on what else is cached.
+void BenchOutOfCore()
+{
+    const int32_t kSize = 16384;
+    const char * kPath = "bench_cache.work";
+    {
+        ImageRGBA32C img(kSize, kSize, kPath);
+        img.GetTileManager().SetBudget(img, 64*1024*1024);
+        cout << format("Out of core passes, %dx%d RGBA32, 64 MB cache\n")% kSize % kSize;
+        double mpix = double(kSize)*kSize/1e6;
+        for(int32_t prefetch : {0, bigimage::kDefaultPrefetchBlocks})
+        {
+            img.GetTileManager().SetPrefetchBlocks(prefetch);
+            auto before = img.GetTileManager().GetStats();
+            double t = Time([&]{img.EachPixel([](uint32_t & pix){pix = pix*3 + 1;});});
+            auto stats = img.GetTileManager().GetStats();
+            cout << format("prefetch %d blocks: %8.1f ms, %8.1f Mpix/s, %zu loads, %zu write-backs\n")
+                % prefetch % (t*1e3) % (mpix/t) % (stats.loads - before.loads) % (stats.writeBacks - before.writeBacks);
+        }
+    }
+    std::remove(kPath);
+}
+
+
+// *****************************************************************************
+// In-place 3x3 box filter with ImageProcJob, against filtering into a second
+// image. The job only holds temporary tiles for the frontier of the pass. The
+// block manager commits results by copying, the swap manager by swapping
+// pointers.
+template<typename imgT>
+uint32_t BoxSum(imgT & img, int32_t x, int32_t y)
+{
+    uint32_t sum = 0;
+    for(int32_t ny = std::max(y - 1, 0); ny <= std::min(y + 1, img.Height() - 1); ++ny)
+    for(int32_t nx = std::max(x - 1, 0); nx <= std::min(x + 1, img.Width() - 1); ++nx)
+        sum += img.GetPixel(nx, ny);
+    return sum/9;
+}
+
+template<typename imgT>
+void BenchStencilJob(const char * name, int32_t size)
+{
+    typedef typename imgT::TileInfo TileInfo;
+    imgT img(size, size, "");
+    img.EachPixelXY([](int32_t x, int32_t y, uint32_t & pix){pix = (x ^ y) & 0xFF;});
+    ImageProcJob<imgT> job(1);
+    // The first pass of the swap manager allocates a buffer for every tile
+    // leaving its home slot, later passes recycle them.
+    double t = BestTime(3, [&]{
+        job.Execute(img, [&](TileInfo & src, TileInfo & dst){
+            dst.EachPixelXY([&](int32_t x, int32_t y, uint32_t & pix){pix = BoxSum(img, x, y);});
+        });
+    });
+    double mpix = double(size)*size/1e6;
+    auto pool = img.GetTileManager().GetTmpPool().GetStats();
+    cout << format("%-16s %8.1f ms, %8.1f Mpix/s, %zu temporary tiles, %.1f%% pool reuse\n")
+        % name % (t*1e3) % (mpix/t) % job.MaxPendingTiles()
+        % (100.0*pool.reuses/std::max<size_t>(pool.allocations + pool.reuses, 1));
+}
+
+void BenchStencil()
+{
+    const int32_t kSize = 8192;
+    cout << format("3x3 box filter, %dx%d RGBA32\n")% kSize % kSize;
+    {
+        ImageRGBA32 img(kSize, kSize, "");
+        ImageRGBA32 out(kSize, kSize, "");
+        img.EachPixelXY([](int32_t x, int32_t y, uint32_t & pix){pix = (x ^ y) & 0xFF;});
+        double t = Time([&]{
+            out.EachPixelXY([&](int32_t x, int32_t y, uint32_t & pix){pix = BoxSum(img, x, y);});
+        });
+        double mpix = double(kSize)*kSize/1e6;
+        cout << format("%-16s %8.1f ms, %8.1f Mpix/s, %zu temporary tiles\n")
+            % "separate output" % (t*1e3) % (mpix/t) % img.GetTiles().size();
+    }
+    BenchStencilJob<ImageRGBA32>("in place, block", kSize);
+    BenchStencilJob<ImageRGBA32S>("in place, swap", kSize);
+}
+
+
+// *****************************************************************************
+// CopyPixels conversion throughput for every pixel type pair, with each kernel
+// set the CPU supports. Buffers are sized to stay in cache, so this measures
+// the kernels rather than memory bandwidth.
+template<typename dpixT, typename spixT>
+void BenchCopyPixelsPair(const char * name)
+{
+    namespace pc = bigimage::pixelconv;
+    const size_t kPixels = 32*1024;
+    const int kReps = 500;
+    std::vector<uint32_t> rgba(kPixels);
+    std::vector<typename spixT::pixel_val_t> src(kPixels);
+    std::vector<typename dpixT::pixel_val_t> dst(kPixels);
+    std::mt19937 rng;
+    for(auto & p : rgba)
+        p = rng();
+    bigimage::CopyPixels<spixT, PixelTypeRGBA32>(&src[0], &rgba[0], kPixels);
+    
+    double bytes = double(kReps)*kPixels*(sizeof(src[0]) + sizeof(dst[0]));
+    cout << format("%-16s")% name;
+    const char * levelNames[] = {"scalar", "SSE4.1", "AVX2"};
+    for(pc::SIMDLevel level : {pc::kSIMDNone, pc::kSIMDSSE41, pc::kSIMDAVX2})
+    {
+        pc::SetSIMDLevel(level);
+        if(pc::GetSIMDLevel() != level)
+            continue;
+        double t = BestTime(3, [&]{
+            for(int j = 0; j < kReps; ++j)
+                bigimage::CopyPixels<dpixT, spixT>(&dst[0], &src[0], kPixels);
+        });
+        cout << format("  %s %6.2f GB/s")% levelNames[level] % (bytes/t/1e9);
+    }
+    cout << endl;
+    pc::SetSIMDLevel(pc::kSIMDAVX2);
+}
+
+void BenchCopyPixels()
+{
+    cout << "CopyPixels conversion throughput, bytes read + written\n";
+    BenchCopyPixelsPair<PixelTypeRGBA32, PixelTypeRGBA32>("RGBA32 <- RGBA32");
+    BenchCopyPixelsPair<PixelTypeRGBA32, PixelTypeRGBAf>("RGBA32 <- RGBAf");
+    BenchCopyPixelsPair<PixelTypeRGBA32, PixelTypeU32>("RGBA32 <- U32");
+    BenchCopyPixelsPair<PixelTypeRGBAf, PixelTypeRGBAf>("RGBAf <- RGBAf");
+    BenchCopyPixelsPair<PixelTypeRGBAf, PixelTypeRGBA32>("RGBAf <- RGBA32");
+    BenchCopyPixelsPair<PixelTypeRGBAf, PixelTypeU32>("RGBAf <- U32");
+    BenchCopyPixelsPair<PixelTypeU32, PixelTypeU32>("U32 <- U32");
+    BenchCopyPixelsPair<PixelTypeU32, PixelTypeRGBA32>("U32 <- RGBA32");
+    BenchCopyPixelsPair<PixelTypeU32, PixelTypeRGBAf>("U32 <- RGBAf");
+}
+
+
+// *****************************************************************************
+// Pixel kernel dispatch: the same kernel run per pixel through a type-erased
+// std::function, per pixel through EachPixel(), and per row through EachRow().
+template<typename imgT, typename kernelT>
+void BenchDispatchType(const char * name, const kernelT & kernel)
+{
+    typedef typename imgT::pixel_val_t pixel_val_t;
+    const int32_t kSize = 8192;
+    imgT img(kSize, kSize, "");
+    img.EachPixel([](pixel_val_t & pix){pix = pixel_val_t();});
+    double mpix = double(kSize)*kSize/1e6;
+    
+    std::function<void(pixel_val_t &)> erased = kernel;
+    double terased = BestTime(3, [&]{img.EachPixel([&](pixel_val_t & pix){erased(pix);});});
+    double tpixel = BestTime(3, [&]{img.EachPixel(kernel);});
+    double trow = BestTime(3, [&]{
+        img.EachRow([&](int32_t x, int32_t y, pixel_val_t * row, int32_t len){
+            for(int32_t j = 0; j < len; ++j)
+                kernel(row[j]);
+        });
+    });
+    cout << format("%-7s std::function %7.1f Mpix/s, EachPixel %7.1f Mpix/s, EachRow %7.1f Mpix/s\n")
+        % name % (mpix/terased) % (mpix/tpixel) % (mpix/trow);
+}
+
+void BenchDispatch()
+{
+    cout << "Pixel kernel dispatch, 8192x8192\n";
+    BenchDispatchType<ImageRGBA32>("RGBA32", [](uint32_t & pix){pix = ((pix >> 1) & 0x7F7F7F7F) + 0x10101010;});
+    BenchDispatchType<ImageRGBAf>("RGBAf", [](float4 & pix){pix = pix*0.5f + 0.25f;});
+}
+
+
+// *****************************************************************************
+// Reductions over an RGBAf image: a channel sum with hand-rolled per-worker
+// contexts, packed next to each other, against Reduce() with a SumReducer, and
+// a full mean and variance with MeanVarReducer.
+void BenchReduce()
+{
+    const int32_t kSize = 8192;
+    typedef ImageRGBAf::TileInfo TileInfo;
+    ImageRGBAf img(kSize, kSize, "");
+    img.EachPixelXY([](int32_t x, int32_t y, float4 & pix){pix = float4{float(x & 0xFF), float(y & 0xFF), 0.5f, 1.0f};});
+    double mpix = double(kSize)*kSize/1e6;
+    auto toDouble = [](const float4 & p){return double4{p[0], p[1], p[2], p[3]};};
+    cout << format("Reductions, %dx%d RGBAf\n")% kSize % kSize;
+    
+    double4 manualSum;
+    double t = BestTime(3, [&]{
+        std::vector<double4> sums(bigimage::kNThreads, double4{0, 0, 0, 0});
+        img.EachTile(&sums[0], [&](double4 & sum, TileInfo & ti){
+            for(const float4 & p : *ti.pixels)
+                sum += toDouble(p);
+        }, bigimage::kAccessRead);
+        manualSum = double4{0, 0, 0, 0};
+        for(auto & s : sums)
+            manualSum += s;
+    });
+    cout << format("manual contexts sum:  %8.1f ms, %8.1f Mpix/s\n")% (t*1e3) % (mpix/t);
+    
+    double4 sum;
+    t = BestTime(3, [&]{sum = img.TransformReduce(toDouble, bigimage::SumReducer<double4>());});
+    cout << format("SumReducer:           %8.1f ms, %8.1f Mpix/s\n")% (t*1e3) % (mpix/t);
+    
+    bigimage::MeanVarReducer<double4>::value_t mv;
+    t = BestTime(3, [&]{mv = img.TransformReduce(toDouble, bigimage::MeanVarReducer<double4>());});
+    cout << format("MeanVarReducer:       %8.1f ms, %8.1f Mpix/s, mean %.2f var %.2f\n")
+        % (t*1e3) % (mpix/t) % mv.mean[0] % mv.var[0];
+}
+
+
+// *****************************************************************************
+// A op B -> C over 8k x 8k images: averaging two RGBA32 images, and scaling an
+// RGBAf image by an RGBA32 mask, through linear buffers with GetPixels() and
+// SetPixels() against tile by tile with BinOpTiles().
+void BenchZip()
+{
+    const int32_t kSize = 8192;
+    const size_t npixels = size_t(kSize)*kSize;
+    double mpix = double(npixels)/1e6;
+    ImageRGBA32 a(kSize, kSize, ""), b(kSize, kSize, ""), c(kSize, kSize, "");
+    ImageRGBAf f(kSize, kSize, ""), g(kSize, kSize, "");
+    a.EachPixelXY([](int32_t x, int32_t y, uint32_t & pix){pix = x*0x01010101u;});
+    b.EachPixelXY([](int32_t x, int32_t y, uint32_t & pix){pix = y*0x01010101u;});
+    f.EachPixelXY([](int32_t x, int32_t y, float4 & pix){pix = float4{float(x), float(y), 1.0f, 1.0f};});
+    auto average = [](uint32_t & d, const uint32_t & l, const uint32_t & r){
+        d = (l & r) + (((l ^ r) & 0xFEFEFEFEu) >> 1);
+    };
+    auto mask = [](float4 & d, const float4 & l, const uint32_t & r){
+        d = l*(float(r & 0xFF)*(1.0f/255.0f));
+    };
+    cout << format("Binary operations, %dx%d\n")% kSize % kSize;
+    
+    std::vector<uint32_t> la(npixels), lb(npixels);
+    double t = BestTime(3, [&]{
+        a.GetPixels<PixelTypeRGBA32>(&la[0]);
+        b.GetPixels<PixelTypeRGBA32>(&lb[0]);
+        bigimage::BinOp<PixelTypeRGBA32, PixelTypeRGBA32>(&la[0], &la[0], &lb[0], npixels, average);
+        c.SetPixels<PixelTypeRGBA32>(&la[0]);
+    });
+    cout << format("RGBA32 average, linear:  %8.1f ms, %8.1f Mpix/s\n")% (t*1e3) % (mpix/t);
+    t = BestTime(3, [&]{bigimage::BinOpTiles(c, a, b, average);});
+    cout << format("RGBA32 average, zipped:  %8.1f ms, %8.1f Mpix/s\n")% (t*1e3) % (mpix/t);
+    
+    std::vector<float4> lf(npixels);
+    t = BestTime(3, [&]{
+        f.GetPixels<PixelTypeRGBAf>(&lf[0]);
+        a.GetPixels<PixelTypeRGBA32>(&la[0]);
+        bigimage::BinOp<PixelTypeRGBAf, PixelTypeRGBAf, PixelTypeRGBA32>(&lf[0], &lf[0], &la[0], npixels, mask);
+        g.SetPixels<PixelTypeRGBAf>(&lf[0]);
+    });
+    cout << format("RGBAf mask, linear:      %8.1f ms, %8.1f Mpix/s\n")% (t*1e3) % (mpix/t);
+    t = BestTime(3, [&]{bigimage::BinOpTiles(g, f, a, mask);});
+    cout << format("RGBAf mask, zipped:      %8.1f ms, %8.1f Mpix/s\n")% (t*1e3) % (mpix/t);
+}
+
+
+// *****************************************************************************
+// A five operation chain, D = RGBA32((A*B + C)*0.5 - A*0.25) in RGBAf, over
+// out of core 8k x 8k RGBA32 images with 32 MB tile caches. Unfused, each step
+// is a pass of its own through an RGBAf intermediate, also out of core. Fused,
+// a pixel expression reads each source tile once and writes D once.
+void BenchFused()
+{
+    const int32_t kSize = 8192;
+    const size_t kBudget = 32*1024*1024;
+    using bigimage::Pixels;
+    using bigimage::Convert;
+    typedef BigImage<ImageType<PixelTypeRGBAf, TileCacheManager>> ImageRGBAfC;
+    {
+        ImageRGBA32C a(kSize, kSize, "bench_fused_a.work"), b(kSize, kSize, "bench_fused_b.work");
+        ImageRGBA32C c(kSize, kSize, "bench_fused_c.work"), d(kSize, kSize, "bench_fused_d.work");
+        ImageRGBAfC tmp(kSize, kSize, "bench_fused_tmp.work");
+        a.GetTileManager().SetBudget(a, kBudget);
+        b.GetTileManager().SetBudget(b, kBudget);
+        c.GetTileManager().SetBudget(c, kBudget);
+        d.GetTileManager().SetBudget(d, kBudget);
+        tmp.GetTileManager().SetBudget(tmp, kBudget);
+        a.EachPixelXY([](int32_t x, int32_t y, uint32_t & pix){pix = (x & 0xFF)*0x01010101u;});
+        b.EachPixelXY([](int32_t x, int32_t y, uint32_t & pix){pix = (y & 0xFF)*0x01010101u;});
+        c.EachPixelXY([](int32_t x, int32_t y, uint32_t & pix){pix = ((x ^ y) & 0xFF)*0x01010101u;});
+        double mpix = double(kSize)*kSize/1e6;
+        auto loads = [&]{
+            return a.GetTileManager().GetStats().loads + b.GetTileManager().GetStats().loads +
+                c.GetTileManager().GetStats().loads + d.GetTileManager().GetStats().loads +
+                tmp.GetTileManager().GetStats().loads;
+        };
+        auto toF = [](const uint32_t & p){float4 f; bigimage::CopyPixel<PixelTypeRGBAf, PixelTypeRGBA32>(f, p); return f;};
+        cout << format("Five operation chain, %dx%d RGBA32, 32 MB caches\n")% kSize % kSize;
+        
+        size_t before = loads();
+        double t = Time([&]{
+            bigimage::BinOpTiles(tmp, a, b, [&](float4 & o, const uint32_t & l, const uint32_t & r){o = toF(l)*toF(r);});
+            bigimage::BinOpTiles(tmp, tmp, c, [&](float4 & o, const float4 & l, const uint32_t & r){o = l + toF(r);});
+            bigimage::FilterTiles(tmp, tmp, [](float4 & o, const float4 & s){o = s*0.5f;});
+            bigimage::BinOpTiles(tmp, tmp, a, [&](float4 & o, const float4 & l, const uint32_t & r){o = l - toF(r)*0.25f;});
+            bigimage::FilterTiles(d, tmp, [](uint32_t & o, const float4 & s){
+                bigimage::CopyPixel<PixelTypeRGBA32, PixelTypeRGBAf>(o, s);
+            });
+        });
+        cout << format("unfused: %8.1f ms, %8.1f Mpix/s, %zu loads\n")% (t*1e3) % (mpix/t) % (loads() - before);
+        
+        before = loads();
+        t = Time([&]{
+            auto fa = Convert<PixelTypeRGBAf>(Pixels(a));
+            bigimage::Evaluate(d, (fa*Convert<PixelTypeRGBAf>(Pixels(b)) + Convert<PixelTypeRGBAf>(Pixels(c)))*0.5f - fa*0.25f);
+        });
+        cout << format("fused:   %8.1f ms, %8.1f Mpix/s, %zu loads\n")% (t*1e3) % (mpix/t) % (loads() - before);
+    }
+    for(const char * path : {"bench_fused_a.work", "bench_fused_b.work", "bench_fused_c.work",
+                             "bench_fused_d.work", "bench_fused_tmp.work"})
+        std::remove(path);
+}
+
+
+// *****************************************************************************
+// Latency of a 1024x768 viewport into a pipeline over an 8k x 8k image: RGBA32
+// to RGBAf, a 5x5 box filter, and back to RGBA32. Eagerly, each step is a pass
+// over the whole image before the viewport can be read. Pulled, only the tiles
+// under the viewport and their neighborhoods are computed, and panning the
+// viewport only computes tiles that weren't cached.
+void BenchPull()
+{
+    const int32_t kSize = 8192;
+    const int32_t kRadius = 2;
+    const Rect view(kSize/2, kSize/2, 1024, 768);
+    typedef bigimage::PullSampler<PixelTypeRGBAf> Sampler;
+    ImageRGBA32 src(kSize, kSize, "");
+    src.EachPixelXY([](int32_t x, int32_t y, uint32_t & pix){pix = ((x ^ y) & 0xFF)*0x01010101u;});
+    std::vector<uint32_t> pixels(view.w*view.h);
+    auto toF = [](float4 & d, const uint32_t & s){bigimage::CopyPixel<PixelTypeRGBAf, PixelTypeRGBA32>(d, s);};
+    auto box = [](float4 & d, int32_t x, int32_t y, const Sampler & s){
+        float4 sum = {0, 0, 0, 0};
+        for(int32_t j = -kRadius; j <= kRadius; ++j)
+        for(int32_t i = -kRadius; i <= kRadius; ++i)
+            sum += s(x + i, y + j);
+        d = sum*(1.0f/((2*kRadius + 1)*(2*kRadius + 1)));
+    };
+    cout << format("Viewport %dx%d into %dx%d pipeline\n")% view.w % view.h % kSize % kSize;
+    
+    double t = Time([&]{
+        ImageRGBAf f(kSize, kSize, ""), g(kSize, kSize, "");
+        bigimage::FilterTiles(f, src, toF);
+        g.EachPixelXY([&](int32_t x, int32_t y, float4 & pix){
+            float4 sum = {0, 0, 0, 0};
+            for(int32_t j = -kRadius; j <= kRadius; ++j)
+            for(int32_t i = -kRadius; i <= kRadius; ++i)
+                sum += f.GetPixel(std::min(std::max(x + i, 0), kSize - 1), std::min(std::max(y + j, 0), kSize - 1));
+            pix = sum*(1.0f/((2*kRadius + 1)*(2*kRadius + 1)));
+        });
+        g.GetPixels<PixelTypeRGBA32>(view, &pixels[0]);
+    });
+    cout << format("eager:          %8.1f ms\n")% (t*1e3);
+    
+    auto srcNode = bigimage::MakeSource(src);
+    auto fNode = bigimage::MakeMap<PixelTypeRGBAf>(*srcNode, toF);
+    auto boxNode = bigimage::MakeNeighborhood<PixelTypeRGBAf>(*fNode, kRadius, box);
+    t = Time([&]{boxNode->GetPixels<PixelTypeRGBA32>(view, &pixels[0]);});
+    cout << format("pulled, cold:   %8.1f ms, %zu tiles computed\n")% (t*1e3) % boxNode->GetStats().computed;
+    size_t before = boxNode->GetStats().computed;
+    Rect panned(view.x + kTileWidth, view.y, view.w, view.h);
+    t = Time([&]{boxNode->GetPixels<PixelTypeRGBA32>(panned, &pixels[0]);});
+    cout << format("pulled, panned: %8.1f ms, %zu tiles computed\n")% (t*1e3) % (boxNode->GetStats().computed - before);
+}
+
+
+// *****************************************************************************
+// 5x5 box filter and 3x3 dilation over 8k x 8k images, reading neighbors
+// through BigImage::GetPixel() against reading them from tile aprons.
+void BenchApron()
+{
+    const int32_t kSize = 8192;
+    const int32_t kRadius = 2;
+    const float kNorm = 1.0f/((2*kRadius + 1)*(2*kRadius + 1));
+    double mpix = double(kSize)*kSize/1e6;
+    ImageRGBAf src(kSize, kSize, ""), dst(kSize, kSize, "");
+    ImageRGBA32 msrc(kSize, kSize, ""), mdst(kSize, kSize, "");
+    src.EachPixelXY([](int32_t x, int32_t y, float4 & pix){pix = float4{float(x & 0xFF), float(y & 0xFF), 0.5f, 1.0f};});
+    msrc.EachPixelXY([](int32_t x, int32_t y, uint32_t & pix){pix = (x*y) & 0xFF;});
+    auto clampX = [&](int32_t x){return std::min(std::max(x, 0), kSize - 1);};
+    cout << format("Stencils, %dx%d\n")% kSize % kSize;
+    
+    double t = BestTime(3, [&]{
+        dst.EachPixelXY([&](int32_t x, int32_t y, float4 & pix){
+            float4 sum = {0, 0, 0, 0};
+            for(int32_t j = -kRadius; j <= kRadius; ++j)
+            for(int32_t i = -kRadius; i <= kRadius; ++i)
+                sum += src.GetPixel(clampX(x + i), clampX(y + j));
+            pix = sum*kNorm;
+        });
+    });
+    cout << format("RGBAf 5x5 box, GetPixel:     %8.1f ms, %8.1f Mpix/s\n")% (t*1e3) % (mpix/t);
+    t = BestTime(3, [&]{
+        bigimage::EachTileApron(dst, src, kRadius, [&](ImageRGBAf::TileInfo & ti, const bigimage::Apron<float4> & a){
+            float4 * out = &(*ti.pixels)[0];
+            for(int32_t y = 0; y < kTileHeight; ++y)
+            for(int32_t x = 0; x < kTileWidth; ++x)
+            {
+                float4 sum = {0, 0, 0, 0};
+                for(int32_t j = -kRadius; j <= kRadius; ++j) {
+                    const float4 * row = a.Row(y + j);
+                    for(int32_t i = -kRadius; i <= kRadius; ++i)
+                        sum += row[x + i];
+                }
+                out[y*kTileWidth + x] = sum*kNorm;
+            }
+        });
+    });
+    cout << format("RGBAf 5x5 box, apron:        %8.1f ms, %8.1f Mpix/s\n")% (t*1e3) % (mpix/t);
+    
+    t = BestTime(3, [&]{
+        mdst.EachPixelXY([&](int32_t x, int32_t y, uint32_t & pix){
+            uint32_t m = 0;
+            for(int32_t j = -1; j <= 1; ++j)
+            for(int32_t i = -1; i <= 1; ++i)
+                m = std::max(m, msrc.GetPixel(clampX(x + i), clampX(y + j)));
+            pix = m;
+        });
+    });
+    cout << format("RGBA32 3x3 dilate, GetPixel: %8.1f ms, %8.1f Mpix/s\n")% (t*1e3) % (mpix/t);
+    t = BestTime(3, [&]{
+        bigimage::EachTileApron(mdst, msrc, 1, [&](ImageRGBA32::TileInfo & ti, const bigimage::Apron<uint32_t> & a){
+            uint32_t * out = &(*ti.pixels)[0];
+            for(int32_t y = 0; y < kTileHeight; ++y)
+            for(int32_t x = 0; x < kTileWidth; ++x)
+            {
+                uint32_t m = 0;
+                for(int32_t j = -1; j <= 1; ++j)
+                for(int32_t i = -1; i <= 1; ++i)
+                    m = std::max(m, a(x + i, y + j));
+                out[y*kTileWidth + x] = m;
+            }
+        });
+    });
+    cout << format("RGBA32 3x3 dilate, apron:    %8.1f ms, %8.1f Mpix/s\n")% (t*1e3) % (mpix/t);
+}
+
+
+// *****************************************************************************
+// In-place Gaussian blur throughput against sigma, with direct separable
+// convolution (FIR) and the recursive approximation (IIR), for each pixel type.
+template<typename imgT>
+void BenchConvolveType(const char * name)
+{
+    const int32_t kSize = 4096;
+    double mpix = double(kSize)*kSize/1e6;
+    imgT img(kSize, kSize, "");
+    img.EachPixelXY([](int32_t x, int32_t y, typename imgT::pixel_val_t & pix){
+        bigimage::CopyPixel<typename imgT::pixel_t, PixelTypeU32>(pix, uint32_t(x*y)*2654435761u);
+    });
+    for(float sigma : {1.0f, 2.0f, 4.0f, 8.0f, 16.0f, 32.0f})
+    {
+        int32_t radius = bigimage::GaussianKernel(sigma).size()/2;
+        double tfir = BestTime(3, [&]{bigimage::GaussianBlurFIR(img, sigma);});
+        double tiir = BestTime(3, [&]{bigimage::GaussianBlurIIR(img, sigma);});
+        cout << format("%-6s sigma %4.1f (radius %3d): FIR %8.1f Mpix/s, IIR %8.1f Mpix/s\n")
+            % name % sigma % radius % (mpix/tfir) % (mpix/tiir);
+    }
+}
+
+void BenchConvolve()
+{
+    cout << "Gaussian blur, 4096x4096\n";
+    BenchConvolveType<BigImage<ImageType<PixelTypeU32, TileBlockManager>>>("U32");
+    BenchConvolveType<ImageRGBA32>("RGBA32");
+    BenchConvolveType<ImageRGBAf>("RGBAf");
+    
+    // Both paths must agree on images with partial tiles and strips
+    const int32_t kWidth = 1000, kHeight = 700;
+    const float kSigma = 6.0f;
+    std::vector<uint32_t> fir(size_t(kWidth)*kHeight), iir(fir.size());
+    for(int pass = 0; pass < 2; ++pass)
+    {
+        ImageRGBA32 img(kWidth, kHeight, "");
+        img.EachPixelXY([](int32_t x, int32_t y, uint32_t & pix){
+            pix = ((x*y)*2654435761u) | 0xFF000000u;
+        });
+        if(pass == 0)
+            bigimage::GaussianBlurFIR(img, kSigma);
+        else
+            bigimage::GaussianBlurIIR(img, kSigma);
+        img.GetPixels<PixelTypeRGBA32>(Rect(0, 0, kWidth, kHeight), (pass == 0)? &fir[0] : &iir[0]);
+    }
+    int maxDiff = 0;
+    for(size_t p = 0; p < fir.size(); ++p)
+        for(int shift = 0; shift < 32; shift += 8)
+            maxDiff = std::max(maxDiff, std::abs(int((fir[p] >> shift) & 0xFF) - int((iir[p] >> shift) & 0xFF)));
+    cout << format("RGBA32 %dx%d, sigma %.1f: IIR differs from FIR by at most %d\n")% kWidth % kHeight % kSigma % maxDiff;
+}
+
+
+// *****************************************************************************
+// Image pyramid: building all levels of a file-backed image with each filter,
+// then reopening the pyramid, which finds the levels already built.
+void BenchPyramid()
+{
+    const int32_t kSize = 8192;
+    const char * kPath = "bench_pyramid.work";
+    const char * kLevelsPath = "bench_pyramid.levels";
+    ImageRGBA32 img(kSize, kSize, kPath);
+    img.EachPixelXY([](int32_t x, int32_t y, uint32_t & pix){pix = uint32_t(x*y)*2654435761u;});
+    cout << format("Image pyramid, %dx%d RGBA32\n")% kSize % kSize;
+    for(auto filter : {bigimage::kPyramidBox, bigimage::kPyramidLanczos})
+    {
+        double tbuild, treopen;
+        int32_t nlevels;
+        {
+            bigimage::BigImagePyramid<ImageRGBA32> pyr(img, kLevelsPath, filter);
+            nlevels = pyr.NumLevels();
+            tbuild = Time([&]{pyr.Level(nlevels - 1);});
+        }
+        {
+            treopen = Time([&]{
+                bigimage::BigImagePyramid<ImageRGBA32> pyr(img, kLevelsPath, filter);
+                pyr.Level(nlevels - 1);
+            });
+        }
+        cout << format("%-8s %d levels built in %8.1f ms (%7.1f Mpix/s of source), reopened in %6.2f ms\n")
+            % ((filter == bigimage::kPyramidBox)? "box" : "lanczos") % nlevels % (tbuild*1e3)
+            % (double(kSize)*kSize*4/3/1e6/tbuild) % (treopen*1e3);
+        std::remove(kLevelsPath);
+        for(int32_t l = 1; l < nlevels; ++l)
+            std::remove((format("%s.%d")% kLevelsPath % l).str().c_str());
+    }
+    std::remove(kPath);
+}
+
+
+// *****************************************************************************
+// Resampling an RGBAf image to larger and smaller sizes with each filter, then
+// between two out of core images with 64 MB tile caches.
+void BenchResample()
+{
+    const int32_t kSize = 4096;
+    const char * names[] = {"bilinear", "mitchell", "lanczos3"};
+    ImageRGBAf src(kSize, kSize, "");
+    src.EachPixelXY([](int32_t x, int32_t y, float4 & pix){pix = float4{float(x), float(y), float(x ^ y), 1.0f};});
+    cout << format("Resample from %dx%d RGBAf\n")% kSize % kSize;
+    for(int32_t dsize : {1536, 6144})
+    {
+        ImageRGBAf dst(dsize, dsize, "");
+        double mpix = double(dsize)*dsize/1e6;
+        for(auto filter : {bigimage::kResampleBilinear, bigimage::kResampleMitchell, bigimage::kResampleLanczos3}) {
+            double t = BestTime(3, [&]{bigimage::Resample(dst, src, filter);});
+            cout << format("to %5d: %-8s %8.1f ms, %8.1f Mpix/s out\n")% dsize % names[filter] % (t*1e3) % (mpix/t);
+        }
+    }
+    
+    typedef BigImage<ImageType<PixelTypeRGBAf, TileCacheManager>> ImageRGBAfC;
+    const char * kSrcPath = "bench_resample_src.work";
+    const char * kDstPath = "bench_resample_dst.work";
+    {
+        ImageRGBAfC csrc(8192, 8192, kSrcPath), cdst(5120, 5120, kDstPath);
+        csrc.GetTileManager().SetBudget(csrc, 64*1024*1024);
+        cdst.GetTileManager().SetBudget(cdst, 64*1024*1024);
+        csrc.EachPixelXY([](int32_t x, int32_t y, float4 & pix){pix = float4{float(x), float(y), float(x ^ y), 1.0f};});
+        auto before = csrc.GetTileManager().GetStats();
+        double t = Time([&]{bigimage::Resample(cdst, csrc, bigimage::kResampleLanczos3);});
+        auto stats = csrc.GetTileManager().GetStats();
+        cout << format("out of core 8192 to 5120 lanczos3: %8.1f ms, %8.1f Mpix/s out, %zu source loads (%zu tiles)\n")
+            % (t*1e3) % (5120.0*5120/1e6/t) % (stats.loads - before.loads) % csrc.GetTiles().size();
+    }
+    std::remove(kSrcPath);
+    std::remove(kDstPath);
+}
+
+
+// *****************************************************************************
+// Warps of an RGBA32 image: a rotation about the center and a perspective
+// correction, which leaves part of the destination outside the source.
+void BenchWarp()
+{
+    const int32_t kSize = 8192;
+    ImageRGBA32 src(kSize, kSize, ""), dst(kSize, kSize, "");
+    src.EachPixelXY([](int32_t x, int32_t y, uint32_t & pix){pix = uint32_t(x*y)*2654435761u;});
+    cout << format("Warp, %dx%d RGBA32\n")% kSize % kSize;
+    
+    double a = 0.2, c = kSize/2.0;
+    mat33d rotation;
+    rotation.rows[0] = mat33d::vec_t{cos(a), -sin(a), c - c*cos(a) + c*sin(a), 0};
+    rotation.rows[1] = mat33d::vec_t{sin(a), cos(a), c - c*sin(a) - c*cos(a), 0};
+    rotation.rows[2] = mat33d::vec_t{0, 0, 1, 0};
+    mat33d perspective;
+    perspective.rows[0] = mat33d::vec_t{1.0, 0.1, 0, 0};
+    perspective.rows[1] = mat33d::vec_t{0.0, 1.2, 0, 0};
+    perspective.rows[2] = mat33d::vec_t{0.5/kSize, 0.2/kSize, 1, 0};
+    
+    double mpix = double(kSize)*kSize/1e6;
+    for(auto filter : {bigimage::kWarpBilinear, bigimage::kWarpBicubic}) {
+        const char * name = (filter == bigimage::kWarpBilinear)? "bilinear" : "bicubic";
+        double t = BestTime(3, [&]{bigimage::Warp(dst, src, rotation, filter);});
+        cout << format("rotation    %-8s %8.1f ms, %8.1f Mpix/s\n")% name % (t*1e3) % (mpix/t);
+        t = BestTime(3, [&]{bigimage::Warp(dst, src, perspective, filter);});
+        cout << format("perspective %-8s %8.1f ms, %8.1f Mpix/s\n")% name % (t*1e3) % (mpix/t);
+    }
+}
+
+
+// *****************************************************************************
+// Targa import of a 32 bit file, reading the whole file into a SimpleImage
+// and setting the image's pixels from it, against streaming it into tiles a
+// tile row at a time.
+void BenchTargaRead()
+{
+    const int32_t kWidth = 8192, kHeight = 4096;
+    const char * kPath = "bench_targa.tga";
+    {
+        SimpleImage simg(kWidth, kHeight, 4);
+        uint32_t * pixels = (uint32_t *)simg.imagedata;
+        for(size_t p = 0; p < size_t(kWidth)*kHeight; ++p)
+            pixels[p] = uint32_t(p)*2654435761u;
+        TargaFileInfo::Write(kPath, simg);
+    }
+    
+    ImageRGBA32 img(kWidth, kHeight, "");
+    double mpix = double(kWidth)*kHeight/1e6;
+    cout << format("Targa read, %dx%d 32 bit\n")% kWidth % kHeight;
+    double t = BestTime(3, [&]{
+        SimpleImage simg;
+        TargaFileInfo tfile;
+        tfile.Read(kPath, simg);
+        img.SetPixels<PixelTypeRGBA32>((const uint32_t *)simg.imagedata);
+    });
+    cout << format("whole file %8.1f ms, %8.1f Mpix/s, %6.1f MB buffered\n")% (t*1e3) % (mpix/t) % (mpix*4);
+    t = BestTime(3, [&]{bigimage::ReadTarga(kPath, img);});
+    cout << format("streaming  %8.1f ms, %8.1f Mpix/s, %6.1f MB buffered\n")% (t*1e3) % (mpix/t)
+        % (double(kWidth)*kTileHeight*4/1e6);
+    std::remove(kPath);
+}
+
+
+// *****************************************************************************
+// Targa export of a 32 bit file, through a linear buffer and
+// TargaFileInfo::Write() against writing bands of tile rows in parallel.
+void BenchTargaWrite()
+{
+    const int32_t kWidth = 8192, kHeight = 4096;
+    const char * kPath = "bench_targa.tga";
+    ImageRGBA32 img(kWidth, kHeight, "");
+    img.EachPixelXY([](int32_t x, int32_t y, uint32_t & pix){pix = uint32_t(x*y)*2654435761u;});
+    double mpix = double(kWidth)*kHeight/1e6;
+    cout << format("Targa write, %dx%d 32 bit\n")% kWidth % kHeight;
+    double t = BestTime(3, [&]{
+        std::vector<uint32_t> pixels(size_t(kWidth)*kHeight);
+        img.GetPixels<PixelTypeRGBA32>(&pixels[0]);
+        TargaFileInfo tfile(kWidth, kHeight, 32);
+        tfile.Write(kPath, (uint8_t *)&pixels[0]);
+    });
+    cout << format("whole image %8.1f ms, %8.1f Mpix/s, %6.1f MB buffered\n")% (t*1e3) % (mpix/t) % (mpix*4);
+    for(int32_t depth : {32, 24}) {
+        t = BestTime(3, [&]{bigimage::WriteTarga(kPath, img, depth);});
+        cout << format("streaming   %8.1f ms, %8.1f Mpix/s, %6.1f MB buffered per worker, %d bit\n")
+            % (t*1e3) % (mpix/t) % (double(kWidth)*kTileHeight*depth/8/1e6) % depth;
+    }
+    std::remove(kPath);
+}
+
+
+// *****************************************************************************
+// Targa export and import of a matte, flat regions of color with a few
+// hundred edges per row, uncompressed and RLE, as 8 bit gray and 32 bit.
+void BenchTargaRLE()
+{
+    const int32_t kWidth = 8192, kHeight = 4096;
+    const char * kPath = "bench_targa_rle.tga";
+    // Gray levels of a grid of discs on a checkerboard
+    auto matte = [](int32_t x, int32_t y) -> uint32_t {
+        int32_t cx = x/512*512 + 256, cy = y/512*512 + 256;
+        if((x - cx)*(x - cx) + (y - cy)*(y - cy) < 200*200)
+            return 0xFFFFFFFF;
+        return ((x/512 + y/512) & 1)? 0 : 0x40404040;
+    };
+    typedef BigImage<ImageType<PixelTypeU32, TileBlockManager>> ImageU32;
+    ImageRGBA32 img(kWidth, kHeight, "");
+    ImageU32 gray(kWidth, kHeight, "");
+    img.EachPixelXY([&](int32_t x, int32_t y, uint32_t & pix){pix = matte(x, y) | 0xFF000000;});
+    gray.EachPixelXY([&](int32_t x, int32_t y, uint32_t & pix){pix = matte(x, y);});
+    
+    double mpix = double(kWidth)*kHeight/1e6;
+    cout << format("Targa RLE, %dx%d matte\n")% kWidth % kHeight;
+    for(int32_t depth : {8, 32})
+    for(bool rle : {false, true})
+    {
+        double tw, tr;
+        if(depth == 8) {
+            tw = BestTime(3, [&]{bigimage::WriteTarga(kPath, gray, depth, rle);});
+            tr = BestTime(3, [&]{bigimage::ReadTarga(kPath, gray);});
+        }
+        else {
+            tw = BestTime(3, [&]{bigimage::WriteTarga(kPath, img, depth, rle);});
+            tr = BestTime(3, [&]{bigimage::ReadTarga(kPath, img);});
+        }
+        FILE * f = fopen(kPath, "rb");
+        fseek(f, 0, SEEK_END);
+        double mb = ftell(f)/1e6;
+        fclose(f);
+        cout << format("%2d bit %-4s %8.1f MB, write %7.1f ms (%7.1f Mpix/s), read %7.1f ms (%7.1f Mpix/s)\n")
+            % depth % (rle? "rle" : "raw") % mb % (tw*1e3) % (mpix/tw) % (tr*1e3) % (mpix/tr);
+    }
+    std::remove(kPath);
+}
+
+
+// *****************************************************************************
+// Reopening a file-backed image, against importing the same pixels from a
+// Targa file, timed to the end of a first pass summing the pixels. Opening maps
+// the tiles in place, so only the pages the pass touches are read.
+void BenchReopen()
+{
+    const int32_t kWidth = 8192, kHeight = 4096;
+    const char * kPath = "bench_reopen.work";
+    const char * kTargaPath = "bench_reopen.tga";
+    {
+        ImageRGBA32 img(kWidth, kHeight, kPath);
+        img.EachPixelXY([](int32_t x, int32_t y, uint32_t & pix){pix = uint32_t(x*y)*2654435761u;});
+        img.GetTileManager().Flush(img);
+        bigimage::WriteTarga(kTargaPath, img);
+    }
+    
+    auto toSum = [](uint32_t p){return uint64_t(p);};
+    double mpix = double(kWidth)*kHeight/1e6;
+    uint64_t sums[4];
+    cout << format("Reopen, %dx%d RGBA32\n")% kWidth % kHeight;
+    double t = BestTime(3, [&]{
+        ImageRGBA32 img(kWidth, kHeight, "");
+        bigimage::ReadTarga(kTargaPath, img);
+        sums[0] = img.TransformReduce(toSum, bigimage::SumReducer<uint64_t>());
+    });
+    cout << format("Targa import:        %8.1f ms, %8.1f Mpix/s\n")% (t*1e3) % (mpix/t);
+    t = BestTime(3, [&]{ImageRGBA32 img(kPath, bigimage::kTileFileReadOnly);});
+    cout << format("open only:           %8.1f ms\n")% (t*1e3);
+    t = BestTime(3, [&]{
+        ImageRGBA32 img(kPath, bigimage::kTileFileReadOnly);
+        sums[1] = img.TransformReduce(toSum, bigimage::SumReducer<uint64_t>());
+    });
+    cout << format("open read-only:      %8.1f ms, %8.1f Mpix/s\n")% (t*1e3) % (mpix/t);
+    t = BestTime(3, [&]{
+        ImageRGBA32 img(kPath, bigimage::kTileFileReadWrite);
+        sums[2] = img.TransformReduce(toSum, bigimage::SumReducer<uint64_t>());
+    });
+    cout << format("open read-write:     %8.1f ms, %8.1f Mpix/s\n")% (t*1e3) % (mpix/t);
+    t = BestTime(3, [&]{
+        ImageRGBA32C img(kPath, bigimage::kTileFileReadOnly);
+        sums[3] = img.TransformReduce(toSum, bigimage::SumReducer<uint64_t>());
+    });
+    cout << format("open cache manager:  %8.1f ms, %8.1f Mpix/s\n")% (t*1e3) % (mpix/t);
+    if(sums[1] != sums[0] || sums[2] != sums[0] || sums[3] != sums[0])
+        cout << "sums differ\n";
+    std::remove(kPath);
+    std::remove(kTargaPath);
+}
+
+
+// *****************************************************************************
+// Compressed tile store against the plain tile cache, for 4k x 4k RGBAf images
+// of two kinds. Photographic: smooth detail at several scales with grain,
+// quantized to 8 bits per channel as from a camera, or the Targa file named
+// by BENCH_TARGA. Synthetic: gradients and flat shapes. Each image is written
+// through a 64 MB tile cache, dropped from the page cache, then read back in a
+// summing pass, so the read bandwidth includes reading the file from disk.
+// Bandwidth is of uncompressed pixels.
+
+// Drop file's pages from the page cache
+static void DropCache(const char * path)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+// Smooth pseudorandom values in [0, 1), interpolated from a lattice of the
+// given spacing
+static float ValueNoise(int32_t x, int32_t y, int32_t spacing, uint32_t seed)
+{
+    auto lattice = [&](int32_t i, int32_t j) {
+        uint32_t h = (uint32_t(i)*73856093u) ^ (uint32_t(j)*19349663u) ^ (seed*83492791u);
+        h = (h ^ (h >> 13))*2654435761u;
+        return float(h >> 8)/float(1 << 24);
+    };
+    int32_t i = x/spacing, j = y/spacing;
+    float fx = float(x % spacing)/spacing, fy = float(y % spacing)/spacing;
+    float top = lattice(i, j) + fx*(lattice(i + 1, j) - lattice(i, j));
+    float bottom = lattice(i, j + 1) + fx*(lattice(i + 1, j + 1) - lattice(i, j + 1));
+    return top + fy*(bottom - top);
+}
+
+// Write src to an image of type imgT backed by path, then read it back cold
+template<typename imgT>
+void BenchCompressedStore(const char * name, const char * store, ImageRGBAf & src, const char * path, size_t budget)
+{
+    double mb = double(src.Width())*src.Height()*sizeof(float4)/1e6;
+    auto toSum = [](const float4 & p){return double(p[0]) + p[1] + p[2] + p[3];};
+    double expected = src.TransformReduce(toSum, bigimage::SumReducer<double>());
+    double tw = Time([&]{
+        imgT img(src.Width(), src.Height(), path);
+        img.GetTileManager().SetBudget(img, budget);
+        EachTileZip(img, src, [](typename imgT::TileInfo & dti, ImageRGBAf::TileInfo & sti){
+            *dti.pixels = *sti.pixels;
+        });
+        img.GetTileManager().Flush(img);
+    });
+    FILE * f = fopen(path, "rb");
+    fseek(f, 0, SEEK_END);
+    double fileMB = ftell(f)/1e6;
+    fclose(f);
+    DropCache(path);
+    double sum = 0;
+    double tr = Time([&]{
+        imgT img(path, bigimage::kTileFileReadOnly);
+        img.GetTileManager().SetBudget(img, budget);
+        sum = img.TransformReduce(toSum, bigimage::SumReducer<double>());
+    });
+    cout << format("%-12s %-10s %7.1f MB, ratio %5.2f, write %7.1f ms, read %7.1f ms (%7.1f MB/s)%s\n")
+        % name % store % fileMB % (mb/fileMB) % (tw*1e3) % (tr*1e3) % (mb/tr) % ((sum == expected)? "" : ", sum differs");
+    std::remove(path);
+}
+
+void BenchCompressed()
+{
+    typedef BigImage<ImageType<PixelTypeRGBAf, TileCacheManager>> ImageRGBAfC;
+    typedef BigImage<ImageType<PixelTypeRGBAf, TileCompressedManager>> ImageRGBAfZ;
+    const int32_t kSize = 4096;
+    const size_t kBudget = 64*1024*1024;
+    const char * kPath = "bench_compressed.work";
+    
+    auto photo = [](int32_t x, int32_t y, float4 & pix){
+        float v[3];
+        for(uint32_t c = 0; c < 3; ++c) {
+            float n = 0.5f*ValueNoise(x, y, 512, c) + 0.3f*ValueNoise(x, y, 64, c + 3) + 0.2f*ValueNoise(x, y, 8, c + 6);
+            int32_t grain = int32_t((uint32_t(x*y + x)*2654435761u) >> 29) - 4;
+            v[c] = std::min(std::max(int32_t(n*240) + grain, 0), 255)/255.0f;
+        }
+        pix = float4{v[0], v[1], v[2], 1.0f};
+    };
+    auto synthetic = [](int32_t x, int32_t y, float4 & pix){
+        int32_t cx = x/512*512 + 256, cy = y/512*512 + 256;
+        bool disc = (x - cx)*(x - cx) + (y - cy)*(y - cy) < 200*200;
+        pix = disc? float4{1.0f, 0.5f, 0.25f, 1.0f} : float4{x/float(kSize), y/float(kSize), 0.5f, 1.0f};
+    };
+    
+    auto run = [&](const char * name, ImageRGBAf & src){
+        BenchCompressedStore<ImageRGBAfC>(name, "cache", src, kPath, kBudget);
+        BenchCompressedStore<ImageRGBAfZ>(name, "compressed", src, kPath, kBudget);
+    };
+    
+    cout << format("Compressed tile store, RGBAf, %d MB tile cache\n")% (kBudget >> 20);
+    if(const char * targa = getenv("BENCH_TARGA")) {
+        bigimage::TargaReader reader(targa);
+        ImageRGBAf src(reader.Width(), reader.Height(), "");
+        reader.Read(src);
+        run("Targa file", src);
+    }
+    else {
+        ImageRGBAf src(kSize, kSize, "");
+        src.EachPixelXY(photo);
+        run("photographic", src);
+    }
+    ImageRGBAf src(kSize, kSize, "");
+    src.EachPixelXY(synthetic);
+    run("synthetic", src);
+}
+
+
+int main(int argc, char * argv[])
+{
+    std::map<std::string, std::function<void()>> benchmarks = {
+        {"eachtile", BenchEachTileScaling},
+        {"smallrect", BenchSmallRectGetPixels},
+        {"neighborhood", BenchNeighborhood},
+        {"outofcore", BenchOutOfCore},
+        {"stencil", BenchStencil},
+        {"copypixels", BenchCopyPixels},
+        {"dispatch", BenchDispatch},
+        {"reduce", BenchReduce},
+        {"zip", BenchZip},
+        {"fused", BenchFused},
+        {"pull", BenchPull},
+        {"apron", BenchApron},
+        {"convolve", BenchConvolve},
+        {"pyramid", BenchPyramid},
+        {"resample", BenchResample},
+        {"warp", BenchWarp},
+        {"tgaread", BenchTargaRead},
+        {"tgawrite", BenchTargaWrite},
+        {"tgarle", BenchTargaRLE},
+        {"reopen", BenchReopen},
+        {"compressed", BenchCompressed},
+    };
+    
+    try {
+        if(argc < 2) {
+            // Run everything
+            for(auto & b : benchmarks)
+                b.second();
+        }
+        for(int j = 1; j < argc; ++j)
+        {
+            auto b = benchmarks.find(argv[j]);
+            if(b == benchmarks.end()) {
+                cerr << format("unknown benchmark \"%s\", available:\n")% argv[j];
+                for(auto & b : benchmarks)
+                    cerr << "    " << b.first << endl;
+                return EXIT_FAILURE;
+            }
+            b->second();
+        }
+    }
+    catch(std::exception & err) {
+        cerr << "exception caught: " << err.what() << endl;
+    }
+    return EXIT_SUCCESS;
+}
@@ -209,11 +209,7 @@ void TestBigImage()
     });
     
     
-    uint32_t * pixels = new uint32_t[img.Width()*img.Height()];
-    img.GetPixels<PixelTypeRGBA32>(pixels);
-    
-    TargaFileInfo tfile(img.Width(), img.Height(), 32);
-    tfile.Write("test.tga", (uint8_t*)pixels);
+    bigimage::WriteTarga("test.tga", img);
     
     img.PrintInfo();
     
@@ -189,14 +189,7 @@ typedef BasicImage::TileInfo BasicTile;
 
 void WriteImage(BasicImage & img, const std::string & fname)
 {
-    uint32_t * pixels = new uint32_t[img.Width()*img.Height()];
-    
-    img.GetPixels<PixelTypeRGBA32>(pixels);
-    
-    TargaFileInfo tfile(img.Width(), img.Height(), 32);
-    tfile.Write(fname, (uint8_t*)pixels);
-    
-    delete pixels;
+    bigimage::WriteTarga(fname, img);
 }
 
 
@@ -16,17 +16,26 @@ using namespace std;
 
 namespace filestore {
 
-MappedFile::MappedFile(const std::string & fpath, size_t fsize, size_t msize):
+MappedFile::MappedFile(const std::string & fpath, size_t fsize, size_t msize, bool ronly):
     filePath(fpath),
     fd(0),
-    baseAddr(nullptr)
+    baseAddr(nullptr),
+    fileSize(0), mapSize(0),
+    readOnly(ronly)
 {
-    fd = open(filePath.c_str(), O_RDWR | O_CREAT, (mode_t)0600);
+    fd = readOnly? open(filePath.c_str(), O_RDONLY) : open(filePath.c_str(), O_RDWR | O_CREAT, (mode_t)0600);
     if(fd < 0)
         throw std::runtime_error((format("Could not open file \"%s\": %s")% filePath % strerror(errno)).str());
     Remap(fsize, msize);
 }
 
+MappedFile::~MappedFile()
+{
+    if(baseAddr)
+        munmap(baseAddr, mapSize);
+    close(fd);
+}
+
 void MappedFile::Remap(size_t fsize, size_t msize)
 {
     // cerr << format(">>MappedFile::Remap(%u, %u)\n")% fsize % msize;
@@ -34,6 +43,8 @@ void MappedFile::Remap(size_t fsize, size_t msize)
     // Get file size, and expand if needed
     uint64_t s = lseek(fd, 0, SEEK_END);
     fileSize = (fsize == 0)? s : fsize;
+    if(s < fileSize && readOnly)
+        throw std::runtime_error((format("File \"%s\" is too short, %u B of %u B")% filePath % s % fileSize).str());
     if(s < fileSize) {
         if(lseek(fd, fileSize - 1, SEEK_SET) == -1)
             throw std::runtime_error((format("Could not seek to end of file \"%s\": %s")% filePath % strerror(errno)).str());
@@ -50,10 +61,11 @@ void MappedFile::Remap(size_t fsize, size_t msize)
     mapSize = msize;
     // cerr << format("region(0x%x)\n")% ((size_t)baseAddr);
     // MAP_SHARED or MAP_FILE?
+    int flags = readOnly? MAP_PRIVATE : MAP_SHARED;
     if(baseAddr)
-        baseAddr = mmap(baseAddr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+        baseAddr = mmap(baseAddr, mapSize, PROT_READ | PROT_WRITE, flags | MAP_FIXED, fd, 0);
     else
-        baseAddr = mmap(0, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        baseAddr = mmap(0, mapSize, PROT_READ | PROT_WRITE, flags, fd, 0);
     if(baseAddr == MAP_FAILED)
         throw std::runtime_error((format("Could not map file \"%s\": %s")% filePath % strerror(errno)).str());
     
@@ -92,6 +104,8 @@ void MappedFile::Remap(size_t fsize, size_t msize)
 // }
 
 void MappedFile::Flush() {
+    if(readOnly)
+        return;
     msync(baseAddr, mapSize, MS_SYNC);
     // region.flush();
 }
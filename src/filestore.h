@@ -66,8 +66,12 @@ struct MappedFile {
     // boost::interprocess::mapped_region region;
     void * baseAddr;
     size_t fileSize, mapSize;
+    bool readOnly;
     
-    MappedFile(const std::string & fpath, size_t fsize, size_t msize);
+    // Read-only files are never written: they are mapped copy-on-write, so
+    // changes to mapped data stay in memory, and are never expanded.
+    MappedFile(const std::string & fpath, size_t fsize, size_t msize, bool ronly = false);
+    ~MappedFile();
     
     size_t FileSize() const {return fileSize;}
     size_t MemSize() const {return mapSize;}
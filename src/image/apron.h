@@ -0,0 +1,157 @@
+
+// Neighborhood access for stencil kernels. EachTileApron() hands the kernel a
+// contiguous copy of each source tile surrounded by an apron of radius pixels
+// gathered from the neighboring tiles, so kernels index neighbors directly
+// rather than looking up the tile of every pixel they read, as
+// BigImage::GetPixel() does. Pixels beyond the edges of the image are
+// supplied according to an edge mode.
+//
+// Apron buffers come from a tile pool, so each worker reuses its own buffers
+// from tile to tile.
+
+#ifndef APRON_H
+#define APRON_H
+
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include "tile.h"
+#include "tilepool.h"
+
+namespace bigimage {
+
+// Source of pixels beyond the edges of the image
+enum EdgeMode {
+    kEdgeClamp,// nearest edge pixel
+    kEdgeWrap,// pixel from the opposite side
+    kEdgeConstant// fill value
+};
+
+// Tile with apron. Coordinates are relative to the tile origin, in
+// [-radius, kTileWidth + radius) x [-radius, kTileHeight + radius).
+template<typename pixel_val_t>
+struct Apron {
+    const pixel_val_t * origin;// pixel 0, 0 of the tile
+    int32_t stride;// pixels per row
+    int32_t radius;
+    
+    const pixel_val_t & operator()(int32_t x, int32_t y) const {return origin[y*stride + x];}
+    const pixel_val_t * Row(int32_t y) const {return origin + y*stride;}
+};
+
+// Map coordinate c to [0, n) by edge mode, or -1 for fill
+inline int32_t EdgeCoord(int32_t c, int32_t n, EdgeMode edge)
+{
+    if(c >= 0 && c < n)
+        return c;
+    switch(edge) {
+        case kEdgeClamp: return std::min(std::max(c, 0), n - 1);
+        case kEdgeWrap: return (c % n + n) % n;
+        default: return -1;
+    }
+}
+
+// Copy w x h pixels of src from x0, y0 into buf, with rows of w pixels. Pixels
+// beyond the edges of src are supplied according to edge. Source tiles
+// involved are prepared for reading while gathering.
+template<typename imgT>
+void GatherRect(imgT & src, int32_t x0, int32_t y0, int32_t w, int32_t h, EdgeMode edge,
+                const typename imgT::pixel_val_t & fill, typename imgT::pixel_val_t * buf)
+{
+    typedef typename imgT::pixel_val_t pixel_val_t;
+    const int32_t sw = src.Width(), sh = src.Height();
+    const int32_t xtiles = (sw + kTileWidth - 1)/kTileWidth;
+    
+    // Source tile rows and columns touched
+    std::vector<int32_t> trows, tcols;
+    for(int32_t y = y0; y < y0 + h; ++y) {
+        int32_t sy = EdgeCoord(y, sh, edge);
+        if(sy >= 0 && std::find(trows.begin(), trows.end(), sy/kTileHeight) == trows.end())
+            trows.push_back(sy/kTileHeight);
+    }
+    for(int32_t x = x0; x < x0 + w; ++x) {
+        int32_t sx = EdgeCoord(x, sw, edge);
+        if(sx >= 0 && std::find(tcols.begin(), tcols.end(), sx/kTileWidth) == tcols.end())
+            tcols.push_back(sx/kTileWidth);
+    }
+    for(int32_t ty : trows)
+        for(int32_t tx : tcols)
+            src.PrepareTile(src.GetTiles()[ty*xtiles + tx], kAccessRead);
+    
+    // Columns within the image are copied in spans along tile rows, those
+    // beyond it pixel by pixel
+    int32_t xin0 = std::min(std::max(x0, 0), x0 + w), xin1 = std::max(std::min(x0 + w, sw), xin0);
+    for(int32_t j = 0; j < h; ++j)
+    {
+        pixel_val_t * row = buf + j*w;
+        int32_t sy = EdgeCoord(y0 + j, sh, edge);
+        if(sy < 0) {
+            std::fill(row, row + w, fill);
+            continue;
+        }
+        for(int32_t x = x0; x < xin0; ++x) {
+            int32_t sx = EdgeCoord(x, sw, edge);
+            row[x - x0] = (sx < 0)? fill : src.GetPixel(sx, sy);
+        }
+        for(int32_t x = xin0; x < xin1;) {
+            int32_t xend = std::min((x/kTileWidth + 1)*kTileWidth, xin1);
+            auto & ti = src.GetTile(x, sy);
+            std::copy(&src.GetPixel(ti, x, sy), &src.GetPixel(ti, x, sy) + (xend - x), row + (x - x0));
+            x = xend;
+        }
+        for(int32_t x = xin1; x < x0 + w; ++x) {
+            int32_t sx = EdgeCoord(x, sw, edge);
+            row[x - x0] = (sx < 0)? fill : src.GetPixel(sx, sy);
+        }
+    }
+    
+    for(int32_t ty : trows)
+        for(int32_t tx : tcols)
+            src.ReleaseTile(src.GetTiles()[ty*xtiles + tx], kAccessRead);
+}
+
+// Copy tile of src at x0, y0 with apron of rx pixels horizontally and ry
+// vertically into buf, with rows of kTileWidth + 2*rx pixels.
+template<typename imgT>
+void GatherApron(imgT & src, int32_t x0, int32_t y0, int32_t rx, int32_t ry, EdgeMode edge,
+                 const typename imgT::pixel_val_t & fill, typename imgT::pixel_val_t * buf)
+{
+    GatherRect(src, x0 - rx, y0 - ry, kTileWidth + 2*rx, kTileHeight + 2*ry, edge, fill, buf);
+}
+
+template<typename imgT>
+void GatherApron(imgT & src, int32_t x0, int32_t y0, int32_t r, EdgeMode edge,
+                 const typename imgT::pixel_val_t & fill, typename imgT::pixel_val_t * buf)
+{
+    GatherApron(src, x0, y0, r, r, edge, fill, buf);
+}
+
+// Iterate over tiles of dst with the corresponding tiles of src, calling
+// function of form:
+// void(dst::TileInfo & dst, const Apron<src::pixel_val_t> & src)
+// The apron has the pixels of src within radius of the tile. Images must be
+// the same size, and must be distinct, as tiles of src are read while others
+// are being processed.
+template<typename dimgT, typename simgT, typename fnT>
+void EachTileApron(dimgT & dst, simgT & src, int32_t radius, const fnT & fn,
+                   EdgeMode edge = kEdgeClamp,
+                   const typename simgT::pixel_val_t & fill = typename simgT::pixel_val_t(),
+                   TileAccess access = kAccessWrite)
+{
+    typedef typename simgT::pixel_val_t spixel_val_t;
+    if(static_cast<void *>(&dst) == static_cast<void *>(&src))
+        throw std::runtime_error("EachTileApron(): source and destination must be distinct images");
+    
+    const int32_t stride = kTileWidth + 2*radius;
+    TilePool aprons;
+    EachTileZip(dst, src, [&](typename dimgT::TileInfo & dti, typename simgT::TileInfo & sti){
+        spixel_val_t * buf = static_cast<spixel_val_t *>(aprons.Alloc(stride*(kTileHeight + 2*radius)*sizeof(spixel_val_t)));
+        GatherApron(src, sti.x, sti.y, radius, edge, fill, buf);
+        fn(dti, Apron<spixel_val_t>{buf + radius*stride + radius, stride, radius});
+        aprons.Free(buf);
+    }, access);
+}
+
+} // namespace bigimage
+#endif // APRON_H
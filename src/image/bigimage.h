@@ -5,9 +5,12 @@
 // image as a contiguous block, allowing efficient use of caches.
 // 
 // Tile managers allow use of different strategies for data layout to preserve
-// locality, reduce copying, etc. Hooks may eventually be added to allow
-// preloading, limit memory usage, etc, currently simple on-demand paging is
-// implemented via memory mapping.
+// locality, reduce copying, etc. Most rely on simple on-demand paging via
+// memory mapping; TileCacheManager instead pages tiles explicitly within a
+// fixed memory budget, with read-ahead and hooks for preloading, and
+// TileCompressedManager does the same with tiles compressed. Backing files
+// describe the images they hold, so file-backed images may be opened again
+// later, see tilefile.h.
 //
 // Image types are defined with a tile manager and a pixel type, which describes
 // not only the datatype of the pixel but also information such as numeric limits,
@@ -28,9 +31,8 @@
 
 #include <functional>
 #include <utility>
-#include <thread>
 #include <atomic>
-#include <mutex>
+#include <stdexcept>
 
 #include <boost/format.hpp>
 
@@ -39,16 +41,28 @@
 #include "pixeltype.h"
 #include "tile.h"
 #include "tilemanager.h"
+#include "sparsemanager.h"
+#include "cachemanager.h"
+#include "swapmanager.h"
+#include "compressedmanager.h"
 #include "imageproc.h"
+#include "reducers.h"
+#include "pixelexpr.h"
+#include "pullgraph.h"
+#include "apron.h"
+#include "convolve.h"
+#include "pyramid.h"
+#include "resample.h"
+#include "warp.h"
+#include "targa_stream.h"
 #include "rect.h"
+#include "workerpool.h"
 
 namespace bigimage {
 using boost::format;
 using std::cerr;
 using std::endl;
 
-const int kNThreads = 16;
-
 
 // *****************************************************************************
 // Image types
@@ -93,16 +107,29 @@ class BigImage {
     std::vector<TileInfo *> torder;
     int32_t width, height;
     int32_t xtiles, ytiles;
+    size_t grainSize;
     
     
   public:
     BigImage(int32_t w, int32_t h, const std::string & backingFilePath);
+    // Open the image in an existing image file, the backing file of an image
+    // with the same pixel type and a tile manager of the same file layout. The
+    // tiles are used in place, without importing.
+    BigImage(const std::string & filePath, TileFileMode mode);
     ~BigImage();
     
     int32_t Width() const {return width;}
     int32_t Height() const {return height;}
     std::tuple<int32_t, int32_t> Size() const {return std::make_tuple(width, height);}
     
+    typename image_t::TileManager & GetTileManager() {return tileManager;}
+    
+    // Minimum number of tiles claimed by a worker at a time by the tile
+    // traversal functions. Larger claims are made early in a pass, shrinking
+    // toward this as the pass nears completion. 0 (the default) is 1 tile.
+    size_t GrainSize() const {return grainSize;}
+    void SetGrainSize(size_t tilesPerChunk) {grainSize = tilesPerChunk;}
+    
     // Get vector of linear-ordered tiles.
     // Intended for efficient look-up of tiles by location.
     std::vector<TileInfo> & GetTiles() {return tinfo;}
@@ -123,32 +150,79 @@ class BigImage {
     // Coordinates may be relative to either image or tile origin.
     pixel_val_t & GetPixel(TileInfo & tile, int32_t x, int32_t y);
     
+    // Prepare tile for access outside of the tile traversal functions, such as
+    // writes through GetPixel(). Returns false if the tile manager has nothing
+    // to prepare for the given access. Each prepared tile must be released
+    // once done with, which allows paging tile managers to evict it.
+    bool PrepareTile(TileInfo & tile, TileAccess access = kAccessWrite) {
+        return tileManager.PrepareTile(*this, tile, access);
+    }
+    void ReleaseTile(TileInfo & tile, TileAccess access = kAccessWrite) {
+        tileManager.ReleaseTile(*this, tile, access);
+    }
+    
     // Iterate over all tiles, calling function of form:
     // void(TileInfo &)
     // void(ctxT &, TileInfo &)
+    // Tiles are processed in parallel on the shared worker pool. threadContexts
+    // must have kNThreads entries, and is indexed by worker ID. Functions are
+    // called through templates, never type-erased, so they can be inlined.
+    // The access declared lets tile managers skip work, such as allocating
+    // storage for tiles that are only read.
     template<typename fnT>
-    void EachTile(const fnT & fn);
+    void EachTile(const fnT & fn, TileAccess access = kAccessWrite);
     
     template<typename ctxT, typename fnT>
-    void EachTile(ctxT * threadContexts, const fnT & fn);
+    void EachTile(ctxT * threadContexts, const fnT & fn, TileAccess access = kAccessWrite);
     
     // Iterate over tiles that intersect given rect, calling function of form:
     // void(TileInfo &)
     // void(ctxT &, TileInfo &)
+    // Only the overlapping tiles are visited, in the tile manager's memory order.
     template<typename fnT>
-    void EachTile(const Rect & rect, const fnT & fn);
+    void EachTile(const Rect & rect, const fnT & fn, TileAccess access = kAccessWrite);
     
     template<typename ctxT, typename fnT>
-    void EachTile(ctxT * threadContexts, const Rect & rect, const fnT & fn);
+    void EachTile(ctxT * threadContexts, const Rect & rect, const fnT & fn, TileAccess access = kAccessWrite);
     
     // Iterate over each pixel, calling function of form void(pixel_val_t & pix)
     template<typename fnT>
-    void EachPixel(const fnT & fn);
+    void EachPixel(const fnT & fn, TileAccess access = kAccessWrite);
     
     // Iterate over each pixel, calling function of form void(int32_t x, int32_t y, pixel_val_t & pix)
     // Coordinates are in image space
     template<typename fnT>
-    void EachPixelXY(const fnT & fn);
+    void EachPixelXY(const fnT & fn, TileAccess access = kAccessWrite);
+    
+    // Iterate over each tile row, calling function of form
+    // void(int32_t x, int32_t y, pixel_val_t * row, int32_t len)
+    // x, y are the image space coordinates of the first of the len pixels in
+    // row. Kernels looping over row vectorize where per-pixel calls may not.
+    template<typename fnT>
+    void EachRow(const fnT & fn, TileAccess access = kAccessWrite);
+    
+    // Iterate over spans of tile rows within rect, with function of the same
+    // form as EachRow().
+    template<typename fnT>
+    void EachSpan(const Rect & rect, const fnT & fn, TileAccess access = kAccessWrite);
+    
+    // Reduce pixels to a single value, see reducers.h. TransformReduce() first
+    // maps each pixel through a function of form value(const pixel_val_t &),
+    // giving the reducer's input. Tiles are reduced in parallel into partial
+    // results for fixed groups of tiles, which are then merged pairwise in
+    // memory order, so the result doesn't depend on scheduling.
+    template<typename reducerT>
+    auto Reduce(const reducerT & reducer) -> typename reducerT::value_t;
+    
+    template<typename reducerT>
+    auto Reduce(const Rect & rect, const reducerT & reducer) -> typename reducerT::value_t;
+    
+    template<typename transformT, typename reducerT>
+    auto TransformReduce(const transformT & transform, const reducerT & reducer) -> typename reducerT::value_t;
+    
+    template<typename transformT, typename reducerT>
+    auto TransformReduce(const Rect & rect, const transformT & transform, const reducerT & reducer)
+        -> typename reducerT::value_t;
     
     // Get pixels as linear pixel data.
     // Pixels array must be allocated by caller.
@@ -179,7 +253,8 @@ BigImage<imageT>::BigImage(int32_t w, int32_t h, const std::string & backingFile
     tileManager(backingFilePath),
     tiles(nullptr),
     width(0), height(0),
-    xtiles(0), ytiles(0)
+    xtiles(0), ytiles(0),
+    grainSize(0)
 {
     width = w;
     height = h;
@@ -188,6 +263,23 @@ BigImage<imageT>::BigImage(int32_t w, int32_t h, const std::string & backingFile
     tiles = tileManager.AllocMain(*this);
 }
 
+template<typename imageT>
+BigImage<imageT>::BigImage(const std::string & filePath, TileFileMode mode):
+    tileManager(filePath, mode),
+    tiles(nullptr),
+    width(0), height(0),
+    xtiles(0), ytiles(0),
+    grainSize(0)
+{
+    // Tile manager checks the rest of the header against its layout
+    TileFileHeader hdr = ReadTileFileHeader(filePath);
+    width = hdr.width;
+    height = hdr.height;
+    xtiles = (width + kTileWidth - 1)/kTileWidth;
+    ytiles = (height + kTileHeight - 1)/kTileHeight;
+    tiles = tileManager.AllocMain(*this);
+}
+
 template<typename imageT>
 BigImage<imageT>::~BigImage()
 {
@@ -216,129 +308,209 @@ auto BigImage<imageT>::GetPixel(TileInfo & tile, int32_t x, int32_t y)
 {
     int32_t px = x % kTileWidth;
     int32_t py = y % kTileHeight;
-    return tile.pixels[py*kTileWidth + px];
+    return (*tile.pixels)[py*kTileWidth + px];
 }
 
 
 template<typename imageT>
 template<typename fnT>
-auto BigImage<imageT>::EachTile(const fnT & fn)
+auto BigImage<imageT>::EachTile(const fnT & fn, TileAccess access)
     -> void
 {
     uint8_t dummyContexts[kNThreads];
-    EachTile(dummyContexts, std::function<void(uint8_t &, TileInfo &)>([fn](uint8_t & ctx, TileInfo & ti){fn(ti);}));
+    EachTile(dummyContexts, [&fn](uint8_t & ctx, TileInfo & ti){fn(ti);}, access);
 }
 
 template<typename imageT>
 template<typename fnT>
-auto BigImage<imageT>::EachTile(const Rect & rect, const fnT & fn)
+auto BigImage<imageT>::EachTile(const Rect & rect, const fnT & fn, TileAccess access)
     -> void
 {
     uint8_t dummyContexts[kNThreads];
-    EachTile(dummyContexts, rect, std::function<void(uint8_t &, TileInfo &)>([fn](uint8_t & ctx, TileInfo & ti){fn(ti);}));
+    EachTile(dummyContexts, rect, [&fn](uint8_t & ctx, TileInfo & ti){fn(ti);}, access);
 }
 
 
 template<typename imageT>
 template<typename ctxT, typename fnT>
-auto BigImage<imageT>::EachTile(ctxT * threadContexts, const fnT & fn)
+auto BigImage<imageT>::EachTile(ctxT * threadContexts, const fnT & fn, TileAccess access)
     -> void
 {
 #if(0)
     for(TileInfo & ti : tinfo)
-        fn(threadContexts[0], ti);
+        if(tileManager.PrepareTile(*this, ti, access)) {
+            fn(threadContexts[0], ti);
+            tileManager.ReleaseTile(*this, ti, access);
+        }
 #else
-    // Each thread gets a lock on the job counter, checks for availability of work,
-    // increments job counter, and releases the lock to do the job.
-    std::vector<std::thread> threads;
-    size_t nextTile = 0;
-    std::mutex tileCtrMtx;
-    size_t ntiles = xtiles*ytiles;
-    
-    for(int tid = 0; tid < kNThreads; ++tid)
-    {
-        threads.emplace_back(std::thread([&](int threadID){
-            tileCtrMtx.lock();
-            while(nextTile < ntiles)
-            {
-                TileInfo & ti = *torder[nextTile++];
-                tileCtrMtx.unlock();
-                fn(threadContexts[threadID], ti);
-                tileCtrMtx.lock();
+    // Workers claim runs of tiles in natural order from an atomic cursor, so
+    // each streams through a contiguous part of the image without locking.
+    WorkerPool::Shared().ParallelForGuided(torder.size(), grainSize, [&](int workerID, size_t begin, size_t end){
+        for(size_t t = begin; t < end; ++t)
+            if(tileManager.PrepareTile(*this, *torder[t], access)) {
+                fn(threadContexts[workerID], *torder[t]);
+                tileManager.ReleaseTile(*this, *torder[t], access);
             }
-            tileCtrMtx.unlock();
-        }, tid));
-    }
-    for(auto & t : threads)
-        t.join();
+    });
 #endif
 }
 
 
 template<typename imageT>
 template<typename ctxT, typename fnT>
-auto BigImage<imageT>::EachTile(ctxT * threadContexts, const Rect & rect, const fnT & fn)
+auto BigImage<imageT>::EachTile(ctxT * threadContexts, const Rect & rect, const fnT & fn, TileAccess access)
     -> void
 {
 #if(0)
     for(TileInfo & ti : tinfo)
-        if(rect.Overlaps(ti.x, ti.y, kTileWidth, kTileHeight))
+        if(rect.Overlaps(ti.x, ti.y, kTileWidth, kTileHeight) && tileManager.PrepareTile(*this, ti, access)) {
             fn(threadContexts[0], ti);
+            tileManager.ReleaseTile(*this, ti, access);
+        }
 #else
-    // Each thread gets a lock on the job counter, checks for availability of work,
-    // increments job counter, and releases the lock to do the job.
-    std::vector<std::thread> threads;
-    size_t nextTile = 0;
-    std::mutex tileCtrMtx;
-    size_t ntiles = xtiles*ytiles;
-    
-    for(int tid = 0; tid < kNThreads; ++tid)
-    {
-        threads.emplace_back(std::thread([&](int threadID){
-            tileCtrMtx.lock();
-            
-            // skip tiles not overlapping rect
-            while(nextTile < ntiles && !rect.Overlaps(torder[nextTile]->x, torder[nextTile]->y, kTileWidth, kTileHeight))
-                ++nextTile;
-            
-            while(nextTile < ntiles)
-            {
-                TileInfo & ti = *torder[nextTile++];
-                tileCtrMtx.unlock();
-                fn(threadContexts[threadID], ti);
-                tileCtrMtx.lock();
+    // Range of tiles overlapping rect, clipped to image
+    int32_t tx0 = std::max(rect.x, 0)/kTileWidth;
+    int32_t ty0 = std::max(rect.y, 0)/kTileHeight;
+    int32_t tx1 = std::min((rect.x + rect.w + kTileWidth - 1)/kTileWidth, xtiles);
+    int32_t ty1 = std::min((rect.y + rect.h + kTileHeight - 1)/kTileHeight, ytiles);
+    if(rect.w <= 0 || rect.h <= 0 || tx0 >= tx1 || ty0 >= ty1)
+        return;
+    
+    std::vector<TileInfo *> rtiles;
+    tileManager.GatherTiles(*this, tx0, ty0, tx1, ty1, rtiles);
+    WorkerPool::Shared().ParallelForGuided(rtiles.size(), grainSize, [&](int workerID, size_t begin, size_t end){
+        for(size_t t = begin; t < end; ++t)
+            if(tileManager.PrepareTile(*this, *rtiles[t], access)) {
+                fn(threadContexts[workerID], *rtiles[t]);
+                tileManager.ReleaseTile(*this, *rtiles[t], access);
             }
-            tileCtrMtx.unlock();
-        }, tid));
-    }
-    for(auto & t : threads)
-        t.join();
+    });
 #endif
 }
 
 
 template<typename imageT>
 template<typename fnT>
-auto BigImage<imageT>::EachPixel(const fnT & fn)
+auto BigImage<imageT>::EachPixel(const fnT & fn, TileAccess access)
     -> void
 {
-    EachTile([fn](TileInfo & ti){
+    EachTile([&fn](TileInfo & ti){
         for(pixel_val_t & p : *ti.pixels)
             fn(p);
-    });
+    }, access);
 }
 
 template<typename imageT>
 template<typename fnT>
-auto BigImage<imageT>::EachPixelXY(const fnT & fn)
+auto BigImage<imageT>::EachPixelXY(const fnT & fn, TileAccess access)
     -> void
 {
-    EachTile([fn](TileInfo & ti){
+    EachTile([&fn](TileInfo & ti){
         int32_t i = 0;
         for(int32_t y = 0; y < kTileHeight; ++y)
         for(int32_t x = 0; x < kTileWidth; ++x)
             fn(ti.x + x, ti.y + y, (*ti.pixels)[i++]);
+    }, access);
+}
+
+template<typename imageT>
+template<typename fnT>
+auto BigImage<imageT>::EachRow(const fnT & fn, TileAccess access)
+    -> void
+{
+    EachTile([&fn](TileInfo & ti){
+        pixel_val_t * row = &(*ti.pixels)[0];
+        for(int32_t y = 0; y < kTileHeight; ++y, row += kTileWidth)
+            fn(ti.x, ti.y + y, row, kTileWidth);
+    }, access);
+}
+
+template<typename imageT>
+template<typename fnT>
+auto BigImage<imageT>::EachSpan(const Rect & rect, const fnT & fn, TileAccess access)
+    -> void
+{
+    EachTile(rect, [&](TileInfo & ti){
+        Rect tr = rect.Intersect(ti.x, ti.y, kTileWidth, kTileHeight);
+        pixel_val_t * row = &(*ti.pixels)[(tr.y - ti.y)*kTileWidth + (tr.x - ti.x)];
+        for(int32_t y = 0; y < tr.h; ++y, row += kTileWidth)
+            fn(tr.x, tr.y + y, row, tr.w);
+    }, access);
+}
+
+template<typename imageT>
+template<typename reducerT>
+auto BigImage<imageT>::Reduce(const reducerT & reducer)
+    -> typename reducerT::value_t
+{
+    return TransformReduce(Rect(0, 0, width, height), [](const pixel_val_t & p){return p;}, reducer);
+}
+
+template<typename imageT>
+template<typename reducerT>
+auto BigImage<imageT>::Reduce(const Rect & rect, const reducerT & reducer)
+    -> typename reducerT::value_t
+{
+    return TransformReduce(rect, [](const pixel_val_t & p){return p;}, reducer);
+}
+
+template<typename imageT>
+template<typename transformT, typename reducerT>
+auto BigImage<imageT>::TransformReduce(const transformT & transform, const reducerT & reducer)
+    -> typename reducerT::value_t
+{
+    return TransformReduce(Rect(0, 0, width, height), transform, reducer);
+}
+
+template<typename imageT>
+template<typename transformT, typename reducerT>
+auto BigImage<imageT>::TransformReduce(const Rect & rect, const transformT & transform, const reducerT & reducer)
+    -> typename reducerT::value_t
+{
+    typedef typename reducerT::value_t value_t;
+    // Partial results are each written by one worker, padded so neighbors
+    // don't share cache lines. Padding is a whole line between values, as
+    // std::vector needn't honor over-alignment before C++17.
+    struct Partial {
+        value_t value;
+        char pad[64];
+    };
+    
+    int32_t tx0 = std::max(rect.x, 0)/kTileWidth;
+    int32_t ty0 = std::max(rect.y, 0)/kTileHeight;
+    int32_t tx1 = std::min((rect.x + rect.w + kTileWidth - 1)/kTileWidth, xtiles);
+    int32_t ty1 = std::min((rect.y + rect.h + kTileHeight - 1)/kTileHeight, ytiles);
+    if(rect.w <= 0 || rect.h <= 0 || tx0 >= tx1 || ty0 >= ty1)
+        return reducer.Init();
+    
+    std::vector<TileInfo *> rtiles;
+    tileManager.GatherTiles(*this, tx0, ty0, tx1, ty1, rtiles);
+    size_t ngroups = (rtiles.size() + kBlockTiles - 1)/kBlockTiles;
+    std::vector<Partial> partials(ngroups, Partial{reducer.Init(), {}});
+    
+    WorkerPool::Shared().ParallelForGuided(ngroups, 1, [&](int workerID, size_t begin, size_t end){
+        for(size_t g = begin; g < end; ++g)
+        for(size_t t = g*kBlockTiles; t < std::min((g + 1)*kBlockTiles, rtiles.size()); ++t)
+        {
+            TileInfo & ti = *rtiles[t];
+            if(!tileManager.PrepareTile(*this, ti, kAccessRead))
+                continue;
+            value_t acc = reducer.Init();
+            Rect tr = rect.Intersect(ti.x, ti.y, kTileWidth, kTileHeight);
+            const pixel_val_t * row = &(*ti.pixels)[(tr.y - ti.y)*kTileWidth + (tr.x - ti.x)];
+            for(int32_t y = 0; y < tr.h; ++y, row += kTileWidth)
+                for(int32_t x = 0; x < tr.w; ++x)
+                    reducer.Accumulate(acc, transform(row[x]));
+            tileManager.ReleaseTile(*this, ti, kAccessRead);
+            reducer.Merge(partials[g].value, acc);
+        }
     });
+    
+    // Pairwise merge in memory order
+    for(size_t stride = 1; stride < ngroups; stride *= 2)
+        for(size_t g = 0; g + stride < ngroups; g += 2*stride)
+            reducer.Merge(partials[g].value, partials[g + stride].value);
+    return partials[0].value;
 }
 
 template<typename imageT>
@@ -354,7 +526,7 @@ auto BigImage<imageT>::GetPixels(const Rect & rect, typename dpixelT::pixel_val_
             CopyPixels<dpixelT, typename imageT::pixel_t>(
                 pixels + (dy + y)*rect.w + dx,
                 &((*ti.pixels)[(ty + y)*kTileWidth + tx]), tr.w);
-    });
+    }, kAccessRead);
 }
 
 template<typename imageT>
@@ -375,8 +547,8 @@ auto BigImage<imageT>::SetPixels(const Rect & rect, const typename dpixelT::pixe
         int32_t dx = tr.x - rect.x, dy = tr.y - rect.y;// source rect coordinates relative to destination rect
         for(int32_t y = 0; y < tr.h; ++y)
             CopyPixels<typename imageT::pixel_t, dpixelT>(
-                &((*ti.pixels)[(ty + y)*kTileWidth + tx],
-                pixels + (dy + y)*rect.w + dx), tr.w);
+                &((*ti.pixels)[(ty + y)*kTileWidth + tx]),
+                pixels + (dy + y)*rect.w + dx, tr.w);
     });
 }
 
@@ -395,5 +567,118 @@ auto BigImage<imageT>::PrintInfo() const -> void
     cerr << format("tiles: %dx%d\n")% xtiles % ytiles;
 }
 
+
+// *****************************************************************************
+// Lockstep traversal of multiple images
+// *****************************************************************************
+
+// Iterate over corresponding tiles of a destination image and one to three
+// source images, calling function of form:
+// void(dst::TileInfo &, src0::TileInfo &, ...)
+// Images must be the same size, but may differ in pixel type and tile manager.
+// Tiles are processed in parallel in the destination's memory order. The
+// destination tile is prepared with the declared access and source tiles for
+// reading. Each run of tiles claimed by a worker is prefetched in all images
+// before any is processed, so reads from the images overlap rather than
+// stalling on each image in turn. The destination may also be a source.
+template<typename dimgT, typename simgT, typename fnT>
+void EachTileZip(dimgT & dst, simgT & src, const fnT & fn, TileAccess access = kAccessWrite);
+
+template<typename dimgT, typename simg0T, typename simg1T, typename fnT>
+void EachTileZip(dimgT & dst, simg0T & src0, simg1T & src1, const fnT & fn, TileAccess access = kAccessWrite);
+
+template<typename dimgT, typename simg0T, typename simg1T, typename simg2T, typename fnT>
+void EachTileZip(dimgT & dst, simg0T & src0, simg1T & src1, simg2T & src2, const fnT & fn,
+                 TileAccess access = kAccessWrite);
+
+// Apply FilterPixels() and BinOp() kernels tile by tile, with function of form
+// void(dst_val_t & dst, const src_val_t & src)
+// void(dst_val_t & dst, const lhs_val_t & lhs, const rhs_val_t & rhs)
+template<typename dimgT, typename simgT, typename fnT>
+void FilterTiles(dimgT & dst, simgT & src, const fnT & fn);
+
+template<typename dimgT, typename limgT, typename rimgT, typename fnT>
+void BinOpTiles(dimgT & dst, limgT & lhs, rimgT & rhs, const fnT & fn);
+
+
+// Prefetch tiles of image at the locations of a run of tiles of another image
+template<typename imgT, typename TileInfoT>
+void PrefetchMatching(imgT & image, TileInfoT * const * run, size_t n)
+{
+    std::vector<typename imgT::TileInfo *> tiles(n);
+    for(size_t j = 0; j < n; ++j)
+        tiles[j] = &image.GetTile(run[j]->x, run[j]->y);
+    image.GetTileManager().Prefetch(image, tiles);
+}
+
+template<typename fnT, typename dimgT, typename... simgTs>
+void EachTileZipN(const fnT & fn, TileAccess access, dimgT & dst, simgTs &... srcs)
+{
+    bool sameSize[] = {(srcs.Size() == dst.Size())...};
+    for(bool s : sameSize)
+        if(!s)
+            throw std::runtime_error((format("EachTileZip(): images differ in size from %dx%d destination")%
+                                      dst.Width() % dst.Height()).str());
+    
+    auto & torder = dst.GetNaturalOrdering();
+    WorkerPool::Shared().ParallelForGuided(torder.size(), dst.GrainSize(), [&](int workerID, size_t begin, size_t end){
+        int prefetched[] = {
+            (PrefetchMatching(dst, &torder[begin], end - begin), 0),
+            (PrefetchMatching(srcs, &torder[begin], end - begin), 0)...
+        };
+        (void)prefetched;
+        for(size_t t = begin; t < end; ++t)
+        {
+            typename dimgT::TileInfo & ti = *torder[t];
+            if(!dst.PrepareTile(ti, access))
+                continue;
+            int prepared[] = {(srcs.PrepareTile(srcs.GetTile(ti.x, ti.y), kAccessRead), 0)...};
+            fn(ti, srcs.GetTile(ti.x, ti.y)...);
+            int released[] = {(srcs.ReleaseTile(srcs.GetTile(ti.x, ti.y), kAccessRead), 0)...};
+            (void)prepared;
+            (void)released;
+            dst.ReleaseTile(ti, access);
+        }
+    });
+}
+
+template<typename dimgT, typename simgT, typename fnT>
+void EachTileZip(dimgT & dst, simgT & src, const fnT & fn, TileAccess access)
+{
+    EachTileZipN(fn, access, dst, src);
+}
+
+template<typename dimgT, typename simg0T, typename simg1T, typename fnT>
+void EachTileZip(dimgT & dst, simg0T & src0, simg1T & src1, const fnT & fn, TileAccess access)
+{
+    EachTileZipN(fn, access, dst, src0, src1);
+}
+
+template<typename dimgT, typename simg0T, typename simg1T, typename simg2T, typename fnT>
+void EachTileZip(dimgT & dst, simg0T & src0, simg1T & src1, simg2T & src2, const fnT & fn,
+                 TileAccess access)
+{
+    EachTileZipN(fn, access, dst, src0, src1, src2);
+}
+
+template<typename dimgT, typename simgT, typename fnT>
+void FilterTiles(dimgT & dst, simgT & src, const fnT & fn)
+{
+    EachTileZip(dst, src, [&fn](typename dimgT::TileInfo & d, typename simgT::TileInfo & s){
+        FilterPixels<typename dimgT::pixel_t, typename simgT::pixel_t>(&(*d.pixels)[0], &(*s.pixels)[0], kTilePixels, fn);
+    });
+}
+
+template<typename dimgT, typename limgT, typename rimgT, typename fnT>
+void BinOpTiles(dimgT & dst, limgT & lhs, rimgT & rhs, const fnT & fn)
+{
+    EachTileZip(dst, lhs, rhs, [&fn](typename dimgT::TileInfo & d, typename limgT::TileInfo & l,
+                                     typename rimgT::TileInfo & r)
+    {
+        BinOp<typename dimgT::pixel_t, typename limgT::pixel_t, typename rimgT::pixel_t>(
+            &(*d.pixels)[0], &(*l.pixels)[0], &(*r.pixels)[0], kTilePixels, fn);
+    });
+}
+
 } // namespace bigimage
 #endif // BIGIMAGE_H
@@ -0,0 +1,459 @@
+
+// Tile cache manager, for images larger than available memory.
+//
+// Tiles are stored in the backing file in the block layout of TileBlockManager,
+// but rather than mapping the file and leaving paging to the kernel, a fixed
+// budget of memory is divided into tile-sized frames and tiles are explicitly
+// read into and written back from those frames.
+//
+// A tile is resident while its pixels pointer is non-null. Tiles are pinned
+// while in use: the tile traversal functions pin each tile around the call to
+// the caller's function, and other access, such as through
+// BigImage::GetPixel(), must be bracketed with BigImage::PrepareTile()/
+// ReleaseTile(). Unpinned tiles are evicted in CLOCK order when a frame is
+// needed, being written back first if modified.
+//
+// Each tile's pins, residency and dirty and CLOCK reference bits share an
+// atomic word, so pinning and unpinning a resident tile is a compare-and-swap
+// with no lock taken. The manager's mutex is only taken for misses, which
+// claim frames and evict tiles by the same compare-and-swap, and to wake
+// threads waiting for frames.
+//
+// Loading the first tile of a block issues read-ahead for the following blocks
+// in memory order, which is the order of the traversal functions, so a pass
+// streams through the file while workers are busy with the tiles already read.
+// Prefetch() allows other access patterns to request read-ahead explicitly.
+//
+// Backing files are image files, see tilefile.h. Images opened read-only never
+// write to the file, so changes to their tiles are lost on eviction.
+
+#ifndef CACHEMANAGER_H
+#define CACHEMANAGER_H
+
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+
+#include <boost/format.hpp>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "tilemanager.h"
+#include "workerpool.h"
+
+namespace bigimage {
+
+// Default memory budget for resident tiles
+const size_t kDefaultCacheBytes = 256*1024*1024;
+// Blocks of read-ahead issued on entering a block
+const int32_t kDefaultPrefetchBlocks = 4;
+
+class TileCacheManager: public TileBlockManager {
+  public:
+    struct Stats {
+        size_t hits, loads, writeBacks;
+    };
+    
+  protected:
+    struct Frame {
+        void * owner;// TileInfo of resident tile, or null
+        int32_t index;// memory index of owner
+    };
+    
+    // Residency word of a tile: kTileDirty, kTileLoading and the flags below,
+    // with the pin count above them
+    enum : uint32_t {
+        kSlotResident = 0x08,// pixels are in a frame
+        kSlotReferenced = 0x10,// CLOCK reference bit of the frame
+        kSlotPin = 0x100// one pin
+    };
+    
+    int fd;
+    FILE * tmpFile;// backing store if no path given
+    off_t dataOffset;// start of tiles in backing store
+    size_t tileBytes;
+    int32_t xtiles, ytiles;
+    int32_t prefetchBlocks;
+    size_t budget;
+    
+    uint8_t * frameData;
+    std::vector<Frame> frames;
+    std::unique_ptr<std::atomic<uint32_t>[]> slots;// residency word of each tile, by memory index
+    size_t clockHand;
+    std::mutex mtx;
+    std::condition_variable changed;// tile finished loading, or unpinned
+    std::atomic<int32_t> waiters;// threads waiting on changed
+    Stats stats;// loads and writeBacks, guarded by mtx
+    std::atomic<size_t> hits;
+    
+    // Memory index of tile, in the block layout
+    template<typename TileInfo>
+    int32_t HomeIndex(const TileInfo & ti) const {return TileIndex(ti.x/kTileWidth, ti.y/kTileHeight, xtiles, ytiles);}
+    
+    // Backing store access. Tiles are stored whole at their memory index in
+    // the data area of the file, managers storing them otherwise override
+    // these.
+    
+    // Open or create the backing store of the image described by hdr
+    virtual void OpenStore(const TileFileHeader & hdr);
+    // Write out anything besides tiles the store needs, and sync the file
+    virtual void SyncStore();
+    virtual void CloseStore();
+    virtual void ReadTile(void * dst, int32_t index);
+    virtual void WriteTile(const void * src, int32_t index);
+    // Advise that count tiles from memory index index will be read soon
+    virtual void AdviseTiles(int32_t index, int32_t count);
+    
+    // Find a frame whose tile may be evicted, and mark that tile as not
+    // resident and loading, setting writeBack if it was modified. Called with
+    // mtx held, waits for tiles to be unpinned if all frames are in use.
+    template<typename TileInfo>
+    size_t ClaimFrame(std::unique_lock<std::mutex> & lock, bool & writeBack);
+    
+    // Pin tile, loading it if not resident
+    template<typename TileInfo>
+    void Pin(TileInfo & ti, TileAccess access);
+    
+    template<typename TileInfo>
+    void Unpin(const TileInfo & ti) {
+        // Waiters count themselves before looking for unpinned tiles, so
+        // either they see this unpin or it sees them
+        uint32_t w = slots[HomeIndex(ti)].fetch_sub(kSlotPin) - kSlotPin;
+        if(w < kSlotPin && waiters > 0) {
+            std::lock_guard<std::mutex> lock(mtx);
+            changed.notify_all();
+        }
+    }
+    
+    void AllocFrames();
+    
+  public:
+    TileCacheManager(const std::string & bfPath, TileFileMode mode = kTileFileCreate):
+        TileBlockManager(bfPath, mode), fd(-1), tmpFile(nullptr), dataOffset(0), tileBytes(0), xtiles(0), ytiles(0),
+        prefetchBlocks(kDefaultPrefetchBlocks), budget(kDefaultCacheBytes),
+        frameData(nullptr), clockHand(0), waiters(0), stats{0, 0, 0}, hits(0)
+    {}
+    virtual ~TileCacheManager() {}
+    
+    // Allocate backing store and initialize tinfo entries. No tiles are
+    // resident initially.
+    template<typename image_t>
+    auto AllocMain(image_t & image) -> typename image_t::Tile *;
+    
+    template<typename Tile>
+    void FreeMain(Tile * tiles);
+    
+    // Set memory budget for resident tiles. All tiles are written back and
+    // evicted, so must not be called while any are pinned. The budget is
+    // raised if needed to allow every worker to pin a few blocks' worth of tiles.
+    template<typename image_t>
+    void SetBudget(image_t & image, size_t bytes);
+    
+    void SetPrefetchBlocks(int32_t blocks) {prefetchBlocks = blocks;}
+    
+    // Write all modified resident tiles to backing store
+    template<typename image_t>
+    void Flush(image_t & image);
+    
+    // Request asynchronous read-ahead of tiles
+    template<typename image_t>
+    void Prefetch(image_t & image, const std::vector<typename image_t::TileInfo *> & tiles);
+    
+    Stats GetStats() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return Stats{hits, stats.loads, stats.writeBacks};
+    }
+    
+    template<typename image_t>
+    void MovePixels(typename image_t::TileInfo & dst, typename image_t::TileInfo & src) {
+        Pin(dst, kAccessWrite);
+        memcpy(dst.pixels, src.pixels, tileBytes);
+        Unpin(dst);
+    }
+    
+    template<typename image_t>
+    bool PrepareTile(image_t & image, typename image_t::TileInfo & ti, TileAccess access) {
+        Pin(ti, access);
+        return true;
+    }
+    
+    template<typename image_t>
+    void ReleaseTile(image_t & image, typename image_t::TileInfo & ti, TileAccess access) {Unpin(ti);}
+};
+
+
+// *****************************************************************************
+// TileCacheManager implementation
+// *****************************************************************************
+
+template<typename image_t>
+auto TileCacheManager::AllocMain(image_t & image) -> typename image_t::Tile *
+{
+    typedef typename image_t::Tile Tile;
+    int32_t width, height;
+    std::tie(width, height) = image.Size();
+    xtiles = (width + kTileWidth - 1)/kTileWidth;
+    ytiles = (height + kTileHeight - 1)/kTileHeight;
+    tileBytes = sizeof(Tile);
+    
+    OpenStore(MakeTileFileHeader(image, kTileLayoutBlock, kBlockWidth, kBlockHeight));
+    
+    std::vector<typename image_t::TileInfo> & tinfo = image.GetTiles();
+    std::vector<typename image_t::TileInfo *> & torder = image.GetNaturalOrdering();
+    tinfo.resize(xtiles*ytiles);
+    torder.resize(xtiles*ytiles);
+    slots.reset(new std::atomic<uint32_t>[xtiles*ytiles]);
+    for(int32_t t = 0; t < xtiles*ytiles; ++t)
+        slots[t] = 0;
+    for(int32_t ty = 0; ty < ytiles; ++ty)
+    for(int32_t tx = 0; tx < xtiles; ++tx)
+    {
+        tinfo[ty*xtiles + tx] = typename image_t::TileInfo(tx*kTileWidth, ty*kTileHeight);
+        torder[TileIndex(tx, ty, xtiles, ytiles)] = &tinfo[ty*xtiles + tx];
+    }
+    
+    AllocFrames();
+    return nullptr;
+}
+
+template<typename Tile>
+void TileCacheManager::FreeMain(Tile * tiles)
+{
+    // Resident tiles are going away along with the image, so only need writing
+    // back, not evicting.
+    typedef TileInfo<typename Tile::image_t> TileInfo_t;
+    for(auto & f : frames) {
+        TileInfo_t * ti = static_cast<TileInfo_t *>(f.owner);
+        if(ti && ti->pixels && (slots[f.index] & kTileDirty))
+            WriteTile(ti->pixels, f.index);
+    }
+    delete[] frameData;
+    frameData = nullptr;
+    frames.clear();
+    CloseStore();
+}
+
+inline void TileCacheManager::OpenStore(const TileFileHeader & hdr)
+{
+    if(backingFilePath != "") {
+        if(fileMode != kTileFileCreate)
+            CheckTileFile(backingFilePath, hdr);
+        if(fileMode == kTileFileReadOnly)
+            fd = open(backingFilePath.c_str(), O_RDONLY);
+        else
+            fd = open(backingFilePath.c_str(), O_RDWR | O_CREAT, (mode_t)0600);
+        if(fd < 0)
+            throw std::runtime_error((boost::format("Could not open file \"%s\": %s")% backingFilePath % strerror(errno)).str());
+        if(fileMode == kTileFileCreate)
+            InitTileFile(fd, hdr, backingFilePath);
+        dataOffset = hdr.dataOffset;
+    }
+    else {
+        if(fileMode != kTileFileCreate)
+            throw std::runtime_error("Opening an image requires a file path");
+        tmpFile = std::tmpfile();
+        if(!tmpFile)
+            throw std::runtime_error("Could not create temporary backing file");
+        fd = fileno(tmpFile);
+        if(ftruncate(fd, off_t(xtiles)*ytiles*tileBytes) != 0)
+            throw std::runtime_error((boost::format("Could not resize backing file: %s")% strerror(errno)).str());
+    }
+}
+
+inline void TileCacheManager::SyncStore()
+{
+    if(fileMode != kTileFileReadOnly)
+        fdatasync(fd);
+}
+
+inline void TileCacheManager::CloseStore()
+{
+    if(tmpFile)
+        fclose(tmpFile);
+    else if(fd >= 0)
+        close(fd);
+    tmpFile = nullptr;
+    fd = -1;
+}
+
+inline void TileCacheManager::ReadTile(void * dst, int32_t index)
+{
+    off_t offset = dataOffset + off_t(index)*tileBytes;
+    if(pread(fd, dst, tileBytes, offset) != (ssize_t)tileBytes)
+        throw std::runtime_error((boost::format("Could not read tile at %d: %s")% offset % strerror(errno)).str());
+}
+
+inline void TileCacheManager::WriteTile(const void * src, int32_t index)
+{
+    off_t offset = dataOffset + off_t(index)*tileBytes;
+    if(pwrite(fd, src, tileBytes, offset) != (ssize_t)tileBytes)
+        throw std::runtime_error((boost::format("Could not write tile at %d: %s")% offset % strerror(errno)).str());
+}
+
+inline void TileCacheManager::AdviseTiles(int32_t index, int32_t count)
+{
+    count = std::min(count, xtiles*ytiles - index);
+    if(count > 0)
+        posix_fadvise(fd, dataOffset + off_t(index)*tileBytes, off_t(count)*tileBytes, POSIX_FADV_WILLNEED);
+}
+
+inline void TileCacheManager::AllocFrames()
+{
+    size_t minFrames = size_t(WorkerPool::Shared().NumWorkers())*kBlockTiles;
+    size_t nframes = std::max(budget/tileBytes, minFrames);
+    delete[] frameData;
+    frameData = new uint8_t[nframes*tileBytes];
+    frames.assign(nframes, Frame{nullptr, 0});
+    clockHand = 0;
+}
+
+template<typename TileInfo>
+size_t TileCacheManager::ClaimFrame(std::unique_lock<std::mutex> & lock, bool & writeBack)
+{
+    size_t nframes = frames.size();
+    ++waiters;
+    while(true)
+    {
+        // Two sweeps: the first may only clear reference bits. Tiles pinned
+        // meanwhile make the claim fail, and are passed over.
+        for(size_t j = 0; j < 2*nframes; ++j)
+        {
+            size_t f = clockHand;
+            clockHand = (clockHand + 1) % nframes;
+            if(!frames[f].owner) {
+                --waiters;
+                writeBack = false;
+                return f;
+            }
+            std::atomic<uint32_t> & slot = slots[frames[f].index];
+            uint32_t w = slot;
+            if(w >= kSlotPin || (w & kTileLoading))
+                continue;
+            if(w & kSlotReferenced) {
+                slot &= ~kSlotReferenced;
+                continue;
+            }
+            if(slot.compare_exchange_strong(w, kTileLoading)) {
+                --waiters;
+                writeBack = w & kTileDirty;
+                return f;
+            }
+        }
+        changed.wait(lock);
+    }
+}
+
+template<typename TileInfo>
+void TileCacheManager::Pin(TileInfo & ti, TileAccess access)
+{
+    const int32_t tidx = HomeIndex(ti);
+    std::atomic<uint32_t> & slot = slots[tidx];
+    const uint32_t dirty = (access != kAccessRead && fileMode != kTileFileReadOnly)? kTileDirty : 0;
+    
+    // Resident tiles are pinned without the lock
+    uint32_t w = slot;
+    while(w & kSlotResident)
+        if(slot.compare_exchange_weak(w, (w + kSlotPin) | kSlotReferenced | dirty)) {
+            hits.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    
+    std::unique_lock<std::mutex> lock(mtx);
+    while(true)
+    {
+        w = slot;
+        if(w & kTileLoading) {
+            ++waiters;
+            changed.wait(lock);
+            --waiters;
+        }
+        else if(w & kSlotResident) {
+            if(slot.compare_exchange_weak(w, (w + kSlotPin) | kSlotReferenced | dirty)) {
+                hits.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+        }
+        else if(slot.compare_exchange_weak(w, kTileLoading)) {
+            break;
+        }
+    }
+    
+    // Take over a frame, writing back its previous tile if needed. Both tiles
+    // are marked as loading until done, so anyone else wanting them waits
+    // rather than reading stale data from the file.
+    bool writeBack;
+    size_t f = ClaimFrame<TileInfo>(lock, writeBack);
+    uint8_t * frame = frameData + f*tileBytes;
+    TileInfo * victim = static_cast<TileInfo *>(frames[f].owner);
+    int32_t vidx = frames[f].index;
+    if(victim)
+        victim->pixels = nullptr;
+    frames[f].owner = &ti;
+    frames[f].index = tidx;
+    if(writeBack)
+        ++stats.writeBacks;
+    ++stats.loads;
+    lock.unlock();
+    
+    if(prefetchBlocks > 0 && tidx % kBlockTiles == 0)
+        AdviseTiles(tidx + kBlockTiles, prefetchBlocks*kBlockTiles);
+    if(writeBack)
+        WriteTile(frame, vidx);
+    ReadTile(frame, tidx);
+    
+    lock.lock();
+    if(victim)
+        slots[vidx] = 0;
+    ti.pixels = reinterpret_cast<decltype(ti.pixels)>(frame);
+    slot = kSlotResident | kSlotReferenced | kSlotPin | dirty;
+    changed.notify_all();
+}
+
+template<typename image_t>
+void TileCacheManager::Flush(image_t & image)
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    for(auto & ti : image.GetTiles())
+    {
+        int32_t tidx = HomeIndex(ti);
+        if((slots[tidx] & kSlotResident) && (slots[tidx] & kTileDirty)) {
+            slots[tidx] &= ~kTileDirty;
+            WriteTile(ti.pixels, tidx);
+        }
+    }
+    SyncStore();
+}
+
+template<typename image_t>
+void TileCacheManager::SetBudget(image_t & image, size_t bytes)
+{
+    Flush(image);
+    for(auto & ti : image.GetTiles()) {
+        ti.pixels = nullptr;
+        slots[HomeIndex(ti)] = 0;
+    }
+    budget = bytes;
+    AllocFrames();
+}
+
+template<typename image_t>
+void TileCacheManager::Prefetch(image_t & image, const std::vector<typename image_t::TileInfo *> & tiles)
+{
+    // Advise contiguous runs of tiles as single ranges
+    size_t j = 0;
+    while(j < tiles.size())
+    {
+        int32_t start = HomeIndex(*tiles[j]), end = start + 1;
+        for(++j; j < tiles.size() && HomeIndex(*tiles[j]) == end; ++j)
+            ++end;
+        AdviseTiles(start, end - start);
+    }
+}
+
+} // namespace bigimage
+#endif // CACHEMANAGER_H
@@ -0,0 +1,253 @@
+
+// Compressed tile manager, for images whose backing files would be too large,
+// or too slow to read, uncompressed.
+//
+// Tiles are paged through a fixed memory budget as by TileCacheManager, but
+// are compressed when written back and decompressed when loaded, see
+// tilecodec.h. Compressed tiles vary in size, so the backing file is an image
+// file in the indexed layout: the header is followed by the index of tile
+// records, and the index by the records. A rewritten tile replaces its record
+// in place if it fits, and is otherwise appended to the file, leaving the
+// space of the old record unused. Tiles that don't compress are stored raw,
+// and tiles that have never been written take no space and read as zero.
+//
+// The index and header are written by Flush() and when the image is freed, so
+// the file only describes the image after one of those. As with the other
+// managers, creating an image on a file already holding a matching image
+// keeps its tiles, and otherwise starts the file over.
+
+#ifndef COMPRESSEDMANAGER_H
+#define COMPRESSEDMANAGER_H
+
+#include <vector>
+#include <utility>
+
+#include "cachemanager.h"
+#include "tilecodec.h"
+
+namespace bigimage {
+
+class TileCompressedManager: public TileCacheManager {
+  protected:
+    TileFileHeader header;
+    std::vector<TileFileRecord> records;// by memory index
+    std::vector<uint32_t> capacity;// bytes available at each record's offset
+    uint64_t fileEnd;
+    bool indexDirty;
+    std::mutex indexMtx;// guards records, capacity, fileEnd and indexDirty
+    
+    // Scratch space and compressed tile for the calling thread. Tiles are
+    // read and written outside the cache's lock by workers and other threads
+    // alike, so each thread has its own.
+    uint8_t * WorkBuffer() {
+        static thread_local std::vector<uint8_t> buf;
+        if(buf.size() < tileBytes + LZBound(tileBytes))
+            buf.resize(tileBytes + LZBound(tileBytes));
+        return &buf[0];
+    }
+    
+    // Take over the header and index of the existing file, if it holds an
+    // image matching header with a sound index. Returns false otherwise.
+    bool LoadIndex();
+    void WriteIndex();
+    
+    virtual void OpenStore(const TileFileHeader & hdr);
+    virtual void SyncStore();
+    virtual void CloseStore();
+    virtual void ReadTile(void * dst, int32_t index);
+    virtual void WriteTile(const void * src, int32_t index);
+    virtual void AdviseTiles(int32_t index, int32_t count);
+    
+  public:
+    TileCompressedManager(const std::string & bfPath, TileFileMode mode = kTileFileCreate):
+        TileCacheManager(bfPath, mode), fileEnd(0), indexDirty(false)
+    {}
+    virtual ~TileCompressedManager() {}
+    
+    // Bytes of tile records in the backing store, for tiles written back so far
+    uint64_t StoredBytes() {
+        std::lock_guard<std::mutex> lock(indexMtx);
+        uint64_t bytes = 0;
+        for(auto & r : records)
+            bytes += r.bytes;
+        return bytes;
+    }
+};
+
+
+// *****************************************************************************
+// TileCompressedManager implementation
+// *****************************************************************************
+
+inline void TileCompressedManager::OpenStore(const TileFileHeader & hdr)
+{
+    // Index after the header page, records after the index
+    header = hdr;
+    header.layout = kTileLayoutIndexed;
+    header.codec = kTileCodecShuffleLZ;
+    header.indexOffset = header.headerBytes;
+    header.indexEntries = size_t(xtiles)*ytiles;
+    size_t indexBytes = header.indexEntries*sizeof(TileFileRecord);
+    header.dataOffset = header.indexOffset + (indexBytes + kTileFileHeaderBytes - 1)/kTileFileHeaderBytes*kTileFileHeaderBytes;
+    header.dataBytes = 0;
+    records.assign(header.indexEntries, TileFileRecord{0, 0, 0});
+    
+    if(backingFilePath == "")
+    {
+        if(fileMode != kTileFileCreate)
+            throw std::runtime_error("Opening an image requires a file path");
+        tmpFile = std::tmpfile();
+        if(!tmpFile)
+            throw std::runtime_error("Could not create temporary backing file");
+        fd = fileno(tmpFile);
+    }
+    else
+    {
+        if(fileMode != kTileFileCreate)
+            CheckTileFile(backingFilePath, header);
+        fd = open(backingFilePath.c_str(), (fileMode == kTileFileReadOnly)? O_RDONLY :
+                  (fileMode == kTileFileCreate)? O_RDWR | O_CREAT : O_RDWR, (mode_t)0600);
+        if(fd < 0)
+            throw std::runtime_error((boost::format("Could not open file \"%s\": %s")% backingFilePath % strerror(errno)).str());
+        if(!LoadIndex())
+        {
+            if(fileMode != kTileFileCreate)
+                throw std::runtime_error((boost::format("\"%s\" has a corrupt index")% backingFilePath).str());
+            std::vector<uint8_t> start(header.dataOffset, 0);// header and empty index
+            memcpy(&start[0], &header, sizeof(header));
+            if(ftruncate(fd, 0) != 0 || pwrite(fd, &start[0], start.size(), 0) != ssize_t(start.size()))
+                throw std::runtime_error((boost::format("Could not initialize \"%s\": %s")% backingFilePath % strerror(errno)).str());
+        }
+    }
+    
+    dataOffset = header.dataOffset;
+    fileEnd = header.dataOffset + header.dataBytes;
+    capacity.resize(records.size());
+    for(size_t t = 0; t < records.size(); ++t)
+        capacity[t] = records[t].bytes;
+    indexDirty = false;
+}
+
+inline bool TileCompressedManager::LoadIndex()
+{
+    TileFileHeader existing;
+    struct stat st;
+    if(!ReadTileFileHeader(fd, existing) || !SameTileImage(existing, header) ||
+       existing.indexOffset < existing.headerBytes || existing.indexEntries != header.indexEntries ||
+       existing.indexOffset + existing.indexEntries*sizeof(TileFileRecord) > existing.dataOffset ||
+       fstat(fd, &st) != 0 || uint64_t(st.st_size) < existing.dataOffset + existing.dataBytes)
+        return false;
+    
+    std::vector<TileFileRecord> existingRecords;
+    ReadTileFileIndex(fd, existing, existingRecords, backingFilePath);
+    uint64_t dataEnd = existing.dataOffset + existing.dataBytes;
+    for(auto & r : existingRecords)
+        if(r.bytes && (r.offset < existing.dataOffset || r.offset + r.bytes > dataEnd || r.bytes > LZBound(tileBytes) ||
+                       ((r.flags & kTileRecordRaw) && r.bytes != tileBytes)))
+            return false;
+    header = existing;
+    records.swap(existingRecords);
+    return true;
+}
+
+inline void TileCompressedManager::WriteIndex()
+{
+    std::lock_guard<std::mutex> lock(indexMtx);
+    if(!indexDirty || tmpFile || fileMode == kTileFileReadOnly)
+        return;
+    header.dataBytes = fileEnd - header.dataOffset;
+    WriteTileFileIndex(fd, header, records, backingFilePath);
+    if(pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+        throw std::runtime_error((boost::format("Could not write header of \"%s\": %s")% backingFilePath % strerror(errno)).str());
+    indexDirty = false;
+}
+
+inline void TileCompressedManager::SyncStore()
+{
+    WriteIndex();
+    TileCacheManager::SyncStore();
+}
+
+inline void TileCompressedManager::CloseStore()
+{
+    WriteIndex();
+    TileCacheManager::CloseStore();
+}
+
+inline void TileCompressedManager::ReadTile(void * dst, int32_t index)
+{
+    TileFileRecord r;
+    {
+        std::lock_guard<std::mutex> lock(indexMtx);
+        r = records[index];
+    }
+    if(r.bytes == 0) {
+        memset(dst, 0, tileBytes);
+        return;
+    }
+    if(r.flags & kTileRecordRaw) {
+        if(pread(fd, dst, tileBytes, r.offset) != (ssize_t)tileBytes)
+            throw std::runtime_error((boost::format("Could not read tile at %d: %s")% r.offset % strerror(errno)).str());
+        return;
+    }
+    uint8_t * buf = WorkBuffer();
+    if(pread(fd, buf + tileBytes, r.bytes, r.offset) != (ssize_t)r.bytes)
+        throw std::runtime_error((boost::format("Could not read tile at %d: %s")% r.offset % strerror(errno)).str());
+    if(!DecompressTile(static_cast<uint8_t *>(dst), tileBytes, buf + tileBytes, r.bytes, header.pixelBytes, buf))
+        throw std::runtime_error((boost::format("Corrupt tile at %d")% r.offset).str());
+}
+
+inline void TileCompressedManager::WriteTile(const void * src, int32_t index)
+{
+    uint8_t * buf = WorkBuffer();
+    const uint8_t * data = buf + tileBytes;
+    size_t bytes = CompressTile(buf + tileBytes, static_cast<const uint8_t *>(src), tileBytes, header.pixelBytes, buf);
+    uint32_t flags = 0;
+    if(bytes >= tileBytes) {
+        data = static_cast<const uint8_t *>(src);
+        bytes = tileBytes;
+        flags = kTileRecordRaw;
+    }
+    
+    TileFileRecord r;
+    {
+        std::lock_guard<std::mutex> lock(indexMtx);
+        r = records[index];
+        if(bytes > capacity[index]) {
+            r.offset = fileEnd;
+            fileEnd += bytes;
+            capacity[index] = bytes;
+        }
+        r.bytes = bytes;
+        r.flags = flags;
+        records[index] = r;
+        indexDirty = true;
+    }
+    if(pwrite(fd, data, bytes, r.offset) != (ssize_t)bytes)
+        throw std::runtime_error((boost::format("Could not write tile at %d: %s")% r.offset % strerror(errno)).str());
+}
+
+inline void TileCompressedManager::AdviseTiles(int32_t index, int32_t count)
+{
+    // Records written in order are contiguous, so are advised as single ranges
+    std::vector<std::pair<off_t, off_t>> ranges;
+    {
+        std::lock_guard<std::mutex> lock(indexMtx);
+        int32_t end = std::min<int32_t>(index + count, records.size());
+        for(int32_t t = index; t < end; ++t)
+        {
+            const TileFileRecord & r = records[t];
+            if(r.bytes == 0)
+                continue;
+            if(!ranges.empty() && ranges.back().second == off_t(r.offset))
+                ranges.back().second += r.bytes;
+            else
+                ranges.push_back(std::make_pair(off_t(r.offset), off_t(r.offset + r.bytes)));
+        }
+    }
+    for(auto & range : ranges)
+        posix_fadvise(fd, range.first, range.second - range.first, POSIX_FADV_WILLNEED);
+}
+
+} // namespace bigimage
+#endif // COMPRESSEDMANAGER_H
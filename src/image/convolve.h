@@ -0,0 +1,357 @@
+
+// Separable convolution and Gaussian blur, in place.
+//
+// Filters run as a horizontal pass followed by a vertical pass. Pixels are
+// converted to a working type for filtering, float for PixelTypeU32 and float4
+// for PixelTypeRGBA32 and PixelTypeRGBAf, and rounded and saturated back.
+// Edges are extended by the nearest edge pixel.
+//
+// FIR passes run as ImageProcJobs, filtering each tile from an apron gathered
+// around it into a temporary tile, which replaces the tile once its neighbors
+// are done with it. Inner loops run over taps, then along contiguous rows of
+// the working type, which vectorize.
+//
+// Large Gaussians use the recursive approximation of Young and van Vliet,
+// "Recursive implementation of the Gaussian filter" (1995), at a cost per
+// pixel that doesn't depend on sigma. Each pass runs forward and backward along
+// whole image lines, in strips of kIIRLanes lines interleaved so the
+// recursion vectorizes across lines. Each task takes a whole row or column of
+// tiles and filters all of its strips, so every tile is loaded and stored once
+// per pass, by one worker, and is filtered in place without temporary tiles.
+// Working memory per worker is a row or column of tiles in the working type.
+
+#ifndef CONVOLVE_H
+#define CONVOLVE_H
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "pixeltype.h"
+#include "tile.h"
+#include "tilepool.h"
+#include "imageproc.h"
+#include "apron.h"
+#include "workerpool.h"
+
+namespace bigimage {
+
+// Sigma from which GaussianBlur() uses the recursive filter
+const float kGaussianIIRSigma = 3.0f;
+// Lines per strip of the recursive filter
+const int32_t kIIRLanes = 16;
+
+// Working type and conversions of pixel types for filtering
+template<typename pixT>
+struct ConvTraits;
+
+template<>
+struct ConvTraits<PixelTypeRGBAf> {
+    typedef float4 work_t;
+    static void Load(float4 * dst, const float4 * src, size_t len) {std::copy(src, src + len, dst);}
+    static void Store(float4 * dst, const float4 * src, size_t len) {std::copy(src, src + len, dst);}
+};
+
+template<>
+struct ConvTraits<PixelTypeRGBA32> {
+    typedef float4 work_t;
+    static void Load(float4 * dst, const uint32_t * src, size_t len) {
+        CopyPixels<PixelTypeRGBAf, PixelTypeRGBA32>(dst, src, len);
+    }
+    static void Store(uint32_t * dst, const float4 * src, size_t len) {
+        CopyPixels<PixelTypeRGBA32, PixelTypeRGBAf>(dst, src, len);
+    }
+};
+
+template<>
+struct ConvTraits<PixelTypeU32> {
+    typedef float work_t;
+    static void Load(float * dst, const uint32_t * src, size_t len) {
+        for(size_t p = 0; p < len; ++p)
+            dst[p] = float(src[p]);
+    }
+    // 4294967040 is the largest float below 2^32
+    static void Store(uint32_t * dst, const float * src, size_t len) {
+        for(size_t p = 0; p < len; ++p)
+            dst[p] = uint32_t(std::min(std::max(src[p], 0.0f), 4294967040.0f) + 0.5f);
+    }
+};
+
+// Normalized Gaussian kernel, of radius ceil(3*sigma)
+inline std::vector<float> GaussianKernel(float sigma)
+{
+    int32_t r = std::max(int32_t(std::ceil(3.0f*sigma)), 1);
+    std::vector<float> kernel(2*r + 1);
+    double sum = 0;
+    for(int32_t i = -r; i <= r; ++i)
+        sum += kernel[i + r] = std::exp(-0.5f*i*i/(sigma*sigma));
+    for(float & k : kernel)
+        k /= sum;
+    return kernel;
+}
+
+// Coefficients of the recursive Gaussian, normalized by b0:
+// w[n] = B*x[n] + b1*w[n - 1] + b2*w[n - 2] + b3*w[n - 3]
+// tail is the number of samples the forward pass runs past the end of a line,
+// for the backward pass to start from.
+struct IIRGaussCoeffs {
+    float B, b1, b2, b3;
+    int32_t tail;
+};
+
+// Valid for sigma >= 0.5
+inline IIRGaussCoeffs GaussianIIRCoeffs(float sigma)
+{
+    double q = (sigma >= 2.5f)? 0.98711*sigma - 0.96330 : 3.97156 - 4.14554*std::sqrt(1.0 - 0.26891*sigma);
+    double q2 = q*q, q3 = q2*q;
+    double b0 = 1.57825 + 2.44413*q + 1.4281*q2 + 0.422205*q3;
+    double b1 = 2.44413*q + 2.85619*q2 + 1.26661*q3;
+    double b2 = -(1.4281*q2 + 1.26661*q3);
+    double b3 = 0.422205*q3;
+    return IIRGaussCoeffs{float(1.0 - (b1 + b2 + b3)/b0), float(b1/b0), float(b2/b0), float(b3/b0),
+                          int32_t(std::ceil(4.0f*sigma))};
+}
+
+// One step of the recursion for each of kIIRLanes interleaved lines
+template<typename work_t>
+inline void IIRStep(work_t * x, work_t * p1, work_t * p2, work_t * p3, const IIRGaussCoeffs & c)
+{
+    for(int32_t l = 0; l < kIIRLanes; ++l) {
+        work_t v = c.B*x[l] + c.b1*p1[l] + c.b2*p2[l] + c.b3*p3[l];
+        p3[l] = p2[l];
+        p2[l] = p1[l];
+        p1[l] = x[l] = v;
+    }
+}
+
+// Run recursive filter forward and backward over n elements of kIIRLanes
+// interleaved lines, with lines extended by their edge values. The forward
+// pass starts from the steady state of the first values. It then continues
+// past the last values for c.tail samples, from whose end the backward pass
+// starts, so the backward pass sees the response to the extension.
+template<typename work_t>
+void IIRLanes(work_t * buf, int32_t n, const IIRGaussCoeffs & c)
+{
+    work_t p1[kIIRLanes], p2[kIIRLanes], p3[kIIRLanes];
+    std::vector<work_t> tail(c.tail*kIIRLanes);
+    const work_t * last = buf + (n - 1)*kIIRLanes;
+    for(int32_t i = 0; i < c.tail; ++i)
+        std::copy(last, last + kIIRLanes, &tail[i*kIIRLanes]);
+    
+    std::copy(buf, buf + kIIRLanes, p1);
+    std::copy(buf, buf + kIIRLanes, p2);
+    std::copy(buf, buf + kIIRLanes, p3);
+    for(int32_t i = 0; i < n; ++i)
+        IIRStep(buf + i*kIIRLanes, p1, p2, p3, c);
+    for(int32_t i = 0; i < c.tail; ++i)
+        IIRStep(&tail[i*kIIRLanes], p1, p2, p3, c);
+    
+    // The backward pass starts from the steady state of its first inputs,
+    // the forward response to the extension, which has settled to the edge
+    // values by the end of the tail
+    const work_t * end = (c.tail > 0)? &tail[(c.tail - 1)*kIIRLanes] : last;
+    std::copy(end, end + kIIRLanes, p1);
+    std::copy(p1, p1 + kIIRLanes, p2);
+    std::copy(p1, p1 + kIIRLanes, p3);
+    for(int32_t i = c.tail - 1; i >= 0; --i)
+        IIRStep(&tail[i*kIIRLanes], p1, p2, p3, c);
+    for(int32_t i = n - 1; i >= 0; --i)
+        IIRStep(buf + i*kIIRLanes, p1, p2, p3, c);
+}
+
+
+// *****************************************************************************
+// FIR passes
+// *****************************************************************************
+
+// Convolve rows, or columns if vertical, with kernel of odd length, centered.
+template<typename imgT>
+void ConvolvePass(imgT & image, const std::vector<float> & kernel, bool vertical)
+{
+    typedef typename imgT::pixel_val_t pixel_val_t;
+    typedef ConvTraits<typename imgT::pixel_t> traits;
+    typedef typename traits::work_t work_t;
+    
+    const int32_t r = kernel.size()/2;
+    const int32_t rx = vertical? 0 : r, ry = vertical? r : 0;
+    const int32_t aw = kTileWidth + 2*rx, ah = kTileHeight + 2*ry;
+    const int32_t rowStep = vertical? aw : 1;// apron offset between taps
+    
+    // Apron pixels, and per-thread working copies plus a row of accumulators
+    TilePool aprons;
+    WorkerLocal<std::vector<work_t>> work;
+    ImageProcJob<imgT> job(rx, ry);
+    job.Execute(image, [&](typename imgT::TileInfo & src, typename imgT::TileInfo & dst){
+        std::vector<work_t> & buf = work.Local();
+        buf.resize(aw*ah + kTileWidth);
+        pixel_val_t * apron = static_cast<pixel_val_t *>(aprons.Alloc(aw*ah*sizeof(pixel_val_t)));
+        GatherApron(image, src.x, src.y, rx, ry, kEdgeClamp, pixel_val_t(), apron);
+        traits::Load(&buf[0], apron, aw*ah);
+        aprons.Free(apron);
+        
+        work_t * acc = &buf[aw*ah];
+        for(int32_t y = 0; y < kTileHeight; ++y)
+        {
+            std::fill(acc, acc + kTileWidth, work_t());
+            const work_t * in = &buf[y*aw];
+            for(int32_t t = 0; t <= 2*r; ++t, in += rowStep) {
+                float k = kernel[t];
+                for(int32_t x = 0; x < kTileWidth; ++x)
+                    acc[x] += k*in[x];
+            }
+            traits::Store(&(*dst.pixels)[y*kTileWidth], acc, kTileWidth);
+        }
+    });
+}
+
+template<typename imgT>
+void ConvolveRows(imgT & image, const std::vector<float> & kernel) {ConvolvePass(image, kernel, false);}
+
+template<typename imgT>
+void ConvolveColumns(imgT & image, const std::vector<float> & kernel) {ConvolvePass(image, kernel, true);}
+
+// Convolve with the outer product of kernels kx and ky, of odd lengths
+template<typename imgT>
+void ConvolveSeparable(imgT & image, const std::vector<float> & kx, const std::vector<float> & ky)
+{
+    ConvolveRows(image, kx);
+    ConvolveColumns(image, ky);
+}
+
+
+// *****************************************************************************
+// Recursive passes
+// *****************************************************************************
+
+// Recursive Gaussian along rows. Each task filters a row of tiles, as
+// kTileHeight/kIIRLanes strips of kIIRLanes rows. Lanes of a last strip past
+// the bottom of the image repeat its last row.
+template<typename imgT>
+void GaussianIIRRows(imgT & image, float sigma)
+{
+    typedef ConvTraits<typename imgT::pixel_t> traits;
+    typedef typename traits::work_t work_t;
+    const IIRGaussCoeffs c = GaussianIIRCoeffs(sigma);
+    const int32_t width = image.Width(), height = image.Height();
+    const int32_t xtiles = (width + kTileWidth - 1)/kTileWidth, ytiles = (height + kTileHeight - 1)/kTileHeight;
+    const int32_t maxStrips = kTileHeight/kIIRLanes;
+    const size_t stripLen = size_t(width)*kIIRLanes;
+    
+    WorkerLocal<std::vector<work_t>> work;
+    WorkerPool::Shared().ParallelForGuided(ytiles, 1, [&](int workerID, size_t begin, size_t end){
+        std::vector<work_t> & buf = work.Local();
+        buf.resize(stripLen*maxStrips + kTileWidth);
+        work_t * line = &buf[stripLen*maxStrips];
+        for(size_t ty = begin; ty < end; ++ty)
+        {
+            const int32_t rows = std::min(kTileHeight, height - int32_t(ty)*kTileHeight);
+            const int32_t strips = (rows + kIIRLanes - 1)/kIIRLanes;
+            for(int32_t tx = 0; tx < xtiles; ++tx) {
+                auto & ti = image.GetTiles()[ty*xtiles + tx];
+                const int32_t cols = std::min(kTileWidth, width - ti.x);
+                image.PrepareTile(ti, kAccessRead);
+                for(int32_t l = 0; l < strips*kIIRLanes; ++l) {
+                    traits::Load(line, &(*ti.pixels)[std::min(l, rows - 1)*kTileWidth], cols);
+                    work_t * out = &buf[(l/kIIRLanes)*stripLen + size_t(ti.x)*kIIRLanes + l % kIIRLanes];
+                    for(int32_t x = 0; x < cols; ++x)
+                        out[x*kIIRLanes] = line[x];
+                }
+                image.ReleaseTile(ti, kAccessRead);
+            }
+            for(int32_t s = 0; s < strips; ++s)
+                IIRLanes(&buf[s*stripLen], width, c);
+            for(int32_t tx = 0; tx < xtiles; ++tx) {
+                auto & ti = image.GetTiles()[ty*xtiles + tx];
+                const int32_t cols = std::min(kTileWidth, width - ti.x);
+                image.PrepareTile(ti, kAccessWrite);
+                for(int32_t l = 0; l < rows; ++l) {
+                    const work_t * in = &buf[(l/kIIRLanes)*stripLen + size_t(ti.x)*kIIRLanes + l % kIIRLanes];
+                    for(int32_t x = 0; x < cols; ++x)
+                        line[x] = in[x*kIIRLanes];
+                    traits::Store(&(*ti.pixels)[l*kTileWidth], line, cols);
+                }
+                image.ReleaseTile(ti, kAccessWrite);
+            }
+        }
+    });
+}
+
+// Recursive Gaussian along columns. Each task filters a column of tiles, as
+// kTileWidth/kIIRLanes strips of kIIRLanes columns. Lanes of a last strip past
+// the right of the image repeat its last column.
+template<typename imgT>
+void GaussianIIRColumns(imgT & image, float sigma)
+{
+    typedef ConvTraits<typename imgT::pixel_t> traits;
+    typedef typename traits::work_t work_t;
+    const IIRGaussCoeffs c = GaussianIIRCoeffs(sigma);
+    const int32_t width = image.Width(), height = image.Height();
+    const int32_t xtiles = (width + kTileWidth - 1)/kTileWidth, ytiles = (height + kTileHeight - 1)/kTileHeight;
+    const int32_t maxStrips = kTileWidth/kIIRLanes;
+    const size_t stripLen = size_t(height)*kIIRLanes;
+    
+    WorkerLocal<std::vector<work_t>> work;
+    WorkerPool::Shared().ParallelForGuided(xtiles, 1, [&](int workerID, size_t begin, size_t end){
+        std::vector<work_t> & buf = work.Local();
+        buf.resize(stripLen*maxStrips);
+        for(size_t tx = begin; tx < end; ++tx)
+        {
+            const int32_t cols = std::min(kTileWidth, width - int32_t(tx)*kTileWidth);
+            const int32_t strips = (cols + kIIRLanes - 1)/kIIRLanes;
+            for(int32_t ty = 0; ty < ytiles; ++ty) {
+                auto & ti = image.GetTiles()[ty*xtiles + tx];
+                const int32_t rows = std::min(kTileHeight, height - ti.y);
+                image.PrepareTile(ti, kAccessRead);
+                for(int32_t y = 0; y < rows; ++y)
+                for(int32_t s = 0; s < strips; ++s)
+                {
+                    const int32_t n = std::min(kIIRLanes, cols - s*kIIRLanes);
+                    work_t * out = &buf[s*stripLen + size_t(ti.y + y)*kIIRLanes];
+                    traits::Load(out, &(*ti.pixels)[y*kTileWidth + s*kIIRLanes], n);
+                    std::fill(out + n, out + kIIRLanes, out[n - 1]);
+                }
+                image.ReleaseTile(ti, kAccessRead);
+            }
+            for(int32_t s = 0; s < strips; ++s)
+                IIRLanes(&buf[s*stripLen], height, c);
+            for(int32_t ty = 0; ty < ytiles; ++ty) {
+                auto & ti = image.GetTiles()[ty*xtiles + tx];
+                const int32_t rows = std::min(kTileHeight, height - ti.y);
+                image.PrepareTile(ti, kAccessWrite);
+                for(int32_t y = 0; y < rows; ++y)
+                for(int32_t s = 0; s < strips; ++s)
+                    traits::Store(&(*ti.pixels)[y*kTileWidth + s*kIIRLanes],
+                                  &buf[s*stripLen + size_t(ti.y + y)*kIIRLanes],
+                                  std::min(kIIRLanes, cols - s*kIIRLanes));
+                image.ReleaseTile(ti, kAccessWrite);
+            }
+        }
+    });
+}
+
+template<typename imgT>
+void GaussianBlurIIR(imgT & image, float sigma)
+{
+    GaussianIIRRows(image, sigma);
+    GaussianIIRColumns(image, sigma);
+}
+
+template<typename imgT>
+void GaussianBlurFIR(imgT & image, float sigma)
+{
+    std::vector<float> kernel = GaussianKernel(sigma);
+    ConvolveSeparable(image, kernel, kernel);
+}
+
+// Gaussian blur, recursive from kGaussianIIRSigma
+template<typename imgT>
+void GaussianBlur(imgT & image, float sigma)
+{
+    if(sigma >= kGaussianIIRSigma)
+        GaussianBlurIIR(image, sigma);
+    else
+        GaussianBlurFIR(image, sigma);
+}
+
+} // namespace bigimage
+#endif // CONVOLVE_H
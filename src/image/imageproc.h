@@ -2,6 +2,12 @@
 #ifndef IMAGEPROC_H
 #define IMAGEPROC_H
 
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+#include "tile.h"
+
 namespace bigimage {
 
 // *****************************************************************************
@@ -12,50 +18,136 @@ namespace bigimage {
 // Setup:
 // For each output tile, job increments reference counter in all required input tiles.
 // Execution:
-// Jobs write output to temporary files and register these in a map.
+// Jobs write output to temporary tiles and register these in a table.
 // On completion of execution for a tile, job decrements reference counters. When a
 // reference count reaches zero, the corresponding result tile is looked up and moved
 // into its location.
-// 
+//
 // Notes:
 // With block-allocated tiles, the final move is an actual memcpy() of pixel data.
-// With a more flexible allocator that doesn't enforce layout in memory, it could
-// be a copy of a pointer.
-
-// template<typename imageT>
-// class ImageProcJob {
-//     typedef typename imageT::pixel_val_t pixel_val_t;
-//     typedef typename TileInfo<imageT> TileInfo;
-//   protected:
-//     void Setup(imageT & image);
-//     
-//   public:
-//     ImageProcJob();
-//     ~ImageProcJob();
-//     
-//     void Execute(imageT & image);
-// };
-// 
-// template<typename imageT>
-// ImageProcJob<imageT>::ImageProcJob() {}
-// 
-// template<typename imageT>
-// ImageProcJob<imageT>::~ImageProcJob() {}
-// 
-// template<typename imageT>
-// auto ImageProcJob<imageT>::Setup(imageT & image) -> void {
-//     // Mark all tiles required by job
-// }
-// 
-// template<typename imageT>
-// auto ImageProcJob<imageT>::Execute(imageT & image) -> void {
-//     Setup(image);
-// }
+// TileSwapManager doesn't enforce layout in memory until flushed, so the move is a
+// copy of a pointer.
+//
+// This allows neighborhood operations to be done in place and in parallel, with
+// temporary tiles only held for the frontier between finished and unfinished
+// parts of the image rather than for a full copy. With traversal in memory order,
+// the frontier is roughly one block row for the block layout.
+//
+// Input tiles are those within radius pixels of the output tile, which may differ
+// horizontally and vertically, such as for the passes of separable filters.
+// The job function has the form:
+// void(TileInfo & src, TileInfo & dst)
+// src is the tile being processed and dst a temporary tile with the same
+// coordinates. Input pixels, including those of neighboring tiles, are read
+// through the image, such as with BigImage::GetPixel(). All input tiles are
+// prepared for reading while the function runs. Only one job may run on an image
+// at a time.
+
+template<typename bigimageT>
+class ImageProcJob {
+    typedef typename bigimageT::pixel_val_t pixel_val_t;
+    typedef typename bigimageT::TileInfo TileInfo;
+    typedef typename bigimageT::Tile Tile;
+
+  protected:
+    int32_t rtx, rty;// radius in tiles
+    int32_t xtiles, ytiles;
+    std::vector<Tile *> results;// pending result tiles, by linear tile index
+    std::mutex mtx;
+    size_t pending, maxPending;
+
+    // Apply fn to input tiles of output tile at tile coordinates tx, ty
+    template<typename fnT>
+    void EachInput(bigimageT & image, int32_t tx, int32_t ty, const fnT & fn) {
+        for(int32_t ny = std::max(ty - rty, 0); ny <= std::min(ty + rty, ytiles - 1); ++ny)
+        for(int32_t nx = std::max(tx - rtx, 0); nx <= std::min(tx + rtx, xtiles - 1); ++nx)
+            fn(image.GetTiles()[ny*xtiles + nx]);
+    }
+
+    void Setup(bigimageT & image);
+
+  public:
+    ImageProcJob(int32_t r);
+    ImageProcJob(int32_t rx, int32_t ry);
+    ~ImageProcJob();
+
+    template<typename fnT>
+    void Execute(bigimageT & image, const fnT & fn);
+    
+    // Largest number of temporary tiles held at once by the last Execute()
+    size_t MaxPendingTiles() const {return maxPending;}
+};
 
+template<typename bigimageT>
+ImageProcJob<bigimageT>::ImageProcJob(int32_t r):
+    rtx((r + kTileWidth - 1)/kTileWidth), rty((r + kTileHeight - 1)/kTileHeight),
+    xtiles(0), ytiles(0),
+    pending(0), maxPending(0)
+{}
 
+template<typename bigimageT>
+ImageProcJob<bigimageT>::ImageProcJob(int32_t rx, int32_t ry):
+    rtx((rx + kTileWidth - 1)/kTileWidth), rty((ry + kTileHeight - 1)/kTileHeight),
+    xtiles(0), ytiles(0),
+    pending(0), maxPending(0)
+{}
 
+template<typename bigimageT>
+ImageProcJob<bigimageT>::~ImageProcJob() {}
 
+template<typename bigimageT>
+auto ImageProcJob<bigimageT>::Setup(bigimageT & image) -> void {
+    // Mark all tiles required by job
+    xtiles = (image.Width() + kTileWidth - 1)/kTileWidth;
+    ytiles = (image.Height() + kTileHeight - 1)/kTileHeight;
+    results.assign(xtiles*ytiles, nullptr);
+    pending = maxPending = 0;
+    for(int32_t ty = 0; ty < ytiles; ++ty)
+    for(int32_t tx = 0; tx < xtiles; ++tx)
+        EachInput(image, tx, ty, [](TileInfo & ti){++ti.references;});
+}
 
+template<typename bigimageT>
+template<typename fnT>
+auto ImageProcJob<bigimageT>::Execute(bigimageT & image, const fnT & fn) -> void {
+    Setup(image);
+    auto & tileManager = image.GetTileManager();
+    image.EachTile([&](TileInfo & ti){
+        int32_t tx = ti.x/kTileWidth, ty = ti.y/kTileHeight;
+        Tile * tmp = tileManager.template AllocTmp<bigimageT>();
+        TileInfo dst(ti.x, ti.y, *tmp);
+        
+        // The tile itself was prepared by the traversal
+        EachInput(image, tx, ty, [&](TileInfo & nt){if(&nt != &ti) image.PrepareTile(nt, kAccessRead);});
+        fn(ti, dst);
+        EachInput(image, tx, ty, [&](TileInfo & nt){if(&nt != &ti) image.ReleaseTile(nt, kAccessRead);});
+        
+        // Release inputs, collecting tiles that are no longer needed by any
+        // output. Every such tile has its own result ready, as each tile is
+        // an input of its own output.
+        std::vector<TileInfo *> done;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            results[ty*xtiles + tx] = tmp;
+            maxPending = std::max(maxPending, ++pending);
+            EachInput(image, tx, ty, [&](TileInfo & nt){
+                if(--nt.references == 0)
+                    done.push_back(&nt);
+            });
+        }
+        for(TileInfo * nt : done)
+        {
+            size_t t = (nt->y/kTileHeight)*xtiles + nt->x/kTileWidth;
+            Tile * result = results[t];
+            TileInfo src(nt->x, nt->y, *result);
+            tileManager.template MovePixels<bigimageT>(*nt, src);
+            tileManager.template FreeTmp<bigimageT>(reinterpret_cast<Tile *>(src.pixels));
+            std::lock_guard<std::mutex> lock(mtx);
+            results[t] = nullptr;
+            --pending;
+        }
+    });
+}
 
 } // namespace bigimage
 #endif // IMAGEPROC_H
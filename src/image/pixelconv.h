@@ -0,0 +1,548 @@
+
+// Pixel conversion kernels behind CopyPixels().
+//
+// Each conversion has a scalar version, which defines the result, and SSE4.1
+// and AVX2 versions, picked at runtime according to what the CPU supports. The
+// SSE4.1 versions are built in when the compiler targets SSE4.1, as the
+// makefiles do with -msse4.1, and the AVX2 versions are built for AVX2 with
+// target attributes, so no special flags are needed for them.
+//
+// Conversions:
+// RGBA32 <-> RGBAf: 8 bit channels map [0, 255] to [0, 1]. Floats are clamped to
+// [0, 1], NaN giving 0, and rounded to nearest.
+// U32 -> RGBA32/RGBAf: value is taken as a gray level, [0, 0xFFFFFFFF] mapping
+// to [0, 255] or [0, 1], rounded to nearest, with alpha opaque.
+// RGBA32/RGBAf -> U32: luminance with Rec. 601 weights, alpha ignored. 8 bit
+// luminance is replicated into all 4 bytes, float luminance is rounded to 24
+// bits and replicated into the lowest byte, so black and white map exactly.
+//
+// File byte orders, as used by Targa files:
+// RGBA32 <-> BGRA32: red and blue swapped, SwapRB32() going either way.
+// RGBA32 <-> BGR24: packed 3 byte pixels, alpha dropped, or opaque when unpacked.
+// U32 -> Gray8: gray level as for U32 -> RGBA32, one byte per pixel.
+//
+// RGBAf pixels are handled as arrays of 4 floats. NaN handling relies on
+// IEEE semantics, and is unspecified when built with -ffast-math.
+
+#ifndef PIXELCONV_H
+#define PIXELCONV_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PIXELCONV_X86 1
+#include <immintrin.h>
+#endif
+
+namespace bigimage {
+namespace pixelconv {
+
+enum SIMDLevel {
+    kSIMDNone,
+    kSIMDSSE41,
+    kSIMDAVX2
+};
+
+inline SIMDLevel DetectSIMDLevel()
+{
+#if defined(PIXELCONV_X86) && defined(__SSE4_1__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return kSIMDAVX2;
+    return kSIMDSSE41;
+#else
+    return kSIMDNone;
+#endif
+}
+
+inline SIMDLevel & ActiveSIMDLevel() {
+    static SIMDLevel level = DetectSIMDLevel();
+    return level;
+}
+
+// Kernel set in use. Can be lowered, for comparing kernels or working around
+// a broken one, but not raised past what the CPU supports.
+inline SIMDLevel GetSIMDLevel() {return ActiveSIMDLevel();}
+inline void SetSIMDLevel(SIMDLevel level) {
+    ActiveSIMDLevel() = std::min(level, DetectSIMDLevel());
+}
+
+const float kInv255 = 1.0f/255.0f;
+const float kInvU32 = 1.0f/4294967295.0f;
+// Rec. 601 luminance weights, and their 8 bit fixed point equivalents
+const float kLumR = 0.299f, kLumG = 0.587f, kLumB = 0.114f;
+const int32_t kLumR8 = 77, kLumG8 = 150, kLumB8 = 29;
+
+
+// *****************************************************************************
+// Scalar conversions
+// *****************************************************************************
+
+// Clamp to [0, 1], NaN giving 0
+inline float Saturate(float c) {
+    c = (c > 0.0f)? c : 0.0f;
+    return (c < 1.0f)? c : 1.0f;
+}
+
+inline uint32_t RGBA32FromRGBAf(const float * src) {
+    return ((uint32_t)lrintf(Saturate(src[0])*255.0f) << 0) |
+           ((uint32_t)lrintf(Saturate(src[1])*255.0f) << 8) |
+           ((uint32_t)lrintf(Saturate(src[2])*255.0f) << 16) |
+           ((uint32_t)lrintf(Saturate(src[3])*255.0f) << 24);
+}
+
+inline void RGBAfFromRGBA32(float * dst, uint32_t src) {
+    dst[0] = (float)((src >> 0) & 0xFF)*kInv255;
+    dst[1] = (float)((src >> 8) & 0xFF)*kInv255;
+    dst[2] = (float)((src >> 16) & 0xFF)*kInv255;
+    dst[3] = (float)((src >> 24) & 0xFF)*kInv255;
+}
+
+// round(v*255/0xFFFFFFFF), which is v/0x01010101 rounded. Half the divisor is
+// added and the division done by multiplying with the reciprocal, 0xFF000001 >> 56.
+// Values that would overflow on adding round to 255 anyway.
+inline uint32_t Gray8FromU32(uint32_t v) {
+    uint32_t x = std::min(v, 0xFF7F7F7Fu) + 0x808080;
+    return (uint64_t(x)*0xFF000001u) >> 56;
+}
+
+inline uint32_t RGBA32FromU32(uint32_t v) {
+    return Gray8FromU32(v)*0x010101 | 0xFF000000;
+}
+
+inline uint32_t SwapRB32(uint32_t v) {
+    return (v & 0xFF00FF00) | ((v >> 16) & 0xFF) | ((v & 0xFF) << 16);
+}
+
+inline void BGR24FromRGBA32(uint8_t * dst, uint32_t v) {
+    dst[0] = v >> 16;
+    dst[1] = v >> 8;
+    dst[2] = v;
+}
+
+inline uint32_t RGBA32FromBGR24(const uint8_t * src) {
+    return src[2] | (src[1] << 8) | (src[0] << 16) | 0xFF000000;
+}
+
+inline uint32_t U32FromRGBA32(uint32_t v) {
+    uint32_t y = (((v >> 0) & 0xFF)*kLumR8 + ((v >> 8) & 0xFF)*kLumG8 + ((v >> 16) & 0xFF)*kLumB8 + 128) >> 8;
+    return y*0x01010101;
+}
+
+inline void RGBAfFromU32(float * dst, uint32_t v) {
+    float g = (float)v*kInvU32;
+    dst[0] = g;
+    dst[1] = g;
+    dst[2] = g;
+    dst[3] = 1.0f;
+}
+
+inline uint32_t U32FromRGBAf(const float * src) {
+    float y = Saturate(src[0]*kLumR + src[1]*kLumG + src[2]*kLumB);
+    uint32_t y24 = (uint32_t)lrintf(y*16777215.0f);
+    return (y24 << 8) | (y24 >> 16);
+}
+
+
+// *****************************************************************************
+// SSE4.1 kernels, 4 pixels per step
+// *****************************************************************************
+
+#if defined(PIXELCONV_X86) && defined(__SSE4_1__)
+namespace sse41 {
+
+inline __m128 Saturate(__m128 c) {
+    // maxps returns its second operand for NaN
+    return _mm_min_ps(_mm_max_ps(c, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+}
+
+inline size_t RGBA32FromRGBAf(uint32_t * dst, const float * src, size_t len) {
+    const __m128 k255 = _mm_set1_ps(255.0f);
+    size_t n = len & ~size_t(3);
+    for(size_t p = 0; p < n; p += 4, src += 16) {
+        __m128i i0 = _mm_cvtps_epi32(_mm_mul_ps(Saturate(_mm_loadu_ps(src + 0)), k255));
+        __m128i i1 = _mm_cvtps_epi32(_mm_mul_ps(Saturate(_mm_loadu_ps(src + 4)), k255));
+        __m128i i2 = _mm_cvtps_epi32(_mm_mul_ps(Saturate(_mm_loadu_ps(src + 8)), k255));
+        __m128i i3 = _mm_cvtps_epi32(_mm_mul_ps(Saturate(_mm_loadu_ps(src + 12)), k255));
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(i0, i1), _mm_packs_epi32(i2, i3));
+        _mm_storeu_si128((__m128i *)(dst + p), packed);
+    }
+    return n;
+}
+
+inline size_t RGBAfFromRGBA32(float * dst, const uint32_t * src, size_t len) {
+    const __m128 kScale = _mm_set1_ps(kInv255);
+    size_t n = len & ~size_t(3);
+    for(size_t p = 0; p < n; p += 4, dst += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + p));
+        _mm_storeu_ps(dst + 0, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(v)), kScale));
+        _mm_storeu_ps(dst + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(v, 4))), kScale));
+        _mm_storeu_ps(dst + 8, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(v, 8))), kScale));
+        _mm_storeu_ps(dst + 12, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(v, 12))), kScale));
+    }
+    return n;
+}
+
+inline __m128i Gray8FromU32(__m128i v) {
+    const __m128i kMax = _mm_set1_epi32(0xFF7F7F7F), kHalf = _mm_set1_epi32(0x808080);
+    const __m128i kRecip = _mm_set1_epi32(0xFF000001);
+    __m128i x = _mm_add_epi32(_mm_min_epu32(v, kMax), kHalf);
+    __m128i even = _mm_srli_epi64(_mm_mul_epu32(x, kRecip), 56);
+    __m128i odd = _mm_srli_epi64(_mm_mul_epu32(_mm_srli_epi64(x, 32), kRecip), 56);
+    return _mm_or_si128(even, _mm_slli_epi64(odd, 32));
+}
+
+inline size_t RGBA32FromU32(uint32_t * dst, const uint32_t * src, size_t len) {
+    const __m128i kSpread = _mm_set1_epi32(0x010101), kAlpha = _mm_set1_epi32(0xFF000000);
+    size_t n = len & ~size_t(3);
+    for(size_t p = 0; p < n; p += 4) {
+        __m128i g = Gray8FromU32(_mm_loadu_si128((const __m128i *)(src + p)));
+        _mm_storeu_si128((__m128i *)(dst + p), _mm_or_si128(_mm_mullo_epi32(g, kSpread), kAlpha));
+    }
+    return n;
+}
+
+inline size_t U32FromRGBA32(uint32_t * dst, const uint32_t * src, size_t len) {
+    // R and B as 16 bit pairs through one madd, G through another
+    const __m128i kRB = _mm_set1_epi32(kLumR8 | (kLumB8 << 16)), kG = _mm_set1_epi32(kLumG8);
+    const __m128i kMaskRB = _mm_set1_epi32(0x00FF00FF), kMaskG = _mm_set1_epi32(0xFF);
+    const __m128i kRound = _mm_set1_epi32(128), kSpread = _mm_set1_epi32(0x01010101);
+    size_t n = len & ~size_t(3);
+    for(size_t p = 0; p < n; p += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + p));
+        __m128i rb = _mm_madd_epi16(_mm_and_si128(v, kMaskRB), kRB);
+        __m128i g = _mm_madd_epi16(_mm_and_si128(_mm_srli_epi32(v, 8), kMaskG), kG);
+        __m128i y = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(rb, g), kRound), 8);
+        _mm_storeu_si128((__m128i *)(dst + p), _mm_mullo_epi32(y, kSpread));
+    }
+    return n;
+}
+
+// Exact conversion of unsigned 32 bit integers to float, in two 16 bit halves
+inline __m128 CvtU32(__m128i v) {
+    __m128 hi = _mm_cvtepi32_ps(_mm_srli_epi32(v, 16));
+    __m128 lo = _mm_cvtepi32_ps(_mm_and_si128(v, _mm_set1_epi32(0xFFFF)));
+    return _mm_add_ps(_mm_mul_ps(hi, _mm_set1_ps(65536.0f)), lo);
+}
+
+inline size_t RGBAfFromU32(float * dst, const uint32_t * src, size_t len) {
+    const __m128 kScale = _mm_set1_ps(kInvU32), kOne = _mm_set1_ps(1.0f);
+    size_t n = len & ~size_t(3);
+    for(size_t p = 0; p < n; p += 4, dst += 16) {
+        __m128 g = _mm_mul_ps(CvtU32(_mm_loadu_si128((const __m128i *)(src + p))), kScale);
+        _mm_storeu_ps(dst + 0, _mm_blend_ps(_mm_shuffle_ps(g, g, 0x00), kOne, 0x8));
+        _mm_storeu_ps(dst + 4, _mm_blend_ps(_mm_shuffle_ps(g, g, 0x55), kOne, 0x8));
+        _mm_storeu_ps(dst + 8, _mm_blend_ps(_mm_shuffle_ps(g, g, 0xAA), kOne, 0x8));
+        _mm_storeu_ps(dst + 12, _mm_blend_ps(_mm_shuffle_ps(g, g, 0xFF), kOne, 0x8));
+    }
+    return n;
+}
+
+inline size_t U32FromRGBAf(uint32_t * dst, const float * src, size_t len) {
+    const __m128 kR = _mm_set1_ps(kLumR), kG = _mm_set1_ps(kLumG), kB = _mm_set1_ps(kLumB);
+    const __m128 kScale = _mm_set1_ps(16777215.0f);
+    size_t n = len & ~size_t(3);
+    for(size_t p = 0; p < n; p += 4, src += 16) {
+        __m128 r = _mm_loadu_ps(src + 0), g = _mm_loadu_ps(src + 4);
+        __m128 b = _mm_loadu_ps(src + 8), a = _mm_loadu_ps(src + 12);
+        _MM_TRANSPOSE4_PS(r, g, b, a);
+        __m128 y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, kR), _mm_mul_ps(g, kG)), _mm_mul_ps(b, kB));
+        __m128i y24 = _mm_cvtps_epi32(_mm_mul_ps(Saturate(y), kScale));
+        _mm_storeu_si128((__m128i *)(dst + p), _mm_or_si128(_mm_slli_epi32(y24, 8), _mm_srli_epi32(y24, 16)));
+    }
+    return n;
+}
+
+// The 24 bit kernels load or store a whole vector for each group of 4 or 8
+// pixels, of which only 12 or 24 bytes are pixel data, so they leave the last
+// few pixels to the scalar versions to stay within the buffers.
+
+inline size_t SwapRB32(uint32_t * dst, const uint32_t * src, size_t len) {
+    const __m128i kSwap = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    size_t n = len & ~size_t(3);
+    for(size_t p = 0; p < n; p += 4)
+        _mm_storeu_si128((__m128i *)(dst + p), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + p)), kSwap));
+    return n;
+}
+
+inline size_t BGR24FromRGBA32(uint8_t * dst, const uint32_t * src, size_t len) {
+    const __m128i kPack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    size_t n = (len > 2)? (len - 2) & ~size_t(3) : 0;
+    for(size_t p = 0; p < n; p += 4)
+        _mm_storeu_si128((__m128i *)(dst + 3*p), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + p)), kPack));
+    return n;
+}
+
+inline size_t RGBA32FromBGR24(uint32_t * dst, const uint8_t * src, size_t len) {
+    const __m128i kUnpack = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    const __m128i kAlpha = _mm_set1_epi32(0xFF000000);
+    size_t n = (len > 2)? (len - 2) & ~size_t(3) : 0;
+    for(size_t p = 0; p < n; p += 4) {
+        __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 3*p)), kUnpack);
+        _mm_storeu_si128((__m128i *)(dst + p), _mm_or_si128(v, kAlpha));
+    }
+    return n;
+}
+
+inline size_t Gray8FromU32(uint8_t * dst, const uint32_t * src, size_t len) {
+    size_t n = len & ~size_t(15);
+    for(size_t p = 0; p < n; p += 16) {
+        __m128i g0 = Gray8FromU32(_mm_loadu_si128((const __m128i *)(src + p + 0)));
+        __m128i g1 = Gray8FromU32(_mm_loadu_si128((const __m128i *)(src + p + 4)));
+        __m128i g2 = Gray8FromU32(_mm_loadu_si128((const __m128i *)(src + p + 8)));
+        __m128i g3 = Gray8FromU32(_mm_loadu_si128((const __m128i *)(src + p + 12)));
+        __m128i packed = _mm_packus_epi16(_mm_packus_epi32(g0, g1), _mm_packus_epi32(g2, g3));
+        _mm_storeu_si128((__m128i *)(dst + p), packed);
+    }
+    return n;
+}
+
+} // namespace sse41
+#endif // SSE4.1
+
+
+// *****************************************************************************
+// AVX2 kernels, 8 pixels per step
+// *****************************************************************************
+
+#if defined(PIXELCONV_X86) && defined(__SSE4_1__)
+#define PIXELCONV_AVX2 __attribute__((target("avx2")))
+namespace avx2 {
+
+PIXELCONV_AVX2 inline __m256 Saturate(__m256 c) {
+    return _mm256_min_ps(_mm256_max_ps(c, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+}
+
+PIXELCONV_AVX2 inline size_t RGBA32FromRGBAf(uint32_t * dst, const float * src, size_t len) {
+    const __m256 k255 = _mm256_set1_ps(255.0f);
+    // Packing works within 128 bit lanes, leaving even pixels in the low lane
+    // and odd pixels in the high lane
+    const __m256i kOrder = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    size_t n = len & ~size_t(7);
+    for(size_t p = 0; p < n; p += 8, src += 32) {
+        __m256i i0 = _mm256_cvtps_epi32(_mm256_mul_ps(Saturate(_mm256_loadu_ps(src + 0)), k255));
+        __m256i i1 = _mm256_cvtps_epi32(_mm256_mul_ps(Saturate(_mm256_loadu_ps(src + 8)), k255));
+        __m256i i2 = _mm256_cvtps_epi32(_mm256_mul_ps(Saturate(_mm256_loadu_ps(src + 16)), k255));
+        __m256i i3 = _mm256_cvtps_epi32(_mm256_mul_ps(Saturate(_mm256_loadu_ps(src + 24)), k255));
+        __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(i0, i1), _mm256_packs_epi32(i2, i3));
+        _mm256_storeu_si256((__m256i *)(dst + p), _mm256_permutevar8x32_epi32(packed, kOrder));
+    }
+    return n;
+}
+
+PIXELCONV_AVX2 inline size_t RGBAfFromRGBA32(float * dst, const uint32_t * src, size_t len) {
+    const __m256 kScale = _mm256_set1_ps(kInv255);
+    size_t n = len & ~size_t(7);
+    for(size_t p = 0; p < n; p += 8, dst += 32) {
+        for(int j = 0; j < 4; ++j) {
+            __m128i v = _mm_loadl_epi64((const __m128i *)(src + p + 2*j));
+            _mm256_storeu_ps(dst + 8*j, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v)), kScale));
+        }
+    }
+    return n;
+}
+
+PIXELCONV_AVX2 inline __m256i Gray8FromU32(__m256i v) {
+    const __m256i kMax = _mm256_set1_epi32(0xFF7F7F7F), kHalf = _mm256_set1_epi32(0x808080);
+    const __m256i kRecip = _mm256_set1_epi32(0xFF000001);
+    __m256i x = _mm256_add_epi32(_mm256_min_epu32(v, kMax), kHalf);
+    __m256i even = _mm256_srli_epi64(_mm256_mul_epu32(x, kRecip), 56);
+    __m256i odd = _mm256_srli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(x, 32), kRecip), 56);
+    return _mm256_or_si256(even, _mm256_slli_epi64(odd, 32));
+}
+
+PIXELCONV_AVX2 inline size_t RGBA32FromU32(uint32_t * dst, const uint32_t * src, size_t len) {
+    const __m256i kSpread = _mm256_set1_epi32(0x010101), kAlpha = _mm256_set1_epi32(0xFF000000);
+    size_t n = len & ~size_t(7);
+    for(size_t p = 0; p < n; p += 8) {
+        __m256i g = Gray8FromU32(_mm256_loadu_si256((const __m256i *)(src + p)));
+        _mm256_storeu_si256((__m256i *)(dst + p), _mm256_or_si256(_mm256_mullo_epi32(g, kSpread), kAlpha));
+    }
+    return n;
+}
+
+PIXELCONV_AVX2 inline size_t U32FromRGBA32(uint32_t * dst, const uint32_t * src, size_t len) {
+    const __m256i kRB = _mm256_set1_epi32(kLumR8 | (kLumB8 << 16)), kG = _mm256_set1_epi32(kLumG8);
+    const __m256i kMaskRB = _mm256_set1_epi32(0x00FF00FF), kMaskG = _mm256_set1_epi32(0xFF);
+    const __m256i kRound = _mm256_set1_epi32(128), kSpread = _mm256_set1_epi32(0x01010101);
+    size_t n = len & ~size_t(7);
+    for(size_t p = 0; p < n; p += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + p));
+        __m256i rb = _mm256_madd_epi16(_mm256_and_si256(v, kMaskRB), kRB);
+        __m256i g = _mm256_madd_epi16(_mm256_and_si256(_mm256_srli_epi32(v, 8), kMaskG), kG);
+        __m256i y = _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(rb, g), kRound), 8);
+        _mm256_storeu_si256((__m256i *)(dst + p), _mm256_mullo_epi32(y, kSpread));
+    }
+    return n;
+}
+
+PIXELCONV_AVX2 inline size_t RGBAfFromU32(float * dst, const uint32_t * src, size_t len) {
+    const __m256 kScale = _mm256_set1_ps(kInvU32), k65536 = _mm256_set1_ps(65536.0f);
+    const __m256i kLow = _mm256_set1_epi32(0xFFFF);
+    const __m256 kOne = _mm256_set1_ps(1.0f);
+    size_t n = len & ~size_t(7);
+    for(size_t p = 0; p < n; p += 8, dst += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + p));
+        __m256 hi = _mm256_cvtepi32_ps(_mm256_srli_epi32(v, 16));
+        __m256 lo = _mm256_cvtepi32_ps(_mm256_and_si256(v, kLow));
+        __m256 g = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(hi, k65536), lo), kScale);
+        // Broadcast gray levels into pixels, two pixels per store
+        __m256 g01 = _mm256_permutevar8x32_ps(g, _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1));
+        __m256 g23 = _mm256_permutevar8x32_ps(g, _mm256_setr_epi32(2, 2, 2, 2, 3, 3, 3, 3));
+        __m256 g45 = _mm256_permutevar8x32_ps(g, _mm256_setr_epi32(4, 4, 4, 4, 5, 5, 5, 5));
+        __m256 g67 = _mm256_permutevar8x32_ps(g, _mm256_setr_epi32(6, 6, 6, 6, 7, 7, 7, 7));
+        _mm256_storeu_ps(dst + 0, _mm256_blend_ps(g01, kOne, 0x88));
+        _mm256_storeu_ps(dst + 8, _mm256_blend_ps(g23, kOne, 0x88));
+        _mm256_storeu_ps(dst + 16, _mm256_blend_ps(g45, kOne, 0x88));
+        _mm256_storeu_ps(dst + 24, _mm256_blend_ps(g67, kOne, 0x88));
+    }
+    return n;
+}
+
+PIXELCONV_AVX2 inline size_t U32FromRGBAf(uint32_t * dst, const float * src, size_t len) {
+    // Weights laid out per pixel, pixels summed with horizontal adds. Alpha is
+    // masked out after weighting, as it may be NaN or infinite.
+    const __m256 kW = _mm256_setr_ps(kLumR, kLumG, kLumB, 0.0f, kLumR, kLumG, kLumB, 0.0f);
+    const __m256 kZero = _mm256_setzero_ps();
+    const __m256 kScale = _mm256_set1_ps(16777215.0f);
+    // After the adds, the low lane holds pixels 0, 2, 4, 6 and the high lane 1, 3, 5, 7
+    const __m256i kOrder = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    size_t n = len & ~size_t(7);
+    for(size_t p = 0; p < n; p += 8, src += 32) {
+        __m256 w0 = _mm256_blend_ps(_mm256_mul_ps(_mm256_loadu_ps(src + 0), kW), kZero, 0x88);
+        __m256 w1 = _mm256_blend_ps(_mm256_mul_ps(_mm256_loadu_ps(src + 8), kW), kZero, 0x88);
+        __m256 w2 = _mm256_blend_ps(_mm256_mul_ps(_mm256_loadu_ps(src + 16), kW), kZero, 0x88);
+        __m256 w3 = _mm256_blend_ps(_mm256_mul_ps(_mm256_loadu_ps(src + 24), kW), kZero, 0x88);
+        __m256 y = _mm256_hadd_ps(_mm256_hadd_ps(w0, w1), _mm256_hadd_ps(w2, w3));
+        y = _mm256_permutevar8x32_ps(y, kOrder);
+        __m256i y24 = _mm256_cvtps_epi32(_mm256_mul_ps(Saturate(y), kScale));
+        _mm256_storeu_si256((__m256i *)(dst + p), _mm256_or_si256(_mm256_slli_epi32(y24, 8), _mm256_srli_epi32(y24, 16)));
+    }
+    return n;
+}
+
+PIXELCONV_AVX2 inline size_t SwapRB32(uint32_t * dst, const uint32_t * src, size_t len) {
+    const __m256i kSwap = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                           2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    size_t n = len & ~size_t(7);
+    for(size_t p = 0; p < n; p += 8)
+        _mm256_storeu_si256((__m256i *)(dst + p), _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(src + p)), kSwap));
+    return n;
+}
+
+PIXELCONV_AVX2 inline size_t BGR24FromRGBA32(uint8_t * dst, const uint32_t * src, size_t len) {
+    // Each lane packs to 12 bytes, which the permute brings together
+    const __m256i kPack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                           2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i kOrder = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    size_t n = (len > 3)? (len - 3) & ~size_t(7) : 0;
+    for(size_t p = 0; p < n; p += 8) {
+        __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(src + p)), kPack);
+        _mm256_storeu_si256((__m256i *)(dst + 3*p), _mm256_permutevar8x32_epi32(v, kOrder));
+    }
+    return n;
+}
+
+PIXELCONV_AVX2 inline size_t RGBA32FromBGR24(uint32_t * dst, const uint8_t * src, size_t len) {
+    const __m256i kUnpack = _mm256_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+                                             2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    const __m256i kAlpha = _mm256_set1_epi32(0xFF000000);
+    size_t n = (len > 2)? (len - 2) & ~size_t(7) : 0;
+    for(size_t p = 0; p < n; p += 8) {
+        // Pixels 0-3 in the low lane, 4-7 in the high lane
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(src + 3*p))),
+                                            _mm_loadu_si128((const __m128i *)(src + 3*p + 12)), 1);
+        _mm256_storeu_si256((__m256i *)(dst + p), _mm256_or_si256(_mm256_shuffle_epi8(v, kUnpack), kAlpha));
+    }
+    return n;
+}
+
+PIXELCONV_AVX2 inline size_t Gray8FromU32(uint8_t * dst, const uint32_t * src, size_t len) {
+    size_t n = len & ~size_t(15);
+    for(size_t p = 0; p < n; p += 16) {
+        __m256i g0 = Gray8FromU32(_mm256_loadu_si256((const __m256i *)(src + p + 0)));
+        __m256i g1 = Gray8FromU32(_mm256_loadu_si256((const __m256i *)(src + p + 8)));
+        // Packing works within lanes, so pack the halves in order
+        __m128i w0 = _mm_packus_epi32(_mm256_castsi256_si128(g0), _mm256_extracti128_si256(g0, 1));
+        __m128i w1 = _mm_packus_epi32(_mm256_castsi256_si128(g1), _mm256_extracti128_si256(g1, 1));
+        _mm_storeu_si128((__m128i *)(dst + p), _mm_packus_epi16(w0, w1));
+    }
+    return n;
+}
+
+} // namespace avx2
+#undef PIXELCONV_AVX2
+#endif // AVX2
+
+
+// *****************************************************************************
+// Dispatch: vector kernels convert a multiple of their width and return the
+// count done, the remainder is converted by the scalar versions.
+// *****************************************************************************
+
+#if defined(PIXELCONV_X86) && defined(__SSE4_1__)
+#define PIXELCONV_DISPATCH(kernel, dst, src, len) \
+    (GetSIMDLevel() == kSIMDAVX2)? avx2::kernel(dst, src, len) : \
+    (GetSIMDLevel() == kSIMDSSE41)? sse41::kernel(dst, src, len) : 0
+#else
+#define PIXELCONV_DISPATCH(kernel, dst, src, len) 0
+#endif
+
+inline void RGBA32FromRGBAf(uint32_t * dst, const float * src, size_t len) {
+    for(size_t p = PIXELCONV_DISPATCH(RGBA32FromRGBAf, dst, src, len); p < len; ++p)
+        dst[p] = RGBA32FromRGBAf(src + 4*p);
+}
+
+inline void RGBAfFromRGBA32(float * dst, const uint32_t * src, size_t len) {
+    for(size_t p = PIXELCONV_DISPATCH(RGBAfFromRGBA32, dst, src, len); p < len; ++p)
+        RGBAfFromRGBA32(dst + 4*p, src[p]);
+}
+
+inline void RGBA32FromU32(uint32_t * dst, const uint32_t * src, size_t len) {
+    for(size_t p = PIXELCONV_DISPATCH(RGBA32FromU32, dst, src, len); p < len; ++p)
+        dst[p] = RGBA32FromU32(src[p]);
+}
+
+inline void U32FromRGBA32(uint32_t * dst, const uint32_t * src, size_t len) {
+    for(size_t p = PIXELCONV_DISPATCH(U32FromRGBA32, dst, src, len); p < len; ++p)
+        dst[p] = U32FromRGBA32(src[p]);
+}
+
+inline void RGBAfFromU32(float * dst, const uint32_t * src, size_t len) {
+    for(size_t p = PIXELCONV_DISPATCH(RGBAfFromU32, dst, src, len); p < len; ++p)
+        RGBAfFromU32(dst + 4*p, src[p]);
+}
+
+inline void U32FromRGBAf(uint32_t * dst, const float * src, size_t len) {
+    for(size_t p = PIXELCONV_DISPATCH(U32FromRGBAf, dst, src, len); p < len; ++p)
+        dst[p] = U32FromRGBAf(src + 4*p);
+}
+
+inline void SwapRB32(uint32_t * dst, const uint32_t * src, size_t len) {
+    for(size_t p = PIXELCONV_DISPATCH(SwapRB32, dst, src, len); p < len; ++p)
+        dst[p] = SwapRB32(src[p]);
+}
+
+inline void BGR24FromRGBA32(uint8_t * dst, const uint32_t * src, size_t len) {
+    for(size_t p = PIXELCONV_DISPATCH(BGR24FromRGBA32, dst, src, len); p < len; ++p)
+        BGR24FromRGBA32(dst + 3*p, src[p]);
+}
+
+inline void RGBA32FromBGR24(uint32_t * dst, const uint8_t * src, size_t len) {
+    for(size_t p = PIXELCONV_DISPATCH(RGBA32FromBGR24, dst, src, len); p < len; ++p)
+        dst[p] = RGBA32FromBGR24(src + 3*p);
+}
+
+inline void Gray8FromU32(uint8_t * dst, const uint32_t * src, size_t len) {
+    for(size_t p = PIXELCONV_DISPATCH(Gray8FromU32, dst, src, len); p < len; ++p)
+        dst[p] = Gray8FromU32(src[p]);
+}
+
+#undef PIXELCONV_DISPATCH
+
+} // namespace pixelconv
+} // namespace bigimage
+#endif // PIXELCONV_H
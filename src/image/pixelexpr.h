@@ -0,0 +1,294 @@
+
+// Lazy pixel expressions. Point operations on images are combined into an
+// expression tree, which Evaluate() computes in a single tile by tile pass:
+// each tile of each source image is read once, its pixels are taken through
+// the whole chain of operations while in cache, and the destination tile is
+// written once.
+//
+// D = (A*B + C)*0.5 as separate EachPixel()/BinOpTiles() passes reads and
+// writes every tile several times, which for images larger than memory means
+// faulting the backing files in again on every pass. The same as an expression:
+// Evaluate(d, (Pixels(a)*Pixels(b) + Pixels(c))*0.5f);
+//
+// Each node has a pixel type, and values of that pixel type's pixel_val_t.
+// Arithmetic operators work on values of the same type, and with scalars, so
+// packed pixel types such as RGBA32 are best converted first, such as with
+// Convert<PixelTypeRGBAf>(). The result is evaluated a row at a time and
+// converted to the destination's pixel type with CopyPixels(), so conversions
+// use its vector kernels. Other operations are given as functions of the forms
+// used by FilterPixels() and BinOp():
+// Map<pixT>(expr, void(dst_val_t & dst, const src_val_t & src))
+// Zip<pixT>(lhs, rhs, void(dst_val_t & dst, const lhs_val_t & lhs, const rhs_val_t & rhs))
+//
+// Nodes hold source images by reference, so an expression must not outlive
+// its images. The destination may also be a source.
+
+#ifndef PIXELEXPR_H
+#define PIXELEXPR_H
+
+#include <stdexcept>
+#include <type_traits>
+
+#include <boost/format.hpp>
+
+#include "pixeltype.h"
+#include "tile.h"
+#include "workerpool.h"
+
+namespace bigimage {
+
+// Base of all expression nodes. Nodes define:
+// typedef ... pixel_t;
+// typedef ... value_t;// pixel_t::pixel_val_t
+// typedef ... Cursor;// value_t operator[](size_t i) const, for pixel i of bound tile
+// bool Matches(int32_t w, int32_t h) const;// sources have size w x h
+// void Prefetch(TileInfo * const * run, size_t n) const;// sources at locations of run
+// Cursor Bind(int32_t x, int32_t y) const;// prepare source tiles at x, y for reading
+// void Release(const Cursor & c) const;// release source tiles of c
+template<typename exprT>
+struct PixelExpr {
+    const exprT & Self() const {return static_cast<const exprT &>(*this);}
+};
+
+// Pixels of an image
+template<typename imgT>
+class ImageExpr: public PixelExpr<ImageExpr<imgT>> {
+    imgT * image;
+    
+  public:
+    typedef typename imgT::pixel_t pixel_t;
+    typedef typename imgT::pixel_val_t value_t;
+    
+    struct Cursor {
+        typename imgT::TileInfo * ti;
+        value_t operator[](size_t i) const {return (*ti->pixels)[i];}
+    };
+    
+    ImageExpr(imgT & img): image(&img) {}
+    
+    bool Matches(int32_t w, int32_t h) const {return image->Width() == w && image->Height() == h;}
+    
+    template<typename TileInfoT>
+    void Prefetch(TileInfoT * const * run, size_t n) const {PrefetchMatching(*image, run, n);}
+    
+    Cursor Bind(int32_t x, int32_t y) const {
+        Cursor c{&image->GetTile(x, y)};
+        image->PrepareTile(*c.ti, kAccessRead);
+        return c;
+    }
+    void Release(const Cursor & c) const {image->ReleaseTile(*c.ti, kAccessRead);}
+};
+
+// Same value at every pixel
+template<typename pixT>
+class ConstantExpr: public PixelExpr<ConstantExpr<pixT>> {
+  public:
+    typedef pixT pixel_t;
+    typedef typename pixT::pixel_val_t value_t;
+    
+    struct Cursor {
+        value_t value;
+        value_t operator[](size_t i) const {return value;}
+    };
+    
+  private:
+    value_t value;
+    
+  public:
+    ConstantExpr(const value_t & v): value(v) {}
+    
+    bool Matches(int32_t w, int32_t h) const {return true;}
+    template<typename TileInfoT>
+    void Prefetch(TileInfoT * const * run, size_t n) const {}
+    Cursor Bind(int32_t x, int32_t y) const {return Cursor{value};}
+    void Release(const Cursor & c) const {}
+};
+
+// Function of one expression, giving values of pixel type pixT
+template<typename pixT, typename argT, typename fnT>
+class MapExpr: public PixelExpr<MapExpr<pixT, argT, fnT>> {
+    argT arg;
+    fnT fn;
+    
+  public:
+    typedef pixT pixel_t;
+    typedef typename pixT::pixel_val_t value_t;
+    
+    struct Cursor {
+        typename argT::Cursor arg;
+        const fnT * fn;
+        value_t operator[](size_t i) const {
+            value_t v;
+            (*fn)(v, arg[i]);
+            return v;
+        }
+    };
+    
+    MapExpr(const argT & a, const fnT & f): arg(a), fn(f) {}
+    
+    bool Matches(int32_t w, int32_t h) const {return arg.Matches(w, h);}
+    template<typename TileInfoT>
+    void Prefetch(TileInfoT * const * run, size_t n) const {arg.Prefetch(run, n);}
+    Cursor Bind(int32_t x, int32_t y) const {return Cursor{arg.Bind(x, y), &fn};}
+    void Release(const Cursor & c) const {arg.Release(c.arg);}
+};
+
+// Function of two expressions, giving values of pixel type pixT
+template<typename pixT, typename lhsT, typename rhsT, typename fnT>
+class ZipExpr: public PixelExpr<ZipExpr<pixT, lhsT, rhsT, fnT>> {
+    lhsT lhs;
+    rhsT rhs;
+    fnT fn;
+    
+  public:
+    typedef pixT pixel_t;
+    typedef typename pixT::pixel_val_t value_t;
+    
+    struct Cursor {
+        typename lhsT::Cursor lhs;
+        typename rhsT::Cursor rhs;
+        const fnT * fn;
+        value_t operator[](size_t i) const {
+            value_t v;
+            (*fn)(v, lhs[i], rhs[i]);
+            return v;
+        }
+    };
+    
+    ZipExpr(const lhsT & l, const rhsT & r, const fnT & f): lhs(l), rhs(r), fn(f) {}
+    
+    bool Matches(int32_t w, int32_t h) const {return lhs.Matches(w, h) && rhs.Matches(w, h);}
+    template<typename TileInfoT>
+    void Prefetch(TileInfoT * const * run, size_t n) const {
+        lhs.Prefetch(run, n);
+        rhs.Prefetch(run, n);
+    }
+    Cursor Bind(int32_t x, int32_t y) const {return Cursor{lhs.Bind(x, y), rhs.Bind(x, y), &fn};}
+    void Release(const Cursor & c) const {
+        lhs.Release(c.lhs);
+        rhs.Release(c.rhs);
+    }
+};
+
+
+// *****************************************************************************
+// Building expressions
+// *****************************************************************************
+
+template<typename imgT>
+ImageExpr<imgT> Pixels(imgT & image) {return ImageExpr<imgT>(image);}
+
+template<typename pixT>
+ConstantExpr<pixT> Constant(const typename pixT::pixel_val_t & value) {return ConstantExpr<pixT>(value);}
+
+// Map to pixel type pixT, by default the argument's own
+template<typename pixT = void, typename argT, typename fnT>
+auto Map(const PixelExpr<argT> & arg, const fnT & fn)
+    -> MapExpr<typename std::conditional<std::is_void<pixT>::value, typename argT::pixel_t, pixT>::type, argT, fnT>
+{
+    return {arg.Self(), fn};
+}
+
+template<typename pixT = void, typename lhsT, typename rhsT, typename fnT>
+auto Zip(const PixelExpr<lhsT> & lhs, const PixelExpr<rhsT> & rhs, const fnT & fn)
+    -> ZipExpr<typename std::conditional<std::is_void<pixT>::value, typename lhsT::pixel_t, pixT>::type, lhsT, rhsT, fnT>
+{
+    return {lhs.Self(), rhs.Self(), fn};
+}
+
+template<typename dpixT, typename spixT>
+struct ConvertOp {
+    void operator()(typename dpixT::pixel_val_t & dst, const typename spixT::pixel_val_t & src) const {
+        CopyPixel<dpixT, spixT>(dst, src);
+    }
+};
+
+// Convert to pixel type pixT with CopyPixel()
+template<typename pixT, typename argT>
+MapExpr<pixT, argT, ConvertOp<pixT, typename argT::pixel_t>> Convert(const PixelExpr<argT> & arg) {
+    return {arg.Self(), ConvertOp<pixT, typename argT::pixel_t>()};
+}
+
+// Arithmetic operators, for expressions of the same value type and for
+// expressions with scalars
+#define PIXELEXPR_OPERATOR(op, name) \
+    struct name { \
+        template<typename T> \
+        void operator()(T & dst, const T & lhs, const T & rhs) const {dst = lhs op rhs;} \
+    }; \
+    template<typename S> \
+    struct name##Scalar { \
+        S s; \
+        template<typename T> \
+        void operator()(T & dst, const T & lhs) const {dst = lhs op s;} \
+    }; \
+    template<typename S> \
+    struct Scalar##name { \
+        S s; \
+        template<typename T> \
+        void operator()(T & dst, const T & rhs) const {dst = s op rhs;} \
+    }; \
+    template<typename lhsT, typename rhsT> \
+    ZipExpr<typename lhsT::pixel_t, lhsT, rhsT, name> \
+    operator op(const PixelExpr<lhsT> & lhs, const PixelExpr<rhsT> & rhs) { \
+        static_assert(std::is_same<typename lhsT::value_t, typename rhsT::value_t>::value, \
+                      "operands must have the same value type"); \
+        return {lhs.Self(), rhs.Self(), name()}; \
+    } \
+    template<typename lhsT, typename S, typename = typename std::enable_if<std::is_arithmetic<S>::value>::type> \
+    MapExpr<typename lhsT::pixel_t, lhsT, name##Scalar<S>> \
+    operator op(const PixelExpr<lhsT> & lhs, S rhs) {return {lhs.Self(), name##Scalar<S>{rhs}};} \
+    template<typename S, typename rhsT, typename = typename std::enable_if<std::is_arithmetic<S>::value>::type> \
+    MapExpr<typename rhsT::pixel_t, rhsT, Scalar##name<S>> \
+    operator op(S lhs, const PixelExpr<rhsT> & rhs) {return {rhs.Self(), Scalar##name<S>{lhs}};}
+
+PIXELEXPR_OPERATOR(+, AddOp)
+PIXELEXPR_OPERATOR(-, SubOp)
+PIXELEXPR_OPERATOR(*, MulOp)
+PIXELEXPR_OPERATOR(/, DivOp)
+
+#undef PIXELEXPR_OPERATOR
+
+
+// *****************************************************************************
+// Evaluation
+// *****************************************************************************
+
+// Evaluate expression into dst in one pass over its tiles, in dst's memory
+// order. Sources must be the size of dst. Each run of tiles claimed by a worker
+// is prefetched in dst and all sources first, as with EachTileZip().
+template<typename dimgT, typename exprT>
+void Evaluate(dimgT & dst, const PixelExpr<exprT> & e, TileAccess access = kAccessWrite)
+{
+    typedef typename dimgT::pixel_t dpixel_t;
+    typedef typename exprT::pixel_t spixel_t;
+    const exprT & expr = e.Self();
+    if(!expr.Matches(dst.Width(), dst.Height()))
+        throw std::runtime_error((boost::format("Evaluate(): sources differ in size from %dx%d destination")%
+                                  dst.Width() % dst.Height()).str());
+    
+    auto & torder = dst.GetNaturalOrdering();
+    WorkerPool::Shared().ParallelForGuided(torder.size(), dst.GrainSize(), [&](int workerID, size_t begin, size_t end){
+        PrefetchMatching(dst, &torder[begin], end - begin);
+        expr.Prefetch(&torder[begin], end - begin);
+        for(size_t t = begin; t < end; ++t)
+        {
+            typename dimgT::TileInfo & ti = *torder[t];
+            if(!dst.PrepareTile(ti, access))
+                continue;
+            typename exprT::Cursor c = expr.Bind(ti.x, ti.y);
+            typename spixel_t::pixel_val_t row[kTileWidth];
+            for(int32_t y = 0; y < kTileHeight; ++y)
+            {
+                for(int32_t x = 0; x < kTileWidth; ++x)
+                    row[x] = c[y*kTileWidth + x];
+                CopyPixels<dpixel_t, spixel_t>(&(*ti.pixels)[y*kTileWidth], row, kTileWidth);
+            }
+            expr.Release(c);
+            dst.ReleaseTile(ti, access);
+        }
+    });
+}
+
+} // namespace bigimage
+#endif // PIXELEXPR_H
@@ -3,16 +3,26 @@
 #define PIXELTYPE_H
 
 #include <cfloat>
+#include <cstring>
 #include "math3d/vmath.h"
+#include "pixelconv.h"
 
 namespace bigimage {
 // *****************************************************************************
 // Pixel types
 // *****************************************************************************
 
+// Pixel type identifiers, as recorded in image files
+enum PixelTypeTag: uint32_t {
+    kPixelTagU32 = 1,
+    kPixelTagRGBA32 = 2,
+    kPixelTagRGBAf = 3
+};
+
 struct PixelTypeU32 {
     typedef uint32_t pixel_val_t;
     typedef uint32_t pixel_comp_t;
+    static const uint32_t kTag = kPixelTagU32;
     const int kChannels = 1;
     const pixel_comp_t kMaxValue = 0xFFFFFFFF;
     const pixel_comp_t kMinValue = 0x00000000;
@@ -23,6 +33,7 @@ struct PixelTypeU32 {
 struct PixelTypeRGBA32 {
     typedef uint32_t pixel_val_t;
     typedef uint8_t pixel_comp_t;
+    static const uint32_t kTag = kPixelTagRGBA32;
     const int kChannels = 4;
     const pixel_comp_t kMaxValue = 0xFF;
     const pixel_comp_t kMinValue = 0x00;
@@ -44,6 +55,7 @@ struct PixelTypeRGBA32 {
 struct PixelTypeRGBAf {
     typedef float4 pixel_val_t;
     typedef float pixel_comp_t;
+    static const uint32_t kTag = kPixelTagRGBAf;
     const int kChannels = 4;
     const pixel_comp_t kMaxValue = FLT_MAX;
     const pixel_comp_t kMinValue = FLT_MIN;
@@ -53,6 +65,9 @@ struct PixelTypeRGBAf {
 
 
 // *****************************************************************************
+// Conversion between pixel types. Specialized for every pair of the pixel
+// types above, see pixelconv.h for the conversions. CopyPixels() uses vector
+// kernels where the CPU has them.
 template<typename dpixT, typename spixT>
 void CopyPixels(typename dpixT::pixel_val_t * dst, const typename spixT::pixel_val_t * src, size_t len);
 
@@ -61,46 +76,115 @@ void CopyPixel(typename dpixT::pixel_val_t & dst, const typename spixT::pixel_va
 
 
 template<>
-void CopyPixels<PixelTypeRGBA32, PixelTypeRGBA32>(uint32_t * dst, const uint32_t * src, size_t len)
-{
+inline void CopyPixels<PixelTypeRGBA32, PixelTypeRGBA32>(uint32_t * dst, const uint32_t * src, size_t len) {
+    memcpy(dst, src, len*sizeof(uint32_t));
+}
+
+template<>
+inline void CopyPixels<PixelTypeU32, PixelTypeU32>(uint32_t * dst, const uint32_t * src, size_t len) {
     memcpy(dst, src, len*sizeof(uint32_t));
 }
 
+template<>
+inline void CopyPixels<PixelTypeRGBAf, PixelTypeRGBAf>(float4 * dst, const float4 * src, size_t len) {
+    memcpy(dst, src, len*sizeof(float4));
+}
+
+template<>
+inline void CopyPixels<PixelTypeRGBA32, PixelTypeRGBAf>(uint32_t * dst, const float4 * src, size_t len) {
+    pixelconv::RGBA32FromRGBAf(dst, reinterpret_cast<const float *>(src), len);
+}
+
+template<>
+inline void CopyPixels<PixelTypeRGBAf, PixelTypeRGBA32>(float4 * dst, const uint32_t * src, size_t len) {
+    pixelconv::RGBAfFromRGBA32(reinterpret_cast<float *>(dst), src, len);
+}
+
+template<>
+inline void CopyPixels<PixelTypeRGBA32, PixelTypeU32>(uint32_t * dst, const uint32_t * src, size_t len) {
+    pixelconv::RGBA32FromU32(dst, src, len);
+}
+
+template<>
+inline void CopyPixels<PixelTypeU32, PixelTypeRGBA32>(uint32_t * dst, const uint32_t * src, size_t len) {
+    pixelconv::U32FromRGBA32(dst, src, len);
+}
 
 template<>
-void CopyPixel<PixelTypeRGBA32, PixelTypeRGBAf>(uint32_t & dst, const float4 & src) {
-    dst = (((uint32_t)(src[0]*255) << 0) & 0x000000FF) |
-          (((uint32_t)(src[1]*255) << 8) & 0x0000FF00) |
-          (((uint32_t)(src[2]*255) << 16) & 0x00FF0000) |
-          (((uint32_t)(src[3]*255) << 24) & 0xFF000000);
+inline void CopyPixels<PixelTypeRGBAf, PixelTypeU32>(float4 * dst, const uint32_t * src, size_t len) {
+    pixelconv::RGBAfFromU32(reinterpret_cast<float *>(dst), src, len);
 }
 
 template<>
-void CopyPixels<PixelTypeRGBA32, PixelTypeRGBAf>(uint32_t * dst, const float4 * src, size_t len) {
-    for(int32_t p = 0; p < len; ++p)
-        CopyPixel<PixelTypeRGBA32, PixelTypeRGBAf>(*dst++, *src++);
+inline void CopyPixels<PixelTypeU32, PixelTypeRGBAf>(uint32_t * dst, const float4 * src, size_t len) {
+    pixelconv::U32FromRGBAf(dst, reinterpret_cast<const float *>(src), len);
+}
+
+
+template<>
+inline void CopyPixel<PixelTypeRGBA32, PixelTypeRGBA32>(uint32_t & dst, const uint32_t & src) {dst = src;}
+
+template<>
+inline void CopyPixel<PixelTypeU32, PixelTypeU32>(uint32_t & dst, const uint32_t & src) {dst = src;}
+
+template<>
+inline void CopyPixel<PixelTypeRGBAf, PixelTypeRGBAf>(float4 & dst, const float4 & src) {dst = src;}
+
+template<>
+inline void CopyPixel<PixelTypeRGBA32, PixelTypeRGBAf>(uint32_t & dst, const float4 & src) {
+    dst = pixelconv::RGBA32FromRGBAf(reinterpret_cast<const float *>(&src));
+}
+
+template<>
+inline void CopyPixel<PixelTypeRGBAf, PixelTypeRGBA32>(float4 & dst, const uint32_t & src) {
+    pixelconv::RGBAfFromRGBA32(reinterpret_cast<float *>(&dst), src);
+}
+
+template<>
+inline void CopyPixel<PixelTypeRGBA32, PixelTypeU32>(uint32_t & dst, const uint32_t & src) {
+    dst = pixelconv::RGBA32FromU32(src);
+}
+
+template<>
+inline void CopyPixel<PixelTypeU32, PixelTypeRGBA32>(uint32_t & dst, const uint32_t & src) {
+    dst = pixelconv::U32FromRGBA32(src);
+}
+
+template<>
+inline void CopyPixel<PixelTypeRGBAf, PixelTypeU32>(float4 & dst, const uint32_t & src) {
+    pixelconv::RGBAfFromU32(reinterpret_cast<float *>(&dst), src);
+}
+
+template<>
+inline void CopyPixel<PixelTypeU32, PixelTypeRGBAf>(uint32_t & dst, const float4 & src) {
+    dst = pixelconv::U32FromRGBAf(reinterpret_cast<const float *>(&src));
 }
 
 // *****************************************************************************
 
+// Filter len pixels of src into dst, with function of form
+// void(dst_val_t & dst, const src_val_t & src)
 template<typename dpixT, typename spixT, typename fn_t>
-void FilterPixels(typename dpixT::pixel_val_t * dst, const typename spixT::pixel_val_t * src, size_t len, fn_t & fn) {
-    for(int32_t p = 0; p < len; ++p)
-        fn(*dst++, *src++, fn);
+void FilterPixels(typename dpixT::pixel_val_t * dst, const typename spixT::pixel_val_t * src, size_t len, const fn_t & fn) {
+    for(size_t p = 0; p < len; ++p)
+        fn(dst[p], src[p]);
 }
 
 
 // *****************************************************************************
 
 
-template<typename dpixT, typename spixT, typename fn_t>
+// Combine len pixels of lhs and rhs into dst, with function of form
+// void(dst_val_t & dst, const lhs_val_t & lhs, const rhs_val_t & rhs)
+// rhs has the pixel type of lhs unless given.
+template<typename dpixT, typename lpixT, typename rpixT = lpixT, typename fn_t>
 void BinOp(typename dpixT::pixel_val_t * dst,
-           const typename spixT::pixel_val_t * lhs,
-           const typename spixT::pixel_val_t * rhs,
-           size_t len, fn_t & fn)
+           const typename lpixT::pixel_val_t * lhs,
+           const typename rpixT::pixel_val_t * rhs,
+           size_t len, const fn_t & fn)
 {
-    for(int32_t p = 0; p < len; ++p)
-        fn(*dst++, *lhs++, *rhs++);
+    for(size_t p = 0; p < len; ++p)
+        fn(dst[p], lhs[p], rhs[p]);
 }
 
 
@@ -0,0 +1,403 @@
+
+// Demand driven image pipelines. A pipeline is a graph of nodes, each of which
+// produces tiles of its output from tiles of its inputs. Nothing is computed
+// until pixels are requested: GetPixels() for a rect computes only the output
+// tiles overlapping it, and each of those pulls only the input tiles it needs
+// from upstream, as given by InputRect(). The cost of showing a viewport is
+// thus proportional to the viewport rather than to the image.
+//
+// Computed tiles are kept in a cache bounded to a number of tiles per node,
+// evicting the least recently used tiles not currently in use, so repeated or
+// overlapping requests, such as those of a viewer panning across an image,
+// only compute new tiles. Sources read tiles of a BigImage directly.
+//
+// Nodes refer to their inputs by reference, and must not outlive them. Nodes
+// are built with the Make*() functions:
+// auto src = MakeSource(image);
+// auto lum = MakeMap<PixelTypeRGBAf>(*src, void(dst_val_t & dst, const src_val_t & src));
+// auto blur = MakeNeighborhood<PixelTypeRGBAf>(*lum, radius,
+//     void(dst_val_t & dst, int32_t x, int32_t y, const Sampler & src));
+// blur->GetPixels<PixelTypeRGBA32>(viewRect, viewPixels);
+//
+// Cached tiles do not track changes to source images. After modifying a
+// source, Invalidate() the nodes downstream of it.
+
+#ifndef PULLGRAPH_H
+#define PULLGRAPH_H
+
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <list>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include "pixeltype.h"
+#include "tile.h"
+#include "tilepool.h"
+#include "rect.h"
+#include "workerpool.h"
+
+namespace bigimage {
+
+// Default limit on cached tiles per node
+const size_t kDefaultPullCacheTiles = 1024;
+
+// *****************************************************************************
+// PullNode
+// *****************************************************************************
+
+template<typename pixT>
+class PullNode {
+  public:
+    typedef pixT pixel_t;
+    typedef typename pixT::pixel_val_t pixel_val_t;
+    typedef Tile<pixT> Tile;
+    
+    struct Stats {
+        size_t computed;// tiles computed
+        size_t hits;// requests served from the cache
+        size_t evictions;
+    };
+    
+  protected:
+    struct Entry {
+        Tile * tile;
+        uint32_t users;
+        bool ready;
+        std::list<int32_t>::iterator idlePos;// place in idle while there are no users
+    };
+    
+    int32_t width, height;
+    int32_t xtiles, ytiles;
+    size_t capacity;
+    
+    std::unordered_map<int32_t, Entry> entries;// by linear tile index
+    std::list<int32_t> idle;// ready entries with no users, least recently used first
+    std::mutex mtx;
+    std::condition_variable tileReady;
+    Stats stats;
+    TilePool pool;
+    
+    // Evict idle tiles, least recently used first, until there is room for
+    // another. The cache may go over capacity if all tiles are in use or
+    // being computed.
+    void MakeRoom();
+    
+    // Compute tile at tile coordinates tx, ty. Called without the cache locked,
+    // and possibly on several workers at once for different tiles.
+    virtual void ComputeTile(int32_t tx, int32_t ty, pixel_val_t * out) = 0;
+    
+  public:
+    PullNode(int32_t w, int32_t h, size_t cacheTiles = kDefaultPullCacheTiles);
+    virtual ~PullNode();
+    
+    int32_t Width() const {return width;}
+    int32_t Height() const {return height;}
+    
+    // Region of input needed to produce the out region of output
+    virtual Rect InputRect(const Rect & out) const {return out;}
+    
+    // Get pixels of tile at tile coordinates tx, ty, computing it if not
+    // cached. The tile stays valid until released.
+    virtual const pixel_val_t * AcquireTile(int32_t tx, int32_t ty);
+    virtual void ReleaseTile(int32_t tx, int32_t ty);
+    
+    // Get pixels as linear pixel data, computing the tiles overlapping rect in
+    // parallel. Pixels array must be allocated by caller.
+    template<typename dpixelT>
+    void GetPixels(const Rect & rect, typename dpixelT::pixel_val_t * pixels);
+    
+    // Drop cached tiles, such as after a source changed. Must not be called
+    // while tiles are in use.
+    void Invalidate();
+    
+    void SetCacheTiles(size_t tiles) {capacity = tiles;}
+    
+    Stats GetStats() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return stats;
+    }
+};
+
+
+// *****************************************************************************
+// Nodes
+// *****************************************************************************
+
+// Pixels of a BigImage, read through its tile manager. Not cached.
+template<typename imgT>
+class SourceNode: public PullNode<typename imgT::pixel_t> {
+    typedef PullNode<typename imgT::pixel_t> base_t;
+    typedef typename base_t::pixel_val_t pixel_val_t;
+    imgT & image;
+    
+    void ComputeTile(int32_t tx, int32_t ty, pixel_val_t * out) {}
+    
+  public:
+    SourceNode(imgT & img): base_t(img.Width(), img.Height(), 0), image(img) {}
+    
+    const pixel_val_t * AcquireTile(int32_t tx, int32_t ty) {
+        auto & ti = image.GetTiles()[ty*this->xtiles + tx];
+        image.PrepareTile(ti, kAccessRead);
+        return &(*ti.pixels)[0];
+    }
+    void ReleaseTile(int32_t tx, int32_t ty) {
+        image.ReleaseTile(image.GetTiles()[ty*this->xtiles + tx], kAccessRead);
+    }
+};
+
+// Point operation, with function of form
+// void(dst_val_t & dst, const src_val_t & src)
+template<typename pixT, typename spixT, typename fnT>
+class MapNode: public PullNode<pixT> {
+    typedef typename PullNode<pixT>::pixel_val_t pixel_val_t;
+    PullNode<spixT> & input;
+    fnT fn;
+    
+    void ComputeTile(int32_t tx, int32_t ty, pixel_val_t * out) {
+        const typename spixT::pixel_val_t * in = input.AcquireTile(tx, ty);
+        FilterPixels<pixT, spixT>(out, in, kTilePixels, fn);
+        input.ReleaseTile(tx, ty);
+    }
+    
+  public:
+    MapNode(PullNode<spixT> & in, const fnT & f, size_t cacheTiles = kDefaultPullCacheTiles):
+        PullNode<pixT>(in.Width(), in.Height(), cacheTiles), input(in), fn(f)
+    {}
+};
+
+// Binary point operation on inputs of the same size, with function of form
+// void(dst_val_t & dst, const lhs_val_t & lhs, const rhs_val_t & rhs)
+template<typename pixT, typename lpixT, typename rpixT, typename fnT>
+class BinOpNode: public PullNode<pixT> {
+    typedef typename PullNode<pixT>::pixel_val_t pixel_val_t;
+    PullNode<lpixT> & lhs;
+    PullNode<rpixT> & rhs;
+    fnT fn;
+    
+    void ComputeTile(int32_t tx, int32_t ty, pixel_val_t * out) {
+        const typename lpixT::pixel_val_t * l = lhs.AcquireTile(tx, ty);
+        const typename rpixT::pixel_val_t * r = rhs.AcquireTile(tx, ty);
+        BinOp<pixT, lpixT, rpixT>(out, l, r, kTilePixels, fn);
+        rhs.ReleaseTile(tx, ty);
+        lhs.ReleaseTile(tx, ty);
+    }
+    
+  public:
+    BinOpNode(PullNode<lpixT> & l, PullNode<rpixT> & r, const fnT & f, size_t cacheTiles = kDefaultPullCacheTiles):
+        PullNode<pixT>(l.Width(), l.Height(), cacheTiles), lhs(l), rhs(r), fn(f)
+    {}
+};
+
+// Input pixels within radius of each output pixel, read through a Sampler
+// clamping coordinates to the image.
+template<typename spixT>
+struct PullSampler {
+    typedef typename spixT::pixel_val_t pixel_val_t;
+    const pixel_val_t * const * tiles;// tiles of input rect, row by row
+    int32_t tx0, ty0, ntx;// tile coordinates of first tile, tiles per row
+    int32_t w, h;
+    
+    pixel_val_t operator()(int32_t x, int32_t y) const {
+        x = std::min(std::max(x, 0), w - 1);
+        y = std::min(std::max(y, 0), h - 1);
+        const pixel_val_t * tile = tiles[(y/kTileHeight - ty0)*ntx + (x/kTileWidth - tx0)];
+        return tile[(y % kTileHeight)*kTileWidth + x % kTileWidth];
+    }
+};
+
+// Neighborhood operation, with function of form
+// void(dst_val_t & dst, int32_t x, int32_t y, const PullSampler<spixT> & src)
+template<typename pixT, typename spixT, typename fnT>
+class NeighborhoodNode: public PullNode<pixT> {
+    typedef typename PullNode<pixT>::pixel_val_t pixel_val_t;
+    PullNode<spixT> & input;
+    int32_t radius;
+    fnT fn;
+    
+    void ComputeTile(int32_t tx, int32_t ty, pixel_val_t * out);
+    
+  public:
+    NeighborhoodNode(PullNode<spixT> & in, int32_t r, const fnT & f, size_t cacheTiles = kDefaultPullCacheTiles):
+        PullNode<pixT>(in.Width(), in.Height(), cacheTiles), input(in), radius(r), fn(f)
+    {}
+    
+    Rect InputRect(const Rect & out) const {
+        Rect r(out.x - radius, out.y - radius, out.w + 2*radius, out.h + 2*radius);
+        return r.Intersect(0, 0, this->width, this->height);
+    }
+};
+
+
+template<typename imgT>
+std::unique_ptr<SourceNode<imgT>> MakeSource(imgT & image) {
+    return std::unique_ptr<SourceNode<imgT>>(new SourceNode<imgT>(image));
+}
+
+template<typename pixT, typename spixT, typename fnT>
+std::unique_ptr<MapNode<pixT, spixT, fnT>> MakeMap(PullNode<spixT> & input, const fnT & fn,
+                                                   size_t cacheTiles = kDefaultPullCacheTiles)
+{
+    return std::unique_ptr<MapNode<pixT, spixT, fnT>>(new MapNode<pixT, spixT, fnT>(input, fn, cacheTiles));
+}
+
+template<typename pixT, typename lpixT, typename rpixT, typename fnT>
+std::unique_ptr<BinOpNode<pixT, lpixT, rpixT, fnT>> MakeBinOp(PullNode<lpixT> & lhs, PullNode<rpixT> & rhs,
+                                                              const fnT & fn, size_t cacheTiles = kDefaultPullCacheTiles)
+{
+    return std::unique_ptr<BinOpNode<pixT, lpixT, rpixT, fnT>>(
+        new BinOpNode<pixT, lpixT, rpixT, fnT>(lhs, rhs, fn, cacheTiles));
+}
+
+template<typename pixT, typename spixT, typename fnT>
+std::unique_ptr<NeighborhoodNode<pixT, spixT, fnT>> MakeNeighborhood(PullNode<spixT> & input, int32_t radius,
+                                                                     const fnT & fn,
+                                                                     size_t cacheTiles = kDefaultPullCacheTiles)
+{
+    return std::unique_ptr<NeighborhoodNode<pixT, spixT, fnT>>(
+        new NeighborhoodNode<pixT, spixT, fnT>(input, radius, fn, cacheTiles));
+}
+
+
+// *****************************************************************************
+// PullNode implementation
+// *****************************************************************************
+
+template<typename pixT>
+PullNode<pixT>::PullNode(int32_t w, int32_t h, size_t cacheTiles):
+    width(w), height(h),
+    xtiles((w + kTileWidth - 1)/kTileWidth), ytiles((h + kTileHeight - 1)/kTileHeight),
+    capacity(cacheTiles),
+    stats{0, 0, 0}
+{}
+
+template<typename pixT>
+PullNode<pixT>::~PullNode()
+{
+    Invalidate();
+}
+
+template<typename pixT>
+auto PullNode<pixT>::MakeRoom() -> void
+{
+    while(entries.size() >= capacity && !idle.empty())
+    {
+        auto victim = entries.find(idle.front());
+        idle.pop_front();
+        pool.Free(victim->second.tile);
+        entries.erase(victim);
+        ++stats.evictions;
+    }
+}
+
+template<typename pixT>
+auto PullNode<pixT>::AcquireTile(int32_t tx, int32_t ty) -> const pixel_val_t *
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    auto e = entries.find(ty*xtiles + tx);
+    if(e != entries.end()) {
+        // Cached, or being computed by another worker
+        Entry & entry = e->second;
+        if(entry.users++ == 0 && entry.ready)
+            idle.erase(entry.idlePos);
+        ++stats.hits;
+        tileReady.wait(lock, [&]{return entry.ready;});
+        return &entry.tile->pixels[0];
+    }
+    
+    MakeRoom();
+    // Entries are stable in memory while others are added and removed
+    Entry & entry = entries[ty*xtiles + tx];
+    entry = Entry{new(pool.Alloc(sizeof(Tile))) Tile, 1, false, idle.end()};
+    ++stats.computed;
+    lock.unlock();
+    
+    ComputeTile(tx, ty, &entry.tile->pixels[0]);
+    
+    lock.lock();
+    entry.ready = true;
+    tileReady.notify_all();
+    return &entry.tile->pixels[0];
+}
+
+template<typename pixT>
+auto PullNode<pixT>::ReleaseTile(int32_t tx, int32_t ty) -> void
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    // Tiles being computed have a user until ready
+    int32_t key = ty*xtiles + tx;
+    Entry & entry = entries.find(key)->second;
+    if(--entry.users == 0)
+        entry.idlePos = idle.insert(idle.end(), key);
+}
+
+template<typename pixT>
+auto PullNode<pixT>::Invalidate() -> void
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    for(auto & e : entries)
+        pool.Free(e.second.tile);
+    entries.clear();
+    idle.clear();
+}
+
+template<typename pixT>
+template<typename dpixelT>
+auto PullNode<pixT>::GetPixels(const Rect & rect, typename dpixelT::pixel_val_t * pixels) -> void
+{
+    // Range of tiles overlapping rect, clipped to image
+    int32_t tx0 = std::max(rect.x, 0)/kTileWidth;
+    int32_t ty0 = std::max(rect.y, 0)/kTileHeight;
+    int32_t tx1 = std::min((rect.x + rect.w + kTileWidth - 1)/kTileWidth, xtiles);
+    int32_t ty1 = std::min((rect.y + rect.h + kTileHeight - 1)/kTileHeight, ytiles);
+    if(rect.w <= 0 || rect.h <= 0 || tx0 >= tx1 || ty0 >= ty1)
+        return;
+    
+    int32_t ntx = tx1 - tx0;
+    WorkerPool::Shared().ParallelForGuided(ntx*(ty1 - ty0), 0, [&](int workerID, size_t begin, size_t end){
+        for(size_t t = begin; t < end; ++t)
+        {
+            int32_t tx = tx0 + int32_t(t) % ntx, ty = ty0 + int32_t(t)/ntx;
+            Rect tr = rect.Intersect(tx*kTileWidth, ty*kTileHeight, kTileWidth, kTileHeight);
+            int32_t sx = tr.x - tx*kTileWidth, sy = tr.y - ty*kTileHeight;// relative to tile
+            int32_t dx = tr.x - rect.x, dy = tr.y - rect.y;// relative to destination rect
+            const pixel_val_t * tile = AcquireTile(tx, ty);
+            for(int32_t y = 0; y < tr.h; ++y)
+                CopyPixels<dpixelT, pixT>(pixels + (dy + y)*rect.w + dx, tile + (sy + y)*kTileWidth + sx, tr.w);
+            ReleaseTile(tx, ty);
+        }
+    });
+}
+
+template<typename pixT, typename spixT, typename fnT>
+auto NeighborhoodNode<pixT, spixT, fnT>::ComputeTile(int32_t tx, int32_t ty, pixel_val_t * out) -> void
+{
+    Rect ir = InputRect(Rect(tx*kTileWidth, ty*kTileHeight, kTileWidth, kTileHeight));
+    PullSampler<spixT> src;
+    src.tx0 = ir.x/kTileWidth;
+    src.ty0 = ir.y/kTileHeight;
+    src.ntx = (ir.x + ir.w + kTileWidth - 1)/kTileWidth - src.tx0;
+    int32_t nty = (ir.y + ir.h + kTileHeight - 1)/kTileHeight - src.ty0;
+    src.w = this->width;
+    src.h = this->height;
+    
+    std::vector<const typename spixT::pixel_val_t *> tiles(src.ntx*nty);
+    for(int32_t j = 0; j < nty; ++j)
+    for(int32_t i = 0; i < src.ntx; ++i)
+        tiles[j*src.ntx + i] = input.AcquireTile(src.tx0 + i, src.ty0 + j);
+    src.tiles = &tiles[0];
+    
+    int32_t p = 0;
+    for(int32_t y = 0; y < kTileHeight; ++y)
+    for(int32_t x = 0; x < kTileWidth; ++x)
+        fn(out[p++], tx*kTileWidth + x, ty*kTileHeight + y, src);
+    
+    for(int32_t j = 0; j < nty; ++j)
+    for(int32_t i = 0; i < src.ntx; ++i)
+        input.ReleaseTile(src.tx0 + i, src.ty0 + j);
+}
+
+} // namespace bigimage
+#endif // PULLGRAPH_H
@@ -0,0 +1,351 @@
+
+// Multi-resolution image pyramids. Each level is a BigImage of half the size
+// of the one before, down to a single tile, with level 0 being the original
+// image. Levels are built on first access, each from the level above it, and
+// kept in their own backing files next to a small header recording which
+// levels are complete, so reopening a pyramid doesn't rebuild them.
+//
+// Downsample2x() builds one level from another, tile by tile in parallel.
+// Each destination tile is filtered from the 2x2 block of source tiles behind
+// it, plus for kPyramidLanczos a few pixels of apron around that block. Level
+// sizes are rounded up to a whole number of tiles, the extra pixels repeating
+// the edge of the level above.
+//
+// Levels are not updated when the original image changes; call Invalidate()
+// to have them rebuilt. Persisted levels require a tile manager that keeps its
+// backing file as is when reopened, which TileSparseManager doesn't.
+
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <boost/format.hpp>
+
+#include "tile.h"
+#include "tilefile.h"
+#include "tilepool.h"
+#include "apron.h"
+#include "convolve.h"
+#include "workerpool.h"
+
+namespace bigimage {
+
+enum PyramidFilter {
+    kPyramidBox,// mean of each 2x2 block
+    kPyramidLanczos// Lanczos-2, 8 taps per axis
+};
+
+// Size of the level below one of size n pixels, along x or y
+inline int32_t PyramidHalfSize(int32_t n, int32_t tileSize)
+{
+    return ((n + 1)/2 + tileSize - 1)/tileSize*tileSize;
+}
+
+// Taps of the 2x downsampling filter, applied from the first pixel of each
+// output pixel's 2x2 block less taps.size()/2 - 1.
+inline std::vector<float> PyramidTaps(PyramidFilter filter)
+{
+    if(filter == kPyramidBox)
+        return {0.5f, 0.5f};
+    
+    // sinc(x)*sinc(x/2) at the 8 source pixel centers nearest the output
+    // pixel center, in output pixel units
+    std::vector<float> taps(8);
+    double sum = 0;
+    for(int32_t t = 0; t < 8; ++t) {
+        double x = (t - 3.5)/2.0, px = M_PI*x;
+        sum += taps[t] = std::sin(px)/px*std::sin(px/2)/(px/2);
+    }
+    for(float & k : taps)
+        k /= sum;
+    return taps;
+}
+
+// Downsample src by 2 into dst, which must be of size PyramidHalfSize() of
+// src. Images must be distinct.
+template<typename imgT>
+void Downsample2x(imgT & dst, imgT & src, PyramidFilter filter = kPyramidBox)
+{
+    typedef typename imgT::pixel_val_t pixel_val_t;
+    typedef ConvTraits<typename imgT::pixel_t> traits;
+    typedef typename traits::work_t work_t;
+    
+    if(dst.Width() != PyramidHalfSize(src.Width(), kTileWidth) ||
+       dst.Height() != PyramidHalfSize(src.Height(), kTileHeight))
+        throw std::runtime_error((boost::format("Downsample2x(): %dx%d destination is not half of %dx%d source")%
+                                  dst.Width() % dst.Height() % src.Width() % src.Height()).str());
+    if(static_cast<void *>(&dst) == static_cast<void *>(&src))
+        throw std::runtime_error("Downsample2x(): source and destination must be distinct images");
+    
+    const std::vector<float> taps = PyramidTaps(filter);
+    const int32_t ntaps = taps.size(), r = ntaps/2 - 1;
+    // Source block of each tile with apron, gathered around its center
+    const int32_t rx = kTileWidth/2 + r, ry = kTileHeight/2 + r;
+    const int32_t aw = kTileWidth + 2*rx, ah = kTileHeight + 2*ry;
+    
+    // Apron pixels, and per-thread rows of the apron, the horizontally
+    // filtered apron and a row of accumulators
+    TilePool aprons;
+    WorkerLocal<std::vector<work_t>> work;
+    dst.EachTile([&](typename imgT::TileInfo & ti){
+        std::vector<work_t> & buf = work.Local();
+        buf.resize(aw + ah*kTileWidth + kTileWidth);
+        work_t * line = &buf[0], * half = &buf[aw], * acc = &buf[aw + ah*kTileWidth];
+        
+        pixel_val_t * apron = static_cast<pixel_val_t *>(aprons.Alloc(aw*ah*sizeof(pixel_val_t)));
+        GatherApron(src, 2*ti.x + kTileWidth/2, 2*ti.y + kTileHeight/2, rx, ry, kEdgeClamp, pixel_val_t(), apron);
+        for(int32_t y = 0; y < ah; ++y)
+        {
+            traits::Load(line, apron + y*aw, aw);
+            work_t * out = half + y*kTileWidth;
+            std::fill(out, out + kTileWidth, work_t());
+            for(int32_t t = 0; t < ntaps; ++t) {
+                float k = taps[t];
+                for(int32_t x = 0; x < kTileWidth; ++x)
+                    out[x] += k*line[2*x + t];
+            }
+        }
+        aprons.Free(apron);
+        
+        for(int32_t y = 0; y < kTileHeight; ++y)
+        {
+            std::fill(acc, acc + kTileWidth, work_t());
+            for(int32_t t = 0; t < ntaps; ++t) {
+                float k = taps[t];
+                const work_t * in = half + (2*y + t)*kTileWidth;
+                for(int32_t x = 0; x < kTileWidth; ++x)
+                    acc[x] += k*in[x];
+            }
+            traits::Store(&(*ti.pixels)[y*kTileWidth], acc, kTileWidth);
+        }
+    });
+}
+
+
+// *****************************************************************************
+// BigImagePyramid
+// *****************************************************************************
+
+// Pyramid over an image, which must outlive it. Level files are named after
+// backingFilePath with the level number appended, as "<path>.1", and the
+// header is kept at backingFilePath itself. Levels the header records as built
+// are rebuilt if their files are missing, or aren't kept when opened. With no
+// backing file path, levels are kept in memory, or as the tile manager keeps
+// unbacked images.
+//
+// Level() builds levels under a lock, so may be called from multiple threads,
+// but not from within tile traversals on the shared worker pool.
+template<typename imgT>
+class BigImagePyramid {
+  public:
+    typedef imgT image_t;
+    
+  protected:
+    struct Header {
+        char magic[8];
+        int32_t width, height;
+        uint32_t pixelBytes;
+        uint32_t filter;
+        uint64_t built;// bit per level
+    };
+    
+    image_t & base;
+    std::string backingFilePath;
+    PyramidFilter filter;
+    int fd;
+    std::vector<std::pair<int32_t, int32_t>> sizes;
+    std::vector<std::unique_ptr<image_t>> levels;// null for level 0 and levels not yet opened
+    uint64_t built;
+    std::mutex mtx;
+    
+    std::string LevelPath(int32_t level) const {
+        return (backingFilePath == "")? "" : (boost::format("%s.%d")% backingFilePath % level).str();
+    }
+    // Read the header of a level file holding the whole of an image
+    static bool ReadLevelHeader(const std::string & path, TileFileHeader & hdr);
+    // Mark level and those below it as not built
+    void Unbuilt(int32_t level);
+    
+    image_t & Open(int32_t level);
+    void WriteHeader();
+    
+  public:
+    BigImagePyramid(image_t & base, const std::string & backingFilePath, PyramidFilter filter = kPyramidBox);
+    ~BigImagePyramid();
+    
+    // Number of levels, including the original image
+    int32_t NumLevels() const {return sizes.size();}
+    std::tuple<int32_t, int32_t> LevelSize(int32_t level) const {
+        return std::make_tuple(sizes[level].first, sizes[level].second);
+    }
+    
+    bool IsBuilt(int32_t level) {
+        std::lock_guard<std::mutex> lock(mtx);
+        return (built >> level) & 1;
+    }
+    
+    // Get level, building it and any levels above it that aren't yet built
+    image_t & Level(int32_t level);
+    
+    // Mark all levels as out of date, to be rebuilt on next access
+    void Invalidate();
+};
+
+template<typename imgT>
+BigImagePyramid<imgT>::BigImagePyramid(image_t & img, const std::string & bfPath, PyramidFilter f):
+    base(img),
+    backingFilePath(bfPath),
+    filter(f),
+    fd(-1),
+    built(1)
+{
+    int32_t w = base.Width(), h = base.Height();
+    sizes.push_back(std::make_pair(w, h));
+    while(w > kTileWidth || h > kTileHeight) {
+        w = PyramidHalfSize(w, kTileWidth);
+        h = PyramidHalfSize(h, kTileHeight);
+        sizes.push_back(std::make_pair(w, h));
+    }
+    levels.resize(sizes.size());
+    
+    if(backingFilePath != "")
+    {
+        fd = open(backingFilePath.c_str(), O_RDWR | O_CREAT, (mode_t)0600);
+        if(fd < 0)
+            throw std::runtime_error((boost::format("Could not open file \"%s\": %s")% backingFilePath % strerror(errno)).str());
+        
+        // Levels recorded as built are kept if the header describes this image
+        Header hdr;
+        if(pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+           memcmp(hdr.magic, "BIGPYRMD", 8) == 0 &&
+           hdr.width == base.Width() && hdr.height == base.Height() &&
+           hdr.pixelBytes == sizeof(typename image_t::pixel_val_t) && hdr.filter == uint32_t(filter))
+            built = hdr.built | 1;
+        else
+            WriteHeader();
+        
+        // Built levels must still have their files
+        for(int32_t l = 1; l < NumLevels(); ++l) {
+            TileFileHeader lhdr;
+            if(((built >> l) & 1) && !(ReadLevelHeader(LevelPath(l), lhdr) && lhdr.width == sizes[l].first &&
+                                       lhdr.height == sizes[l].second &&
+                                       lhdr.pixelBytes == sizeof(typename image_t::pixel_val_t))) {
+                Unbuilt(l);
+                break;
+            }
+        }
+    }
+}
+
+template<typename imgT>
+BigImagePyramid<imgT>::~BigImagePyramid()
+{
+    if(fd >= 0)
+        close(fd);
+}
+
+template<typename imgT>
+bool BigImagePyramid<imgT>::ReadLevelHeader(const std::string & path, TileFileHeader & hdr)
+{
+    int lfd = open(path.c_str(), O_RDONLY);
+    if(lfd < 0)
+        return false;
+    struct stat st;
+    bool ok = ReadTileFileHeader(lfd, hdr) && fstat(lfd, &st) == 0 && uint64_t(st.st_size) >= hdr.dataOffset + hdr.dataBytes;
+    close(lfd);
+    return ok;
+}
+
+template<typename imgT>
+void BigImagePyramid<imgT>::Unbuilt(int32_t level)
+{
+    built &= (uint64_t(1) << level) - 1;
+    if(fd >= 0)
+        WriteHeader();
+}
+
+template<typename imgT>
+auto BigImagePyramid<imgT>::Open(int32_t level) -> image_t &
+{
+    if(level == 0)
+        return base;
+    if(!levels[level])
+    {
+        // Tile managers start over files not holding the image they expect,
+        // so a built level whose file changes on opening has lost its data
+        std::string path = LevelPath(level);
+        bool wasBuilt = (built >> level) & 1;
+        TileFileHeader before, after;
+        bool intact = wasBuilt && path != "" && ReadLevelHeader(path, before);
+        levels[level].reset(new image_t(sizes[level].first, sizes[level].second, path));
+        if(wasBuilt && path != "" &&
+           !(intact && ReadLevelHeader(path, after) && memcmp(&before, &after, sizeof(before)) == 0))
+            Unbuilt(level);
+    }
+    return *levels[level];
+}
+
+template<typename imgT>
+void BigImagePyramid<imgT>::WriteHeader()
+{
+    Header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, "BIGPYRMD", 8);
+    hdr.width = base.Width();
+    hdr.height = base.Height();
+    hdr.pixelBytes = sizeof(typename image_t::pixel_val_t);
+    hdr.filter = filter;
+    hdr.built = built;
+    if(pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+        throw std::runtime_error((boost::format("Could not write pyramid header \"%s\": %s")% backingFilePath % strerror(errno)).str());
+    fdatasync(fd);
+}
+
+template<typename imgT>
+auto BigImagePyramid<imgT>::Level(int32_t level) -> image_t &
+{
+    if(level < 0 || level >= NumLevels())
+        throw std::runtime_error((boost::format("BigImagePyramid::Level(): no level %d of %d")% level % NumLevels()).str());
+    
+    std::lock_guard<std::mutex> lock(mtx);
+    for(int32_t l = 1; l <= level; ++l)
+    {
+        // Opening a level marks it as not built if its file was lost
+        image_t & dst = Open(l);
+        if((built >> l) & 1)
+            continue;
+        Downsample2x(dst, Open(l - 1), filter);
+        // Level data must be in its file before the header says it's built
+        if(fd >= 0) {
+            dst.GetTileManager().Flush(dst);
+            built |= uint64_t(1) << l;
+            WriteHeader();
+        }
+        else {
+            built |= uint64_t(1) << l;
+        }
+    }
+    return Open(level);
+}
+
+template<typename imgT>
+void BigImagePyramid<imgT>::Invalidate()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    built = 1;
+    if(fd >= 0)
+        WriteHeader();
+}
+
+} // namespace bigimage
+#endif // PYRAMID_H
@@ -0,0 +1,117 @@
+
+// Reducers for BigImage::Reduce() and BigImage::TransformReduce().
+//
+// A reducer describes an accumulator type and how to fill and combine
+// accumulators:
+// typedef ... value_t;
+// value_t Init() const;// identity accumulator
+// void Accumulate(value_t & acc, const input_t & x) const;
+// void Merge(value_t & acc, const value_t & other) const;
+// Merge() must be associative. Reductions call Accumulate() on a fresh
+// accumulator for each tile, so an accumulator sees at most one tile's worth of
+// Accumulate() calls before being merged.
+//
+// The built-in reducers work on scalars and on float4/double4 vectors, which
+// are reduced per component. Pixel types with packed channels, such as RGBA32,
+// are best reduced through TransformReduce() with a transform unpacking them.
+
+#ifndef REDUCERS_H
+#define REDUCERS_H
+
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+
+#include "math3d/vmath.h"
+#include "math3d/misc.h"
+
+namespace bigimage {
+
+// Per component minimum and maximum
+template<typename T> T ReduceMin(const T & a, const T & b) {return std::min(a, b);}
+template<typename T> T ReduceMax(const T & a, const T & b) {return std::max(a, b);}
+
+inline float4 ReduceMin(const float4 & a, const float4 & b) {
+    float4 r = a;
+    for(int c = 0; c < 4; ++c)
+        r[c] = std::min(a[c], b[c]);
+    return r;
+}
+inline float4 ReduceMax(const float4 & a, const float4 & b) {
+    float4 r = a;
+    for(int c = 0; c < 4; ++c)
+        r[c] = std::max(a[c], b[c]);
+    return r;
+}
+inline double4 ReduceMin(const double4 & a, const double4 & b) {
+    double4 r = a;
+    for(int c = 0; c < 4; ++c)
+        r[c] = std::min(a[c], b[c]);
+    return r;
+}
+inline double4 ReduceMax(const double4 & a, const double4 & b) {
+    double4 r = a;
+    for(int c = 0; c < 4; ++c)
+        r[c] = std::max(a[c], b[c]);
+    return r;
+}
+
+
+// Minimum. The initial value defaults to the largest value of scalar types, and
+// must be given for vectors.
+template<typename T>
+struct MinReducer {
+    typedef T value_t;
+    T init;
+    
+    MinReducer(const T & i = std::numeric_limits<T>::max()): init(i) {}
+    T Init() const {return init;}
+    void Accumulate(T & acc, const T & x) const {acc = ReduceMin(acc, x);}
+    void Merge(T & acc, const T & other) const {acc = ReduceMin(acc, other);}
+};
+
+// Maximum. The initial value defaults to the lowest value of scalar types, and
+// must be given for vectors.
+template<typename T>
+struct MaxReducer {
+    typedef T value_t;
+    T init;
+    
+    MaxReducer(const T & i = std::numeric_limits<T>::lowest()): init(i) {}
+    T Init() const {return init;}
+    void Accumulate(T & acc, const T & x) const {acc = ReduceMax(acc, x);}
+    void Merge(T & acc, const T & other) const {acc = ReduceMax(acc, other);}
+};
+
+// Sum. T should be wide enough for the whole image, such as uint64_t for
+// integer pixels or double4 for float4 pixels.
+template<typename T>
+struct SumReducer {
+    typedef T value_t;
+    
+    T Init() const {return T();}
+    void Accumulate(T & acc, const T & x) const {acc += x;}
+    void Merge(T & acc, const T & other) const {acc += other;}
+};
+
+// Mean and population variance, accumulated with Welford's method within
+// tiles and merged pairwise across tiles. T should be double or double4.
+template<typename T>
+struct MeanVarReducer {
+    struct value_t {
+        T mean, var;
+        int64_t n;
+    };
+    
+    value_t Init() const {return value_t{T(), T(), 0};}
+    void Accumulate(value_t & acc, const T & x) const {
+        m3d::accum_mean_var(acc.mean, acc.var, x, int(acc.n++));
+    }
+    void Merge(value_t & acc, const value_t & other) const {
+        m3d::merge_mean_var(acc.mean, acc.var, acc.n, other.mean, other.var, other.n);
+        acc.n += other.n;
+    }
+};
+
+} // namespace bigimage
+#endif // REDUCERS_H
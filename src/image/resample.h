@@ -0,0 +1,234 @@
+
+// Resampling of images to arbitrary sizes with separable filters.
+//
+// Weights are precomputed for each output column and row: the first source
+// pixel contributing to it and the weights of that and the following pixels.
+// Filters are widened by the scale factor when reducing, so every source pixel
+// contributes. Edges are extended by the nearest edge pixel.
+//
+// Output tiles are filtered in parallel, in the destination's memory order.
+// For each output tile, the source rows behind it are read one at a time along
+// the band of source tiles they cross, filtered horizontally into a row of
+// kTileWidth working pixels, and accumulated into each output row they
+// contribute to. Bands wider than a block are taken in chunks of a block's
+// width, each chunk's share of the horizontal filter being accumulated
+// separately. Working memory per worker is one tile of accumulators and a
+// source row span of at most a block's width, and at most a block row of
+// source tiles is prepared at a time, so memory use stays bounded, whatever
+// the scale, when both images are out of core. The source tiles behind each
+// output tile are prefetched in the source's memory order first.
+//
+// Pixels are filtered in the working types of ConvTraits, so RGBA pixels are
+// processed as float4 vectors.
+
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+
+#include "pixeltype.h"
+#include "tile.h"
+#include "convolve.h"
+#include "tilemanager.h"
+#include "workerpool.h"
+
+namespace bigimage {
+
+enum ResampleFilter {
+    kResampleBilinear,// triangle, support 1
+    kResampleMitchell,// Mitchell-Netravali with B = C = 1/3, support 2
+    kResampleLanczos3// sinc(x)*sinc(x/3), support 3
+};
+
+inline float ResampleSupport(ResampleFilter filter)
+{
+    switch(filter) {
+        case kResampleBilinear: return 1.0f;
+        case kResampleMitchell: return 2.0f;
+        default: return 3.0f;
+    }
+}
+
+// Filter at x, in source pixels at unit scale
+inline double ResampleKernel(ResampleFilter filter, double x)
+{
+    x = std::fabs(x);
+    switch(filter) {
+        case kResampleBilinear:
+            return std::max(1.0 - x, 0.0);
+        case kResampleMitchell: {
+            const double B = 1.0/3.0, C = 1.0/3.0;
+            if(x < 1.0)
+                return ((12 - 9*B - 6*C)*x*x*x + (-18 + 12*B + 6*C)*x*x + (6 - 2*B))/6;
+            if(x < 2.0)
+                return ((-B - 6*C)*x*x*x + (6*B + 30*C)*x*x + (-12*B - 48*C)*x + (8*B + 24*C))/6;
+            return 0.0;
+        }
+        default: {
+            if(x < 1e-8)
+                return 1.0;
+            if(x >= 3.0)
+                return 0.0;
+            double px = M_PI*x;
+            return 3.0*std::sin(px)*std::sin(px/3.0)/(px*px);
+        }
+    }
+}
+
+// Weights of each output pixel along one axis
+struct ResampleWeights {
+    std::vector<int32_t> first;// first source pixel of each output pixel
+    std::vector<int32_t> count;// number of source pixels
+    std::vector<float> weights;// maxTaps per output pixel
+    int32_t maxTaps;
+    
+    const float * Weights(int32_t i) const {return &weights[size_t(i)*maxTaps];}
+};
+
+// Weights for resampling srcSize pixels to dstSize, with pixel centers
+// aligned. Taps beyond the edges are folded into the edge pixels.
+inline ResampleWeights ResampleTable(int32_t srcSize, int32_t dstSize, ResampleFilter filter)
+{
+    const double scale = double(srcSize)/dstSize;
+    const double fscale = std::max(scale, 1.0);
+    const double support = ResampleSupport(filter)*fscale;
+    
+    ResampleWeights table;
+    table.maxTaps = std::min(int32_t(std::ceil(2*support)) + 1, srcSize);
+    table.first.resize(dstSize);
+    table.count.resize(dstSize);
+    table.weights.assign(size_t(dstSize)*table.maxTaps, 0.0f);
+    std::vector<double> w;
+    for(int32_t i = 0; i < dstSize; ++i)
+    {
+        double center = (i + 0.5)*scale - 0.5;
+        int32_t lo = std::ceil(center - support), hi = std::floor(center + support);
+        int32_t first = std::min(std::max(lo, 0), srcSize - 1);
+        int32_t last = std::min(std::max(hi, 0), srcSize - 1);
+        w.assign(last - first + 1, 0.0);
+        double sum = 0;
+        for(int32_t j = lo; j <= hi; ++j) {
+            double k = ResampleKernel(filter, (j - center)/fscale);
+            w[std::min(std::max(j, first), last) - first] += k;
+            sum += k;
+        }
+        
+        // Drop zero weights at the ends
+        int32_t b = 0, e = w.size();
+        while(b < e - 1 && w[b] == 0.0)
+            ++b;
+        while(e > b + 1 && w[e - 1] == 0.0)
+            --e;
+        table.first[i] = first + b;
+        table.count[i] = e - b;
+        float * out = &table.weights[size_t(i)*table.maxTaps];
+        for(int32_t t = b; t < e; ++t)
+            out[t - b] = w[t]/sum;
+    }
+    return table;
+}
+
+// Resample src to the size of dst. Pixel types must have the same working
+// type, such as PixelTypeRGBA32 and PixelTypeRGBAf. Images must be distinct.
+template<typename dimgT, typename simgT>
+void Resample(dimgT & dst, simgT & src, ResampleFilter filter = kResampleLanczos3)
+{
+    typedef ConvTraits<typename dimgT::pixel_t> dtraits;
+    typedef ConvTraits<typename simgT::pixel_t> straits;
+    typedef typename dtraits::work_t work_t;
+    static_assert(std::is_same<work_t, typename straits::work_t>::value,
+                  "source and destination must have the same working type");
+    if(static_cast<void *>(&dst) == static_cast<void *>(&src))
+        throw std::runtime_error("Resample(): source and destination must be distinct images");
+    
+    const ResampleWeights wx = ResampleTable(src.Width(), dst.Width(), filter);
+    const ResampleWeights wy = ResampleTable(src.Height(), dst.Height(), filter);
+    const int32_t sxtiles = (src.Width() + kTileWidth - 1)/kTileWidth;
+    
+    // Per-thread source row span, horizontally filtered row, and accumulators
+    WorkerLocal<std::vector<work_t>> work;
+    WorkerLocal<std::vector<typename simgT::TileInfo *>> gathered;
+    dst.EachTile([&](typename dimgT::TileInfo & ti){
+        std::vector<work_t> & buf = work.Local();
+        std::vector<typename simgT::TileInfo *> & stiles = gathered.Local();
+        
+        // Source pixels behind the part of the tile inside the image
+        const int32_t cols = std::min(kTileWidth, dst.Width() - ti.x), rows = std::min(kTileHeight, dst.Height() - ti.y);
+        int32_t sx0 = src.Width(), sx1 = 0, sy0 = src.Height(), sy1 = 0;
+        for(int32_t x = ti.x; x < ti.x + cols; ++x) {
+            sx0 = std::min(sx0, wx.first[x]);
+            sx1 = std::max(sx1, wx.first[x] + wx.count[x]);
+        }
+        for(int32_t y = ti.y; y < ti.y + rows; ++y) {
+            sy0 = std::min(sy0, wy.first[y]);
+            sy1 = std::max(sy1, wy.first[y] + wy.count[y]);
+        }
+        int32_t tx0 = sx0/kTileWidth, tx1 = (sx1 + kTileWidth - 1)/kTileWidth;
+        int32_t ty0 = sy0/kTileHeight, ty1 = (sy1 + kTileHeight - 1)/kTileHeight;
+        src.GetTileManager().GatherTiles(src, tx0, ty0, tx1, ty1, stiles);
+        src.GetTileManager().Prefetch(src, stiles);
+        
+        const int32_t spanWidth = kBlockWidth*kTileWidth;
+        buf.resize(spanWidth + kTileWidth + kTilePixels);
+        work_t * span = &buf[0], * hrow = &buf[spanWidth], * acc = &buf[spanWidth + kTileWidth];
+        std::fill(acc, acc + kTilePixels, work_t());
+        
+        for(int32_t ty = ty0; ty < ty1; ++ty)
+        for(int32_t cx0 = tx0; cx0 < tx1; cx0 += kBlockWidth)
+        {
+            const int32_t cx1 = std::min(cx0 + kBlockWidth, tx1);
+            const int32_t c0 = cx0*kTileWidth, c1 = cx1*kTileWidth;
+            for(int32_t tx = cx0; tx < cx1; ++tx)
+                src.PrepareTile(src.GetTiles()[ty*sxtiles + tx], kAccessRead);
+            
+            for(int32_t sy = std::max(sy0, ty*kTileHeight); sy < std::min(sy1, (ty + 1)*kTileHeight); ++sy)
+            {
+                // Source row across the chunk of tiles
+                int32_t row = sy % kTileHeight;
+                for(int32_t tx = cx0; tx < cx1; ++tx)
+                    straits::Load(span + (tx - cx0)*kTileWidth,
+                                  &(*src.GetTiles()[ty*sxtiles + tx].pixels)[row*kTileWidth], kTileWidth);
+                
+                // Taps of each output pixel within the chunk
+                for(int32_t x = 0; x < cols; ++x)
+                {
+                    const int32_t first = wx.first[ti.x + x];
+                    const int32_t t0 = std::max(c0 - first, 0), t1 = std::min(c1 - first, wx.count[ti.x + x]);
+                    if(t1 <= t0) {
+                        hrow[x] = work_t();
+                        continue;
+                    }
+                    const float * k = wx.Weights(ti.x + x);
+                    const work_t * in = span + (first + t0 - c0);
+                    work_t v = work_t();
+                    for(int32_t t = t0; t < t1; ++t)
+                        v += k[t]*in[t - t0];
+                    hrow[x] = v;
+                }
+                
+                // Accumulate into the output rows taking this source row
+                for(int32_t j = ti.y; j < ti.y + rows; ++j)
+                {
+                    if(sy < wy.first[j] || sy >= wy.first[j] + wy.count[j])
+                        continue;
+                    float k = wy.Weights(j)[sy - wy.first[j]];
+                    work_t * out = acc + (j - ti.y)*kTileWidth;
+                    for(int32_t x = 0; x < cols; ++x)
+                        out[x] += k*hrow[x];
+                }
+            }
+            
+            for(int32_t tx = cx0; tx < cx1; ++tx)
+                src.ReleaseTile(src.GetTiles()[ty*sxtiles + tx], kAccessRead);
+        }
+        
+        for(int32_t y = 0; y < rows; ++y)
+            dtraits::Store(&(*ti.pixels)[y*kTileWidth], acc + y*kTileWidth, cols);
+    });
+}
+
+} // namespace bigimage
+#endif // RESAMPLE_H
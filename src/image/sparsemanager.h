@@ -0,0 +1,131 @@
+
+// Sparse tile manager, for images that are mostly empty.
+//
+// Tiles that have never been written share a single read-only "fill" tile, and
+// only get storage of their own on first write, when the fill pixels are copied
+// into place. Pixel storage uses the block layout of TileBlockManager, but the
+// home slots of untouched tiles are never accessed, so they take neither memory
+// nor, with a backing file on a filesystem supporting holes, disk space.
+//
+// Tile traversal functions declare their access: reads see the fill tile,
+// writes allocate, and operations declaring kAccessPreserveFill skip fill tiles
+// entirely. Writes made outside the traversal functions, such as through
+// BigImage::GetPixel(), must first prepare the tile for writing with
+// BigImage::PrepareTile(). Writing to an unprepared fill tile faults, as the
+// fill tile is mapped read-only.
+//
+// Which tiles have been written isn't recorded in the backing file, so images
+// opened from an existing file have storage for every tile.
+
+#ifndef SPARSEMANAGER_H
+#define SPARSEMANAGER_H
+
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "tilemanager.h"
+
+namespace bigimage {
+
+class TileSparseManager: public TileBlockManager {
+    uint8_t * homeTiles;// block layout storage for written tiles
+    void * fillTile;
+    size_t fillBytes;
+    int32_t xtiles, ytiles;
+    std::atomic<size_t> nallocated;
+
+    template<typename image_t>
+    void Materialize(typename image_t::TileInfo & ti) {
+        typedef typename image_t::Tile Tile;
+        Tile * home = reinterpret_cast<Tile *>(homeTiles) + TileIndex(ti.x/kTileWidth, ti.y/kTileHeight, xtiles, ytiles);
+        memcpy(home, fillTile, sizeof(Tile));
+        ti.pixels = &home->pixels;
+        ti.state &= ~kTileFill;
+        ++nallocated;
+    }
+
+  public:
+    TileSparseManager(const std::string & bfPath, TileFileMode mode = kTileFileCreate):
+        TileBlockManager(bfPath, mode), homeTiles(nullptr), fillTile(nullptr), fillBytes(0), xtiles(0), ytiles(0), nallocated(0)
+    {}
+    ~TileSparseManager() {}
+
+    // Allocate main image tiles and initialize tinfo entries, with all tiles
+    // referring to the fill tile, unless opening an existing image. Fill value
+    // is initially zero.
+    template<typename image_t>
+    auto AllocMain(image_t & image) -> typename image_t::Tile *
+    {
+        typedef typename image_t::Tile Tile;
+        Tile * tiles = TileBlockManager::AllocMain(image);
+        homeTiles = reinterpret_cast<uint8_t *>(tiles);
+        xtiles = (std::get<0>(image.Size()) + kTileWidth - 1)/kTileWidth;
+        ytiles = (std::get<1>(image.Size()) + kTileHeight - 1)/kTileHeight;
+
+        // Anonymous pages are zeroed, which is the initial fill value.
+        size_t pageSize = sysconf(_SC_PAGESIZE);
+        fillBytes = (sizeof(Tile) + pageSize - 1)/pageSize*pageSize;
+        fillTile = mmap(nullptr, fillBytes, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(fillTile == MAP_FAILED)
+            throw std::runtime_error("Could not allocate fill tile");
+
+        if(fileMode != kTileFileCreate) {
+            nallocated = image.GetTiles().size();
+            return tiles;
+        }
+        for(auto & ti : image.GetTiles()) {
+            ti.pixels = &static_cast<Tile *>(fillTile)->pixels;
+            ti.state |= kTileFill;
+        }
+        return tiles;
+    }
+
+    template<typename Tile>
+    void FreeMain(Tile * tiles) {
+        if(fillTile)
+            munmap(fillTile, fillBytes);
+        fillTile = nullptr;
+        TileBlockManager::FreeMain(tiles);
+    }
+
+    // Set the value of all tiles that have not been written. Must not be called
+    // while tiles are being traversed.
+    template<typename image_t>
+    void SetFill(const typename image_t::pixel_val_t & value) {
+        typedef typename image_t::Tile Tile;
+        mprotect(fillTile, fillBytes, PROT_READ | PROT_WRITE);
+        std::fill(static_cast<Tile *>(fillTile)->pixels.begin(), static_cast<Tile *>(fillTile)->pixels.end(), value);
+        mprotect(fillTile, fillBytes, PROT_READ);
+    }
+
+    // Number of tiles that have been given storage of their own
+    size_t AllocatedTiles() const {return nallocated;}
+
+    template<typename image_t>
+    void MovePixels(typename image_t::TileInfo & dst, typename image_t::TileInfo & src) {
+        if(dst.state & kTileFill)
+            Materialize<image_t>(dst);
+        TileBlockManager::MovePixels<image_t>(dst, src);
+    }
+
+    // Fill tiles are given storage on write, and skipped entirely by operations
+    // that preserve the fill value. A tile must only be prepared by one thread
+    // at a time, which traversal functions guarantee.
+    template<typename image_t>
+    bool PrepareTile(image_t & image, typename image_t::TileInfo & ti, TileAccess access) {
+        if(!(ti.state & kTileFill))
+            return true;
+        if(access == kAccessPreserveFill)
+            return false;
+        if(access == kAccessWrite)
+            Materialize<image_t>(ti);
+        return true;
+    }
+};
+
+} // namespace bigimage
+#endif // SPARSEMANAGER_H
@@ -0,0 +1,100 @@
+
+// Swapping tile manager, for images that are mostly updated by replacing whole
+// tiles, as ImageProcJob does.
+//
+// Tiles have home slots in the block layout of TileBlockManager, in memory or in
+// the backing file, but TileInfo::pixels may be re-pointed at any tile buffer.
+// MovePixels() hands the result buffer to the destination tile in place of
+// copying its pixels, which makes committing a result O(1). Displaced tiles
+// keep their pixels in pooled heap buffers until Flush() copies them back to
+// their home slots, which is needed before the backing file holds the image
+// contents. Home slots never enter the pool, each only ever belongs to its own
+// tile, so flushing is a plain copy per displaced tile.
+//
+// The home slot of a displaced tile is not reused, so until flushed the image
+// takes memory for both the home slot and the buffer. With a backing file, the
+// stale home slot is only file space.
+
+#ifndef SWAPMANAGER_H
+#define SWAPMANAGER_H
+
+#include "tilemanager.h"
+
+namespace bigimage {
+
+class TileSwapManager: public TileBlockManager {
+    uint8_t * homeTiles;
+    int32_t xtiles, ytiles;
+    void * tinfo;// image's tile info array, to reach displaced tiles on FreeMain()
+    size_t ntiles;
+    
+    template<typename Tile, typename TileInfo>
+    Tile * HomeTile(const TileInfo & ti) {
+        return reinterpret_cast<Tile *>(homeTiles) + TileIndex(ti.x/kTileWidth, ti.y/kTileHeight, xtiles, ytiles);
+    }
+    
+    // Copy displaced tile back to its home slot, returning its buffer
+    template<typename Tile, typename TileInfo>
+    Tile * ReturnHome(TileInfo & ti) {
+        Tile * home = HomeTile<Tile>(ti);
+        if(ti.pixels == &home->pixels)
+            return nullptr;
+        Tile * buf = reinterpret_cast<Tile *>(ti.pixels);
+        home->pixels = *ti.pixels;
+        ti.pixels = &home->pixels;
+        return buf;
+    }
+    
+  public:
+    TileSwapManager(const std::string & bfPath, TileFileMode mode = kTileFileCreate):
+        TileBlockManager(bfPath, mode), homeTiles(nullptr), xtiles(0), ytiles(0), tinfo(nullptr), ntiles(0)
+    {}
+    ~TileSwapManager() {}
+    
+    template<typename image_t>
+    auto AllocMain(image_t & image) -> typename image_t::Tile *
+    {
+        typename image_t::Tile * tiles = TileBlockManager::AllocMain(image);
+        homeTiles = reinterpret_cast<uint8_t *>(tiles);
+        xtiles = (std::get<0>(image.Size()) + kTileWidth - 1)/kTileWidth;
+        ytiles = (std::get<1>(image.Size()) + kTileHeight - 1)/kTileHeight;
+        tinfo = image.GetTiles().data();
+        ntiles = image.GetTiles().size();
+        return tiles;
+    }
+    
+    // Displaced tiles are flushed first if there is a backing file.
+    template<typename Tile>
+    void FreeMain(Tile * tiles) {
+        TileInfo<typename Tile::image_t> * ti = static_cast<TileInfo<typename Tile::image_t> *>(tinfo);
+        for(size_t t = 0; t < ntiles; ++t) {
+            if(backingFile)
+                tmpPool.Free(ReturnHome<Tile>(ti[t]));
+            else if(ti[t].pixels != &HomeTile<Tile>(ti[t])->pixels)
+                tmpPool.Free(ti[t].pixels);
+        }
+        TileBlockManager::FreeMain(tiles);
+    }
+    
+    // Takes over src's buffer. src is left with dst's previous buffer for the
+    // caller to free, or null if that was dst's home slot.
+    template<typename image_t>
+    void MovePixels(typename image_t::TileInfo & dst, typename image_t::TileInfo & src) {
+        auto old = dst.pixels;
+        dst.pixels = src.pixels;
+        src.pixels = (old == &HomeTile<typename image_t::Tile>(dst)->pixels)? nullptr : old;
+    }
+    
+    // Copy displaced tiles back to their home slots and return their buffers
+    // to the pool, then write them to the backing file. Must not be called
+    // while tiles are being traversed.
+    template<typename image_t>
+    void Flush(image_t & image) {
+        for(auto & ti : image.GetTiles())
+            FreeTmp<image_t>(ReturnHome<typename image_t::Tile>(ti));
+        TileBlockManager::Flush(image);
+    }
+};
+
+} // namespace bigimage
+#endif // SWAPMANAGER_H
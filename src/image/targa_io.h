@@ -10,6 +10,8 @@
 #include <sstream>
 #include <cstdlib>
 #include <cstring>
+#include <vector>
+#include <algorithm>
 #include <stdint.h>
 
 
@@ -110,6 +112,200 @@ enum {
     kTargaType_RLE_BW = 11
 };
 
+// *****************************************************************************
+// RLE packets, used by types 10 and 11. Each packet starts with a byte holding
+// the pixel count less 1 in its low 7 bits, with the high bit set for a run
+// packet, followed by one pixel repeated count times, and clear for a raw
+// packet, followed by count pixels.
+//
+// Pixels are compared and expanded through a 24 byte pattern of the pixel
+// repeated, which holds a whole number of 1, 3 or 4 byte pixels, so runs are
+// checked and filled 24 bytes at a time rather than pixel by pixel.
+
+// Worst case size of a row of npixels, encoded
+inline size_t TargaRLEBound(size_t npixels, size_t pixelBytes)
+{
+    return npixels*pixelBytes + (npixels + 127)/128;
+}
+
+inline void TargaRLEPattern(uint8_t * pattern, const uint8_t * pixel, size_t pixelBytes)
+{
+    // Fixed size copies, as this is done for every run packet
+    switch(pixelBytes) {
+        case 1:
+            memset(pattern, pixel[0], 24);
+        break;
+        case 3:
+            for(size_t p = 0; p < 24; p += 3)
+                memcpy(pattern + p, pixel, 3);
+        break;
+        default:
+            for(size_t p = 0; p < 24; p += 4)
+                memcpy(pattern + p, pixel, 4);
+        break;
+    }
+}
+
+template<size_t pixelBytes>
+inline uint32_t TargaPixelWord(const uint8_t * src)
+{
+    uint32_t v = 0;
+    memcpy(&v, src, pixelBytes);
+    return v;
+}
+
+// Number of pixels equal to the first, up to n
+template<size_t pixelBytes>
+size_t TargaRunLength(const uint8_t * src, size_t n)
+{
+    const uint32_t v = TargaPixelWord<pixelBytes>(src);
+    if(n < 2 || TargaPixelWord<pixelBytes>(src + pixelBytes) != v)
+        return 1;
+    
+    const size_t kBlock = 24/pixelBytes;
+    uint64_t pattern[3], block[3];
+    TargaRLEPattern((uint8_t *)pattern, src, pixelBytes);
+    size_t i = 2;
+    for(; i + kBlock <= n; i += kBlock) {
+        memcpy(block, src + i*pixelBytes, 24);
+        if(((block[0] ^ pattern[0]) | (block[1] ^ pattern[1]) | (block[2] ^ pattern[2])) != 0)
+            break;
+    }
+    while(i < n && TargaPixelWord<pixelBytes>(src + i*pixelBytes) == v)
+        ++i;
+    return i;
+}
+
+template<size_t pixelBytes>
+size_t TargaRLEEncode(uint8_t * dst, const uint8_t * src, size_t npixels)
+{
+    // Runs shorter than this are cheaper left in raw packets
+    const size_t kMinRun = (pixelBytes == 1)? 3 : 2;
+    uint8_t * out = dst;
+    size_t raw = 0;// first pixel not yet encoded
+    auto flushRaw = [&](size_t end) {
+        while(raw < end) {
+            size_t count = std::min<size_t>(end - raw, 128);
+            *out++ = count - 1;
+            memcpy(out, src + raw*pixelBytes, count*pixelBytes);
+            out += count*pixelBytes;
+            raw += count;
+        }
+    };
+    for(size_t i = 0; i < npixels;)
+    {
+        size_t run = TargaRunLength<pixelBytes>(src + i*pixelBytes, npixels - i);
+        if(run < kMinRun) {
+            i += run;
+            continue;
+        }
+        flushRaw(i);
+        for(size_t left = run; left > 0;) {
+            size_t count = std::min<size_t>(left, 128);
+            *out++ = 0x80 | (count - 1);
+            memcpy(out, src + i*pixelBytes, pixelBytes);
+            out += pixelBytes;
+            left -= count;
+        }
+        i += run;
+        raw = i;
+    }
+    flushRaw(npixels);
+    return out - dst;
+}
+
+// Encode a row of npixels file pixels into dst, which must have room for
+// TargaRLEBound() bytes. Packets don't cross rows. Returns bytes written.
+inline size_t TargaRLEEncode(uint8_t * dst, const uint8_t * src, size_t npixels, size_t pixelBytes)
+{
+    switch(pixelBytes) {
+        case 1: return TargaRLEEncode<1>(dst, src, npixels);
+        case 3: return TargaRLEEncode<3>(dst, src, npixels);
+        default: return TargaRLEEncode<4>(dst, src, npixels);
+    }
+}
+
+// Expands packets read from a stream. Packets may cross rows, so decoding
+// may stop and resume partway through one.
+class TargaRLEDecoder {
+    std::istream & in;
+    size_t pixelBytes;
+    std::vector<uint8_t> buf;
+    size_t pos, end;// unread bytes in buf
+    size_t runLeft, rawLeft;// pixels left of current packet
+    uint8_t pattern[24];
+    
+    // Have at least need bytes buffered, if the stream has them
+    bool Fill(size_t need) {
+        if(end - pos >= need)
+            return true;
+        std::copy(buf.begin() + pos, buf.begin() + end, buf.begin());
+        end -= pos;
+        pos = 0;
+        in.read((char *)&buf[end], buf.size() - end);
+        end += in.gcount();
+        return end - pos >= need;
+    }
+    
+  public:
+    TargaRLEDecoder(std::istream & is, size_t pb):
+        in(is), pixelBytes(pb), buf(256*1024), pos(0), end(0), runLeft(0), rawLeft(0)
+    {}
+    
+    // Decode npixels into dst. Returns false if the data ends first.
+    bool Decode(uint8_t * dst, size_t npixels);
+};
+
+inline bool TargaRLEDecoder::Decode(uint8_t * dst, size_t npixels)
+{
+    const size_t kBlock = 24/pixelBytes;
+    while(npixels > 0)
+    {
+        if(runLeft > 0) {
+            size_t count = std::min(runLeft, npixels);
+            runLeft -= count;
+            npixels -= count;
+            for(; count >= kBlock; count -= kBlock, dst += 24)
+                memcpy(dst, pattern, 24);
+            memcpy(dst, pattern, count*pixelBytes);
+            dst += count*pixelBytes;
+        }
+        else if(rawLeft > 0) {
+            size_t count = std::min(rawLeft, npixels);
+            memcpy(dst, &buf[pos], count*pixelBytes);
+            pos += count*pixelBytes;
+            dst += count*pixelBytes;
+            rawLeft -= count;
+            npixels -= count;
+        }
+        else {
+            // Next packet, which is buffered whole
+            Fill(1 + 128*pixelBytes);
+            if(end - pos < 1)
+                return false;
+            uint8_t header = buf[pos++];
+            size_t count = (header & 0x7F) + 1;
+            size_t bytes = (header & 0x80)? pixelBytes : count*pixelBytes;
+            if(end - pos < bytes)
+                return false;
+            if(header & 0x80) {
+                TargaRLEPattern(pattern, &buf[pos], pixelBytes);
+                pos += pixelBytes;
+                runLeft = count;
+            }
+            else {
+                rawLeft = count;
+            }
+        }
+    }
+    return true;
+}
+
+
+// *****************************************************************************
+// TargaFileInfo
+// *****************************************************************************
+
 class TargaFileInfo {
     uint8_t cmapType;
     uint8_t cmapSpec[5];
@@ -148,20 +344,26 @@ class TargaFileInfo {
     // and as rows array, starting at bottom row and going up.
     bool Read(const std::string & filename, SimpleImage & image);
     
-    // Read header data
+    // Read header data, leaving fin at the start of the image data
     bool ReadHeader(std::ifstream & fin);
+    // Image descriptor, bits 4 and 5 of which give the origin corner
+    uint8_t Descriptor() const {return descriptor;}
     // Read image data into already-allocated buffer (use ReadHeader() to determine size)
     bool ReadImage(std::ifstream & fin, uint8_t * imagedata);
     
-    static bool Write(const std::string & filename, const SimpleImage & image);
-    bool Write(const std::string & filename, const uint8_t * imagedata);
+    // Write image with lower-left origin, as 8 bit gray or true color, RLE
+    // compressed if rle is set
+    static bool Write(const std::string & filename, const SimpleImage & image, bool rle = false);
+    bool Write(const std::string & filename, const uint8_t * imagedata, bool rle = false);
+    
+    bool IsRLE() const {return type == kTargaType_RLE_Truecolor || type == kTargaType_RLE_BW;}
 };
 
 // TODO: error handling...
 inline bool TargaFileInfo::ReadHeader(std::ifstream & fin)
 {
     fin.read((char *)&idLen, 1);//image ID length
-    fin.read((char *)&cmapSpec, 1);//cmap type
+    fin.read((char *)&cmapType, 1);//cmap type
     fin.read((char *)&type, 1);//image type
     fin.read((char *)cmapSpec, 5);//cmap specification
     fin.read((char *)imageSpec, 10);//image specification
@@ -170,21 +372,35 @@ inline bool TargaFileInfo::ReadHeader(std::ifstream & fin)
     imageID = new char[idLen];
     fin.read((char *)imageID, idLen);//image ID
     
+    // Skip any color map, of length entries of entry size bits each
+    if(cmapType != 0) {
+        size_t cmapLen = (cmapSpec[3] << 8) | cmapSpec[2];
+        fin.seekg(cmapLen*((cmapSpec[4] + 7)/8), std::ios::cur);
+    }
+    
     width = (imageSpec[5] << 8) | imageSpec[4];
     height = (imageSpec[7] << 8) | imageSpec[6];
     depth = imageSpec[8];
     descriptor = imageSpec[9];
     
-    // Only handling true color images, so no color map data to read
-    if(type == kTargaType_Truecolor)
+    // Only handling true color and gray images, so no color map data to read
+    if(type == kTargaType_Truecolor || type == kTargaType_BW ||
+       type == kTargaType_RLE_Truecolor || type == kTargaType_RLE_BW)
         pixelBytes = depth/8;
     
-    return true;
+    return fin.good();
 }
 
 inline bool TargaFileInfo::ReadImage(std::ifstream & fin, uint8_t * tgaImageData)
 {
-    fin.read((char *)tgaImageData, width*height*pixelBytes);
+    if(IsRLE()) {
+        TargaRLEDecoder decoder(fin, pixelBytes);
+        if(!decoder.Decode(tgaImageData, width*height))
+            return false;
+    }
+    else if(!fin.read((char *)tgaImageData, width*height*pixelBytes)) {
+        return false;
+    }
     if(depth == 24) {
         // write BGR data as RGB
         for(int p = 0, n = width*height*3; p < n; p += 3)
@@ -202,15 +418,16 @@ inline bool TargaFileInfo::ReadImage(std::ifstream & fin, uint8_t * tgaImageData
 inline bool TargaFileInfo::Read(const std::string & filename, SimpleImage & image)
 {
     std::ifstream fin(filename.c_str(), std::ios::in | std::ios::binary);
-    ReadHeader(fin);
-    if(type == kTargaType_Truecolor) {
-        if(tgaImageData) delete[] tgaImageData;
+    if(!ReadHeader(fin))
+        return false;
+    if(tgaImageData) delete[] tgaImageData;
+    tgaImageData = NULL;
+    if(type == kTargaType_Truecolor || type == kTargaType_BW ||
+       type == kTargaType_RLE_Truecolor || type == kTargaType_RLE_BW)
         tgaImageData = new uint8_t[width*height*pixelBytes];
-    }
-    ReadImage(fin, tgaImageData);
-    fin.close();
-    if(!tgaImageData)
+    if(!tgaImageData || !ReadImage(fin, tgaImageData))
         return false;
+    fin.close();
     
     // Translate from file pixel layout into standard (origin at lower left) layout
     // and RGBA byte order
@@ -274,21 +491,24 @@ inline bool TargaFileInfo::Read(const std::string & filename, SimpleImage & imag
     return true;
 }
 
-inline bool TargaFileInfo::Write(const std::string & filename, const SimpleImage & image)
+inline bool TargaFileInfo::Write(const std::string & filename, const SimpleImage & image, bool rle)
 {
     TargaFileInfo writer;
     writer.pixelBytes = image.pixelBytes;
     writer.depth = image.pixelBytes*8;
     writer.width = image.width;
     writer.height = image.height;
-    return writer.Write(filename, image.imagedata);
+    return writer.Write(filename, image.imagedata, rle);
 }
 
-inline bool TargaFileInfo::Write(const std::string & filename, const uint8_t * imagedata)
+inline bool TargaFileInfo::Write(const std::string & filename, const uint8_t * imagedata, bool rle)
 {
     std::ofstream fout(filename.c_str(), std::ios::out | std::ios::binary);
     
-    type = kTargaType_Truecolor;
+    if(depth == 8)
+        type = rle? kTargaType_RLE_BW : kTargaType_BW;
+    else
+        type = rle? kTargaType_RLE_Truecolor : kTargaType_Truecolor;
     
 //    imageID = NULL;
     if(imageID == NULL)
@@ -322,7 +542,18 @@ inline bool TargaFileInfo::Write(const std::string & filename, const uint8_t * i
 //    fout.write(***, sizeof(char));//color-map data (not used)
     
     // Write image data
-    if(depth == 24) {
+    if(rle) {
+        // Encode a row at a time, from a copy in BGR(A) order
+        std::vector<uint8_t> row(width*pixelBytes), packets(TargaRLEBound(width, pixelBytes));
+        for(size_t y = 0; y < height; ++y) {
+            memcpy(&row[0], imagedata + y*width*pixelBytes, width*pixelBytes);
+            if(depth == 24 || depth == 32)
+                for(size_t p = 0, n = width*pixelBytes; p < n; p += pixelBytes)
+                    std::swap(row[p], row[p+2]);
+            fout.write((char *)&packets[0], TargaRLEEncode(&packets[0], &row[0], width, pixelBytes));
+        }
+    }
+    else if(depth == 24) {
         // write RGB data as BGR
         for(int p = 0, n = width*height*3; p < n; p += 3) {
             fout.put(imagedata[p+2]);
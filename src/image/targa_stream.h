@@ -0,0 +1,328 @@
+
+// Streaming Targa import and export for BigImages. TargaReader decodes a file
+// one tile row at a time: the file rows behind each row of tiles are read, or
+// expanded from RLE packets, into a band buffer, and scattered into the tiles
+// of that row in parallel, converting BGR(A) or gray pixels to the image's
+// pixel type on the way. Memory use is one band of width x kTileHeight file
+// pixels, whatever the image height.
+//
+// Images are laid out as TargaFileInfo::Read() lays out a SimpleImage, with
+// row 0 the bottom row of the picture, so they round trip through
+// TargaFileInfo::Write(). Files with other origins are flipped while
+// scattering: files stored top down are read from the top row of tiles
+// downward, so the file is still read sequentially, and files stored right
+// to left are read backward along each row.
+//
+// WriteTarga() writes files bottom row first. Rows of tiles are converted in
+// parallel, each worker untiling whole rows of tiles into its own band
+// buffer. Uncompressed bands are written with pwrite() at their offsets in
+// the file, which are known in advance, as soon as they are ready. RLE bands
+// are encoded by the workers too, a batch of one per worker at a time, and
+// written in order after each batch. Memory use is a band buffer per worker,
+// and a buffer of encoded rows for RLE.
+
+#ifndef TARGA_STREAM_H
+#define TARGA_STREAM_H
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <boost/format.hpp>
+
+#include "targa_io.h"
+#include "pixeltype.h"
+#include "pixelconv.h"
+#include "tile.h"
+#include "rect.h"
+#include "workerpool.h"
+
+namespace bigimage {
+
+// Convert len file pixels of pixelBytes each to RGBA32, stepping backward
+// from src for reversed rows
+inline void TargaDecodePixels(uint32_t * dst, const uint8_t * src, size_t len, int32_t pixelBytes, bool reverse)
+{
+    if(!reverse && pixelBytes == 3) {
+        pixelconv::RGBA32FromBGR24(dst, src, len);
+        return;
+    }
+    if(!reverse && pixelBytes == 4) {
+        pixelconv::SwapRB32(dst, reinterpret_cast<const uint32_t *>(src), len);
+        return;
+    }
+    const ptrdiff_t step = reverse? -pixelBytes : pixelBytes;
+    switch(pixelBytes) {
+        case 1:
+            for(size_t p = 0; p < len; ++p, src += step)
+                dst[p] = src[0]*0x010101u | 0xFF000000u;
+        break;
+        case 3:
+            for(size_t p = 0; p < len; ++p, src += step)
+                dst[p] = src[2] | (src[1] << 8) | (src[0] << 16) | 0xFF000000u;
+        break;
+        default:
+            for(size_t p = 0; p < len; ++p, src += step)
+                dst[p] = src[2] | (src[1] << 8) | (src[0] << 16) | (uint32_t(src[3]) << 24);
+        break;
+    }
+}
+
+class TargaReader {
+    std::string filename;
+    std::ifstream fin;
+    TargaFileInfo info;
+    std::unique_ptr<TargaRLEDecoder> decoder;// for RLE files
+    
+    // Read nrows file rows into buf
+    void ReadRows(uint8_t * buf, int32_t nrows);
+    
+  public:
+    // Open file and read its header. 8 bit gray, 24 bit and 32 bit true color
+    // files are supported, uncompressed or RLE.
+    TargaReader(const std::string & filename);
+    
+    int32_t Width() const {return info.width;}
+    int32_t Height() const {return info.height;}
+    int32_t PixelBytes() const {return info.pixelBytes;}
+    
+    // Read the image data into image, which must be of the file's size. May
+    // be called once.
+    template<typename imgT>
+    void Read(imgT & image);
+};
+
+inline TargaReader::TargaReader(const std::string & fname):
+    filename(fname),
+    fin(fname.c_str(), std::ios::in | std::ios::binary)
+{
+    if(!fin)
+        throw std::runtime_error((boost::format("Could not open file \"%s\": %s")% filename % strerror(errno)).str());
+    if(!info.ReadHeader(fin))
+        throw std::runtime_error((boost::format("Could not read Targa header of \"%s\"")% filename).str());
+    
+    info.pixelBytes = info.depth/8;
+    bool truecolor = ((info.type == kTargaType_Truecolor || info.type == kTargaType_RLE_Truecolor) &&
+                      (info.depth == 24 || info.depth == 32));
+    bool gray = ((info.type == kTargaType_BW || info.type == kTargaType_RLE_BW) && info.depth == 8);
+    if(!truecolor && !gray)
+        throw std::runtime_error((boost::format("Unsupported Targa image in \"%s\": type %d, %d bits per pixel")%
+                                  filename % int(info.type) % int(info.depth)).str());
+    if(info.IsRLE())
+        decoder.reset(new TargaRLEDecoder(fin, info.pixelBytes));
+}
+
+inline void TargaReader::ReadRows(uint8_t * buf, int32_t nrows)
+{
+    size_t n = size_t(info.width)*nrows;
+    if(decoder? !decoder->Decode(buf, n) : !fin.read((char *)buf, n*info.pixelBytes))
+        throw std::runtime_error((boost::format("Unexpected end of Targa image data in \"%s\"")% filename).str());
+}
+
+template<typename imgT>
+void TargaReader::Read(imgT & image)
+{
+    typedef typename imgT::pixel_t pixel_t;
+    if(image.Width() != Width() || image.Height() != Height())
+        throw std::runtime_error((boost::format("TargaReader::Read(): %dx%d image for %dx%d file \"%s\"")%
+                                  image.Width() % image.Height() % Width() % Height() % filename).str());
+    
+    const int32_t width = Width(), height = Height(), pixelBytes = PixelBytes();
+    const size_t rowBytes = size_t(width)*pixelBytes;
+    const bool topDown = info.Descriptor() & 0x20, rightToLeft = info.Descriptor() & 0x10;
+    const int32_t ytiles = (height + kTileHeight - 1)/kTileHeight;
+    
+    std::vector<uint8_t> band(rowBytes*kTileHeight);
+    for(int32_t t = 0; t < ytiles; ++t)
+    {
+        // Image rows y0 to y1 of this row of tiles, band row 0 being the
+        // first of them in the file
+        int32_t ty = topDown? ytiles - 1 - t : t;
+        int32_t y0 = ty*kTileHeight, y1 = std::min(y0 + kTileHeight, height);
+        ReadRows(&band[0], y1 - y0);
+        
+        image.EachTile(Rect(0, y0, width, y1 - y0), [&](typename imgT::TileInfo & ti){
+            uint32_t row[kTileWidth];
+            int32_t n = std::min(kTileWidth, width - ti.x);
+            int32_t fx = rightToLeft? width - 1 - ti.x : ti.x;
+            for(int32_t y = y0; y < y1; ++y) {
+                const uint8_t * src = &band[(topDown? y1 - 1 - y : y - y0)*rowBytes + size_t(fx)*pixelBytes];
+                TargaDecodePixels(row, src, n, pixelBytes, rightToLeft);
+                CopyPixels<pixel_t, PixelTypeRGBA32>(&(*ti.pixels)[(y - y0)*kTileWidth], row, n);
+            }
+        });
+    }
+}
+
+// Read Targa file into image, which must be of the file's size
+template<typename imgT>
+void ReadTarga(const std::string & filename, imgT & image)
+{
+    TargaReader(filename).Read(image);
+}
+
+
+// Pixels of src as RGBA32, converted into buf for other pixel types
+template<typename pixT>
+const uint32_t * TargaRGBA32(const typename pixT::pixel_val_t * src, uint32_t * buf, size_t len)
+{
+    CopyPixels<PixelTypeRGBA32, pixT>(buf, src, len);
+    return buf;
+}
+
+template<>
+inline const uint32_t * TargaRGBA32<PixelTypeRGBA32>(const uint32_t * src, uint32_t * buf, size_t len)
+{
+    return src;
+}
+
+// Convert up to kTileWidth pixels to file pixels of pixelBytes each: gray
+// levels for 1 byte pixels, BGR or BGRA for 3 or 4
+template<typename pixT>
+void TargaEncodePixels(uint8_t * dst, const typename pixT::pixel_val_t * src, size_t len, int32_t pixelBytes)
+{
+    uint32_t buf[kTileWidth];
+    if(pixelBytes == 1) {
+        CopyPixels<PixelTypeU32, pixT>(buf, src, len);
+        pixelconv::Gray8FromU32(dst, buf, len);
+    }
+    else if(pixelBytes == 3) {
+        pixelconv::BGR24FromRGBA32(dst, TargaRGBA32<pixT>(src, buf, len), len);
+    }
+    else {
+        pixelconv::SwapRB32(reinterpret_cast<uint32_t *>(dst), TargaRGBA32<pixT>(src, buf, len), len);
+    }
+}
+
+// Write image to a Targa file of depth 8 (gray), 24 or 32 bits, RLE
+// compressed if rle is set
+template<typename imgT>
+void WriteTarga(const std::string & filename, imgT & image, int32_t depth = 32, bool rle = false)
+{
+    typedef typename imgT::pixel_t pixel_t;
+    const int32_t width = image.Width(), height = image.Height();
+    if(depth != 8 && depth != 24 && depth != 32)
+        throw std::runtime_error((boost::format("WriteTarga(): unsupported depth %d for \"%s\"")% depth % filename).str());
+    if(width > 0xFFFF || height > 0xFFFF)
+        throw std::runtime_error((boost::format("WriteTarga(): %dx%d image too large for \"%s\"")% width % height % filename).str());
+    
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, (mode_t)0644);
+    if(fd < 0)
+        throw std::runtime_error((boost::format("Could not open file \"%s\": %s")% filename % strerror(errno)).str());
+    
+    // Writes all of buf at offset, returning errno on failure
+    auto writeAt = [fd](const uint8_t * buf, size_t n, off_t offset) -> int {
+        while(n > 0) {
+            ssize_t w = pwrite(fd, buf, n, offset);
+            if(w < 0 && errno == EINTR)
+                continue;
+            if(w <= 0)
+                return (w < 0)? errno : EIO;
+            buf += w;
+            n -= w;
+            offset += w;
+        }
+        return 0;
+    };
+    
+    const int32_t pixelBytes = depth/8;
+    const size_t rowBytes = size_t(width)*pixelBytes;
+    const int32_t xtiles = (width + kTileWidth - 1)/kTileWidth, ytiles = (height + kTileHeight - 1)/kTileHeight;
+    uint8_t type = (depth == 8)? (rle? kTargaType_RLE_BW : kTargaType_BW) : (rle? kTargaType_RLE_Truecolor : kTargaType_Truecolor);
+    const uint8_t header[18] = {
+        0, 0, type,// no ID or color map
+        0, 0, 0, 0, 0,// color map spec
+        0, 0, 0, 0,// x, y origin
+        uint8_t(width & 0xFF), uint8_t(width >> 8), uint8_t(height & 0xFF), uint8_t(height >> 8),
+        uint8_t(depth),
+        uint8_t((depth == 32)? 8 : 0)// alpha bits, lower left origin
+    };
+    off_t offset = sizeof(header);
+    std::atomic<int> err(writeAt(header, sizeof(header), 0));
+    
+    // Untile row of tiles ty into band
+    WorkerLocal<std::vector<typename imgT::TileInfo *>> gathered;
+    auto untile = [&](int32_t ty, uint8_t * band) {
+        std::vector<typename imgT::TileInfo *> & rtiles = gathered.Local();
+        int32_t y0 = ty*kTileHeight, y1 = std::min(y0 + kTileHeight, height);
+        image.GetTileManager().GatherTiles(image, 0, ty, xtiles, ty + 1, rtiles);
+        image.GetTileManager().Prefetch(image, rtiles);
+        for(int32_t tx = 0; tx < xtiles; ++tx)
+        {
+            auto & ti = image.GetTiles()[ty*xtiles + tx];
+            int32_t n = std::min(kTileWidth, width - ti.x);
+            image.PrepareTile(ti, kAccessRead);
+            for(int32_t y = y0; y < y1; ++y)
+                TargaEncodePixels<pixel_t>(band + (y - y0)*rowBytes + size_t(ti.x)*pixelBytes,
+                                           &(*ti.pixels)[(y - y0)*kTileWidth], n, pixelBytes);
+            image.ReleaseTile(ti, kAccessRead);
+        }
+    };
+    
+    WorkerLocal<std::vector<uint8_t>> bands;
+    if(!rle)
+    {
+        WorkerPool::Shared().ParallelForGuided(ytiles, 1, [&](int workerID, size_t begin, size_t end){
+            std::vector<uint8_t> & band = bands.Local();
+            band.resize(rowBytes*kTileHeight);
+            for(size_t ty = begin; ty < end && err == 0; ++ty) {
+                int32_t y0 = ty*kTileHeight, y1 = std::min(y0 + kTileHeight, height);
+                untile(ty, &band[0]);
+                if(int e = writeAt(&band[0], (y1 - y0)*rowBytes, offset + off_t(y0)*rowBytes))
+                    err = e;
+            }
+        });
+        offset += off_t(height)*rowBytes;
+    }
+    else
+    {
+        // Encoded sizes aren't known in advance, so bands are encoded in
+        // batches and written in order
+        const int32_t batch = WorkerPool::Shared().NumWorkers();
+        const size_t rowBound = TargaRLEBound(width, pixelBytes);
+        std::vector<std::vector<uint8_t>> encoded(batch);
+        for(int32_t ty0 = 0; ty0 < ytiles && err == 0; ty0 += batch)
+        {
+            int32_t nbands = std::min(batch, ytiles - ty0);
+            WorkerPool::Shared().ParallelForGuided(nbands, 1, [&](int workerID, size_t begin, size_t end){
+                std::vector<uint8_t> & band = bands.Local();
+                band.resize(rowBytes*kTileHeight);
+                for(size_t b = begin; b < end; ++b) {
+                    int32_t ty = ty0 + b;
+                    int32_t nrows = std::min(kTileHeight, height - ty*kTileHeight);
+                    untile(ty, &band[0]);
+                    std::vector<uint8_t> & out = encoded[b];
+                    out.resize(rowBound*nrows);
+                    size_t bytes = 0;
+                    for(int32_t y = 0; y < nrows; ++y)
+                        bytes += TargaRLEEncode(&out[bytes], &band[y*rowBytes], width, pixelBytes);
+                    out.resize(bytes);
+                }
+            });
+            for(int32_t b = 0; b < nbands && err == 0; ++b) {
+                err = writeAt(&encoded[b][0], encoded[b].size(), offset);
+                offset += encoded[b].size();
+            }
+        }
+    }
+    
+    // Footer: no extension area or developer directory
+    const char footer[26] = "\0\0\0\0\0\0\0\0TRUEVISION-XFILE.";
+    if(err == 0)
+        err = writeAt((const uint8_t *)footer, sizeof(footer), offset);
+    close(fd);
+    if(err != 0)
+        throw std::runtime_error((boost::format("Could not write file \"%s\": %s")% filename % strerror(err)).str());
+}
+
+} // namespace bigimage
+#endif // TARGA_STREAM_H
@@ -19,6 +19,21 @@ const int32_t kTileWidth = 64;
 const int32_t kTileHeight = 64;
 const int32_t kTilePixels = kTileWidth*kTileHeight;
 
+// Tile state flags
+enum {
+    kTileFill = 0x01,// pixels are the tile manager's shared, read-only fill tile
+    kTileDirty = 0x02,// pixels modified since last written to backing store
+    kTileLoading = 0x04// pixels in transit to or from backing store
+};
+
+// Access declared by tile traversal functions, letting tile managers avoid work
+// for tiles that won't be modified.
+enum TileAccess {
+    kAccessRead,// tiles are only read
+    kAccessWrite,// tiles may be modified
+    kAccessPreserveFill// tiles may be modified, but fill tiles would be left as-is, so may be skipped
+};
+
 // This structure may go away, it serves no real purpose as tiles can always be
 // handled through TileInfo structs.
 template<typename imageT>
@@ -36,11 +51,14 @@ struct TileInfo {
     
     std::array<pixel_val_t, kTilePixels> * pixels;
     int32_t x, y;
-    uint32_t references;
+    uint32_t references;// outputs of the running ImageProcJob still needing tile
+    uint32_t state;
     
     TileInfo() {}
+    TileInfo(int32_t _x, int32_t _y):
+        pixels(nullptr), x(_x), y(_y), references(0), state(0) {}
     TileInfo(int32_t _x, int32_t _y, Tile<imageT> & t):
-        pixels(&t.pixels), x(_x), y(_y), references(0) {}
+        pixels(&t.pixels), x(_x), y(_y), references(0), state(0) {}
     
     
     // Coordinates may be relative to either image or tile origin
@@ -0,0 +1,326 @@
+
+// Lossless compression of tiles, for stores that keep tiles compressed.
+//
+// Tiles are first shuffled into byte planes, byte k of every pixel together,
+// with each byte replaced by its difference from the byte of the previous
+// pixel. Smooth images leave planes of small values, and the high bytes of
+// float channels planes of mostly zeros. The planes are then compressed with
+// a byte-oriented LZ77 coder in the style of LZ4: sequences of a token, a run
+// of literals, and a match of at least 4 bytes at an offset of up to 64 KB.
+//
+// Token: high nibble literal count, low nibble match length - 4. A nibble of
+// 15 continues in following bytes, each adding up to 255. Literals follow the
+// token and literal count, then the 16 bit little-endian match offset and any
+// match length bytes. The last sequence has literals only, and ends the data.
+//
+// Blocks are at most 64 KB, the size of the largest tiles.
+//
+// The shuffle has SSE2 versions for 4 and 16 byte pixels, built in whenever
+// the compiler targets SSE2, as it always does for x86-64.
+
+#ifndef TILECODEC_H
+#define TILECODEC_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__SSE2__)
+#define TILECODEC_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace bigimage {
+
+const size_t kLZMinMatch = 4;
+const int32_t kLZHashBits = 13;
+
+// Largest compressed size of len bytes
+inline size_t LZBound(size_t len) {return len + len/255 + 16;}
+
+inline uint32_t LZRead32(const uint8_t * p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+inline uint32_t LZHash(uint32_t v) {return (v*2654435761u) >> (32 - kLZHashBits);}
+
+// Write count in the continuation bytes of a nibble that is already 15
+inline uint8_t * LZWriteLength(uint8_t * op, size_t count)
+{
+    for(; count >= 255; count -= 255)
+        *op++ = 255;
+    *op++ = count;
+    return op;
+}
+
+// Compress len bytes of src into dst, which must have room for LZBound(len)
+// bytes. Returns the compressed size.
+inline size_t LZCompress(uint8_t * dst, const uint8_t * src, size_t len)
+{
+    uint16_t table[1 << kLZHashBits];
+    memset(table, 0, sizeof(table));
+    uint8_t * op = dst;
+    const uint8_t * anchor = src;// start of pending literals
+    
+    auto emit = [&](const uint8_t * lit, size_t nlit, size_t offset, size_t mlen) {
+        uint8_t * token = op++;
+        *token = std::min<size_t>(nlit, 15) << 4;
+        if(nlit >= 15)
+            op = LZWriteLength(op, nlit - 15);
+        memcpy(op, lit, nlit);
+        op += nlit;
+        if(mlen == 0)
+            return;
+        *op++ = offset & 0xFF;
+        *op++ = offset >> 8;
+        mlen -= kLZMinMatch;
+        *token |= std::min<size_t>(mlen, 15);
+        if(mlen >= 15)
+            op = LZWriteLength(op, mlen - 15);
+    };
+    
+    if(len >= kLZMinMatch + 1)
+    {
+        const uint8_t * ip = src + 1;
+        const uint8_t * matchLimit = src + len - kLZMinMatch;// last position a match may start
+        uint32_t misses = 0;
+        while(ip <= matchLimit)
+        {
+            uint32_t h = LZHash(LZRead32(ip));
+            const uint8_t * ref = src + table[h];
+            table[h] = ip - src;
+            if(ref >= ip || LZRead32(ref) != LZRead32(ip)) {
+                // Step faster through data that isn't matching
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+            
+            const uint8_t * mend = ip + kLZMinMatch, * rend = ref + kLZMinMatch;
+            while(mend < src + len && *mend == *rend)
+                ++mend, ++rend;
+            emit(anchor, ip - anchor, ip - ref, mend - ip);
+            
+            // Index a position within the match, so runs keep matching
+            if(mend - 2 <= matchLimit)
+                table[LZHash(LZRead32(mend - 2))] = mend - 2 - src;
+            ip = anchor = mend;
+        }
+    }
+    emit(anchor, src + len - anchor, 0, 0);
+    return op - dst;
+}
+
+// Decompress srcLen bytes of src into len bytes at dst. Returns false if the
+// data is corrupt or doesn't decompress to exactly len bytes.
+inline bool LZDecompress(uint8_t * dst, size_t len, const uint8_t * src, size_t srcLen)
+{
+    const uint8_t * ip = src, * iend = src + srcLen;
+    uint8_t * op = dst, * oend = dst + len;
+    
+    // Read continuation bytes of a length whose nibble is 15
+    auto readLength = [&](size_t & count) {
+        uint8_t b;
+        do {
+            if(ip >= iend)
+                return false;
+            b = *ip++;
+            count += b;
+        } while(b == 255);
+        return true;
+    };
+    
+    while(ip < iend)
+    {
+        uint8_t token = *ip++;
+        size_t nlit = token >> 4;
+        if(nlit == 15 && !readLength(nlit))
+            return false;
+        if(nlit > size_t(iend - ip) || nlit > size_t(oend - op))
+            return false;
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if(ip == iend)
+            break;
+        
+        if(iend - ip < 2)
+            return false;
+        size_t offset = ip[0] | (size_t(ip[1]) << 8);
+        ip += 2;
+        size_t mlen = token & 15;
+        if(mlen == 15 && !readLength(mlen))
+            return false;
+        mlen += kLZMinMatch;
+        if(offset == 0 || offset > size_t(op - dst) || mlen > size_t(oend - op))
+            return false;
+        
+        const uint8_t * ref = op - offset;
+        if(offset >= mlen) {
+            memcpy(op, ref, mlen);
+            op += mlen;
+        }
+        else if(offset >= 8) {
+            // Overlapping, but 8 byte chunks never overlap their source
+            uint8_t * mend = op + mlen;
+            for(; op + 8 <= mend; op += 8, ref += 8)
+                memcpy(op, ref, 8);
+            while(op < mend)
+                *op++ = *ref++;
+        }
+        else {
+            for(size_t j = 0; j < mlen; ++j)
+                op[j] = ref[j];
+            op += mlen;
+        }
+    }
+    return op == oend;
+}
+
+// Shuffle elements [from, n) of n elements of elemBytes bytes into byte planes
+// of differences. This scalar version defines the format.
+inline void ShuffleDeltaScalar(uint8_t * dst, const uint8_t * src, size_t n, size_t elemBytes, size_t from = 0)
+{
+    for(size_t b = 0; b < elemBytes; ++b)
+    {
+        uint8_t * plane = dst + b*n;
+        const uint8_t * in = src + from*elemBytes + b;
+        uint8_t prev = from? in[-ptrdiff_t(elemBytes)] : 0;
+        for(size_t i = from; i < n; ++i, in += elemBytes) {
+            plane[i] = *in - prev;
+            prev = *in;
+        }
+    }
+}
+
+inline void UnshuffleDeltaScalar(uint8_t * dst, const uint8_t * src, size_t n, size_t elemBytes, size_t from = 0)
+{
+    for(size_t b = 0; b < elemBytes; ++b)
+    {
+        const uint8_t * plane = src + b*n;
+        uint8_t * out = dst + from*elemBytes + b;
+        uint8_t prev = from? out[-ptrdiff_t(elemBytes)] : 0;
+        for(size_t i = from; i < n; ++i, out += elemBytes) {
+            prev += plane[i];
+            *out = prev;
+        }
+    }
+}
+
+#if defined(TILECODEC_SSE2)
+// Each round interleaves the bytes of the first half of the rows with the
+// second half. Four rounds transpose 16 rows of 16 bytes, and turn 4 rows of
+// 4 byte elements into 4 byte planes; two rounds turn the planes back.
+template<int nrows>
+inline void InterleaveRows(__m128i * x, int rounds)
+{
+    __m128i y[nrows];
+    for(int r = 0; r < rounds; ++r)
+    {
+        for(int i = 0; i < nrows/2; ++i) {
+            y[2*i] = _mm_unpacklo_epi8(x[i], x[i + nrows/2]);
+            y[2*i + 1] = _mm_unpackhi_epi8(x[i], x[i + nrows/2]);
+        }
+        std::copy(y, y + nrows, x);
+    }
+}
+#endif
+
+// Shuffle n elements of elemBytes bytes into byte planes of differences, 16
+// elements per step with SSE2 for RGBAf and 32 bit pixels
+inline void ShuffleDelta(uint8_t * dst, const uint8_t * src, size_t n, size_t elemBytes)
+{
+    size_t from = 0;
+#if defined(TILECODEC_SSE2)
+    __m128i x[16], prev = _mm_setzero_si128();
+    if(elemBytes == 16) {
+        for(; from + 16 <= n; from += 16)
+        {
+            for(int k = 0; k < 16; ++k) {
+                __m128i p = _mm_loadu_si128((const __m128i *)(src + (from + k)*16));
+                x[k] = _mm_sub_epi8(p, prev);
+                prev = p;
+            }
+            InterleaveRows<16>(x, 4);
+            for(int b = 0; b < 16; ++b)
+                _mm_storeu_si128((__m128i *)(dst + b*n + from), x[b]);
+        }
+    }
+    else if(elemBytes == 4) {
+        for(; from + 16 <= n; from += 16)
+        {
+            for(int k = 0; k < 4; ++k) {
+                __m128i p = _mm_loadu_si128((const __m128i *)(src + from*4 + k*16));
+                __m128i before = _mm_or_si128(_mm_slli_si128(p, 4), _mm_srli_si128(prev, 12));
+                x[k] = _mm_sub_epi8(p, before);
+                prev = p;
+            }
+            InterleaveRows<4>(x, 4);
+            for(int b = 0; b < 4; ++b)
+                _mm_storeu_si128((__m128i *)(dst + b*n + from), x[b]);
+        }
+    }
+#endif
+    ShuffleDeltaScalar(dst, src, n, elemBytes, from);
+}
+
+inline void UnshuffleDelta(uint8_t * dst, const uint8_t * src, size_t n, size_t elemBytes)
+{
+    size_t from = 0;
+#if defined(TILECODEC_SSE2)
+    __m128i x[16], prev = _mm_setzero_si128();
+    if(elemBytes == 16) {
+        for(; from + 16 <= n; from += 16)
+        {
+            for(int b = 0; b < 16; ++b)
+                x[b] = _mm_loadu_si128((const __m128i *)(src + b*n + from));
+            InterleaveRows<16>(x, 4);
+            for(int k = 0; k < 16; ++k) {
+                prev = _mm_add_epi8(prev, x[k]);
+                _mm_storeu_si128((__m128i *)(dst + (from + k)*16), prev);
+            }
+        }
+    }
+    else if(elemBytes == 4) {
+        for(; from + 16 <= n; from += 16)
+        {
+            for(int b = 0; b < 4; ++b)
+                x[b] = _mm_loadu_si128((const __m128i *)(src + b*n + from));
+            InterleaveRows<4>(x, 2);
+            for(int k = 0; k < 4; ++k) {
+                // Running sum of the 4 elements, plus the last of the previous step
+                __m128i s = _mm_add_epi8(x[k], _mm_slli_si128(x[k], 4));
+                s = _mm_add_epi8(s, _mm_slli_si128(s, 8));
+                prev = _mm_add_epi8(s, _mm_shuffle_epi32(prev, 0xFF));
+                _mm_storeu_si128((__m128i *)(dst + from*4 + k*16), prev);
+            }
+        }
+    }
+#endif
+    UnshuffleDeltaScalar(dst, src, n, elemBytes, from);
+}
+
+// Compress a tile of len bytes of elemBytes byte pixels into dst, which must
+// have room for LZBound(len) bytes. scratch holds len bytes. Returns the
+// compressed size.
+inline size_t CompressTile(uint8_t * dst, const uint8_t * src, size_t len, size_t elemBytes, uint8_t * scratch)
+{
+    ShuffleDelta(scratch, src, len/elemBytes, elemBytes);
+    return LZCompress(dst, scratch, len);
+}
+
+inline bool DecompressTile(uint8_t * dst, size_t len, const uint8_t * src, size_t srcLen, size_t elemBytes,
+                           uint8_t * scratch)
+{
+    if(!LZDecompress(scratch, len, src, srcLen))
+        return false;
+    UnshuffleDelta(dst, scratch, len/elemBytes, elemBytes);
+    return true;
+}
+
+} // namespace bigimage
+#endif // TILECODEC_H
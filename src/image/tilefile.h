@@ -0,0 +1,232 @@
+
+// Native tiled image files. Backing files of file-backed images start with a
+// header page describing the image: its size, pixel type, tile and block
+// geometry, and the layout of tiles in the file, so that images can be opened
+// again directly from their backing files, with no import step.
+//
+// File layout:
+// 0: TileFileHeader, padded with zeros to kTileFileHeaderBytes
+// dataOffset: tile data, dataBytes long. For the block and quadtree layouts,
+// tiles are fixed size and stored in the order of their tile manager.
+// indexOffset: optional index of indexEntries TileFileRecords, one per tile in
+// the block order of TileBlockManager::TileIndex(), for layouts whose tiles
+// can't be located by computation, such as variable size compressed tiles.
+//
+// Tile data starts 4 KB into the file, so tiles stay page aligned when the
+// file is mapped. Fields are in host byte order.
+
+#ifndef TILEFILE_H
+#define TILEFILE_H
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <boost/format.hpp>
+
+#include "pixeltype.h"
+#include "tile.h"
+
+namespace bigimage {
+
+const uint32_t kTileFileVersion = 1;
+const uint64_t kTileFileHeaderBytes = 4096;
+
+// Arrangement of tiles in the data area
+enum TileLayout {
+    kTileLayoutBlock = 1,// TileBlockManager::TileIndex() order
+    kTileLayoutQuadtree = 2,// rank of Morton code, as TileQuadtreeManager
+    kTileLayoutIndexed = 3// located through the index
+};
+
+// Compression of tile records
+enum TileCodec {
+    kTileCodecNone = 0,
+    kTileCodecShuffleLZ = 1// byte plane shuffle with deltas, then LZ, see tilecodec.h
+};
+
+// Tile record flags
+enum {
+    kTileRecordRaw = 0x01// stored uncompressed
+};
+
+// How a tile manager treats an existing backing file
+enum TileFileMode {
+    kTileFileCreate,// use the file if it holds an image matching the one being created, otherwise start it over
+    kTileFileReadOnly,// open an existing image file without ever writing to it
+    kTileFileReadWrite// open an existing image file for update
+};
+
+struct TileFileHeader {
+    char magic[8];// "BIGTILES"
+    uint32_t version;
+    uint32_t headerBytes;
+    int32_t width, height;// pixels
+    int32_t tileWidth, tileHeight;// pixels
+    int32_t blockWidth, blockHeight;// tiles
+    uint32_t layout;// TileLayout
+    uint32_t pixelType;// PixelTypeTag
+    uint32_t pixelBytes;
+    uint32_t codec;// compression of tile records, 0 for none
+    uint64_t dataOffset, dataBytes;
+    uint64_t indexOffset, indexEntries;// indexOffset 0 if there is no index
+};
+
+// Location of a tile's data. Tiles with no data, never having been written,
+// are all zero.
+struct TileFileRecord {
+    uint64_t offset;
+    uint32_t bytes;
+    uint32_t flags;
+};
+
+inline const char * TileLayoutName(uint32_t layout)
+{
+    switch(layout) {
+        case kTileLayoutBlock: return "block";
+        case kTileLayoutQuadtree: return "quadtree";
+        case kTileLayoutIndexed: return "indexed";
+        default: return "unknown";
+    }
+}
+
+// Header of image with fixed size tiles in the given layout
+template<typename image_t>
+TileFileHeader MakeTileFileHeader(image_t & image, TileLayout layout, int32_t blockWidth, int32_t blockHeight)
+{
+    TileFileHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, "BIGTILES", 8);
+    hdr.version = kTileFileVersion;
+    hdr.headerBytes = kTileFileHeaderBytes;
+    std::tie(hdr.width, hdr.height) = image.Size();
+    hdr.tileWidth = kTileWidth;
+    hdr.tileHeight = kTileHeight;
+    hdr.blockWidth = blockWidth;
+    hdr.blockHeight = blockHeight;
+    hdr.layout = layout;
+    hdr.pixelType = image_t::pixel_t::kTag;
+    hdr.pixelBytes = sizeof(typename image_t::pixel_val_t);
+    hdr.dataOffset = kTileFileHeaderBytes;
+    size_t ntiles = size_t((hdr.width + kTileWidth - 1)/kTileWidth)*((hdr.height + kTileHeight - 1)/kTileHeight);
+    hdr.dataBytes = ntiles*sizeof(typename image_t::Tile);
+    return hdr;
+}
+
+// Read header of fd, returning false if it doesn't start with one
+inline bool ReadTileFileHeader(int fd, TileFileHeader & hdr)
+{
+    return pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+           memcmp(hdr.magic, "BIGTILES", 8) == 0 && hdr.version == kTileFileVersion;
+}
+
+// Read header of file, throwing if it isn't an image file
+inline TileFileHeader ReadTileFileHeader(const std::string & path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        throw std::runtime_error((boost::format("Could not open file \"%s\": %s")% path % strerror(errno)).str());
+    TileFileHeader hdr;
+    bool ok = ReadTileFileHeader(fd, hdr);
+    close(fd);
+    if(!ok)
+        throw std::runtime_error((boost::format("\"%s\" is not a tiled image file")% path).str());
+    return hdr;
+}
+
+// Whether headers describe images of the same size, pixel type, tile geometry
+// and layout, whatever the extent of their data
+inline bool SameTileImage(const TileFileHeader & a, const TileFileHeader & b)
+{
+    return a.pixelType == b.pixelType && a.pixelBytes == b.pixelBytes && a.layout == b.layout && a.codec == b.codec &&
+           a.width == b.width && a.height == b.height && a.tileWidth == b.tileWidth && a.tileHeight == b.tileHeight &&
+           a.blockWidth == b.blockWidth && a.blockHeight == b.blockHeight;
+}
+
+// Check that the image file at path holds an image described by expected, as
+// far as needed to open it with expected's layout and pixel type
+inline void CheckTileFile(const std::string & path, const TileFileHeader & expected)
+{
+    TileFileHeader hdr = ReadTileFileHeader(path);
+    if(hdr.pixelType != expected.pixelType || hdr.pixelBytes != expected.pixelBytes)
+        throw std::runtime_error((boost::format("\"%s\" holds pixels of type %d, %d bytes, not type %d, %d bytes")%
+                                  path % hdr.pixelType % hdr.pixelBytes % expected.pixelType % expected.pixelBytes).str());
+    if(hdr.layout != expected.layout || hdr.codec != expected.codec)
+        throw std::runtime_error((boost::format("\"%s\" has %s layout with codec %d, not %s layout with codec %d")%
+                                  path % TileLayoutName(hdr.layout) % hdr.codec % TileLayoutName(expected.layout) % expected.codec).str());
+    if(hdr.width != expected.width || hdr.height != expected.height ||
+       hdr.tileWidth != expected.tileWidth || hdr.tileHeight != expected.tileHeight ||
+       hdr.blockWidth != expected.blockWidth || hdr.blockHeight != expected.blockHeight)
+        throw std::runtime_error((boost::format("\"%s\" holds a %dx%d image in %dx%d tiles and %dx%d blocks, not %dx%d in %dx%d tiles and %dx%d blocks")%
+                                  path % hdr.width % hdr.height % hdr.tileWidth % hdr.tileHeight % hdr.blockWidth % hdr.blockHeight %
+                                  expected.width % expected.height % expected.tileWidth % expected.tileHeight %
+                                  expected.blockWidth % expected.blockHeight).str());
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0 || uint64_t(st.st_size) < hdr.dataOffset + hdr.dataBytes)
+        throw std::runtime_error((boost::format("\"%s\" is truncated")% path).str());
+}
+
+// Set up fd as the backing file of a new image described by hdr. A file
+// already holding a matching image is kept as it is, otherwise the file is
+// emptied, the header written, and the file sized for the data. Returns true
+// if the file was kept.
+inline bool InitTileFile(int fd, const TileFileHeader & hdr, const std::string & path)
+{
+    TileFileHeader existing;
+    struct stat st;
+    if(ReadTileFileHeader(fd, existing) && memcmp(&existing, &hdr, sizeof(hdr)) == 0 &&
+       fstat(fd, &st) == 0 && uint64_t(st.st_size) >= hdr.dataOffset + hdr.dataBytes)
+        return true;
+    
+    std::vector<uint8_t> page(hdr.headerBytes, 0);
+    memcpy(&page[0], &hdr, sizeof(hdr));
+    if(ftruncate(fd, 0) != 0 || ftruncate(fd, hdr.dataOffset + hdr.dataBytes) != 0)
+        throw std::runtime_error((boost::format("Could not resize \"%s\": %s")% path % strerror(errno)).str());
+    if(pwrite(fd, &page[0], page.size(), 0) != ssize_t(page.size()))
+        throw std::runtime_error((boost::format("Could not write header of \"%s\": %s")% path % strerror(errno)).str());
+    return false;
+}
+
+inline bool InitTileFile(const std::string & path, const TileFileHeader & hdr)
+{
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, (mode_t)0600);
+    if(fd < 0)
+        throw std::runtime_error((boost::format("Could not open file \"%s\": %s")% path % strerror(errno)).str());
+    bool kept;
+    try {
+        kept = InitTileFile(fd, hdr, path);
+    }
+    catch(...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    return kept;
+}
+
+// Read the index of the image file open at fd
+inline void ReadTileFileIndex(int fd, const TileFileHeader & hdr, std::vector<TileFileRecord> & records,
+                              const std::string & path)
+{
+    records.resize(hdr.indexEntries);
+    ssize_t bytes = hdr.indexEntries*sizeof(TileFileRecord);
+    if(bytes > 0 && pread(fd, &records[0], bytes, hdr.indexOffset) != bytes)
+        throw std::runtime_error((boost::format("Could not read index of \"%s\"")% path).str());
+}
+
+inline void WriteTileFileIndex(int fd, const TileFileHeader & hdr, const std::vector<TileFileRecord> & records,
+                               const std::string & path)
+{
+    ssize_t bytes = records.size()*sizeof(TileFileRecord);
+    if(bytes > 0 && pwrite(fd, &records[0], bytes, hdr.indexOffset) != bytes)
+        throw std::runtime_error((boost::format("Could not write index of \"%s\": %s")% path % strerror(errno)).str());
+}
+
+} // namespace bigimage
+#endif // TILEFILE_H
@@ -6,8 +6,16 @@
 #ifndef TILEMANAGER_H
 #define TILEMANAGER_H
 
+#include <algorithm>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
 #include "filestore.h"
 #include "tile.h"
+#include "tilepool.h"
+#include "tilefile.h"
 
 namespace bigimage {
 
@@ -20,13 +28,112 @@ const int32_t kBlockTiles = kBlockWidth*kBlockHeight;
 // Tile managers
 // *****************************************************************************
 
-// TODO: TileLinearManager, TileQuadtreeManager
+// TODO: TileLinearManager
 
-// Layout of tiles in memory for quadtree:
-// 0 1 4 5
-// 2 3 6 7
-// 8 9 C D
-// A B E F
+// Common storage handling for tile managers that keep all tiles of an image in
+// one array, either in memory or in a memory mapped backing file. Derived
+// managers decide the order of tiles within that array. Backing files are
+// image files, see tilefile.h, with the array following the header.
+class TileArrayManager {
+  protected:
+    std::string backingFilePath;
+    TileFileMode fileMode;
+    filestore::MappedFile * backingFile;
+    TilePool tmpPool;
+    
+    // Allocate storage for the tiles of image, in the given layout
+    template<typename image_t>
+    auto AllocTiles(image_t & image, TileLayout layout, int32_t blockWidth, int32_t blockHeight)
+        -> typename image_t::Tile *
+    {
+        typedef typename image_t::Tile Tile;
+        TileFileHeader hdr = MakeTileFileHeader(image, layout, blockWidth, blockHeight);
+        if(backingFilePath == "") {
+            if(fileMode != kTileFileCreate)
+                throw std::runtime_error("Opening an image requires a file path");
+            return new Tile[hdr.dataBytes/sizeof(Tile)];
+        }
+        if(fileMode == kTileFileCreate)
+            InitTileFile(backingFilePath, hdr);
+        else
+            CheckTileFile(backingFilePath, hdr);
+        size_t s = hdr.dataOffset + hdr.dataBytes;
+        backingFile = new filestore::MappedFile(backingFilePath.c_str(), s, s, fileMode == kTileFileReadOnly);
+        return reinterpret_cast<Tile *>(static_cast<uint8_t *>(backingFile->baseAddr) + hdr.dataOffset);
+    }
+    
+  public:
+    // Backing files are created or opened according to mode. Read-only images
+    // may still be modified, but changes are never written to the file.
+    TileArrayManager(const std::string & bfPath, TileFileMode mode = kTileFileCreate):
+        backingFilePath(bfPath), fileMode(mode), backingFile(nullptr) {}
+    ~TileArrayManager() {}
+    
+    template<typename Tile>
+    void FreeMain(Tile * tiles) {
+        if(backingFile) {
+            delete backingFile;
+            backingFile = nullptr;
+        }
+        else {
+            delete[] tiles;
+        }
+    }
+    
+    // Temporary tiles come from a per-thread pool. Contents are undefined.
+    template<typename image_t>
+    auto AllocTmp() -> typename image_t::Tile * {
+        return new(tmpPool.Alloc(sizeof(typename image_t::Tile))) typename image_t::Tile;
+    }
+    
+    template<typename image_t>
+    void FreeTmp(typename image_t::Tile * tile) {tmpPool.Free(tile);}
+    
+    TilePool & GetTmpPool() {return tmpPool;}
+    
+    // Move pixels of src into dst. Managers may exchange buffers rather than
+    // copy, so afterwards the caller frees whatever src.pixels refers to.
+    template<typename image_t>
+    void MovePixels(typename image_t::TileInfo & dst, typename image_t::TileInfo & src) {
+        memcpy(dst.pixels, src.pixels, sizeof(typename image_t::Tile));
+    }
+    
+    // Write modified tiles to the backing file, if there is one
+    template<typename image_t>
+    void Flush(image_t & image) {
+        if(backingFile)
+            backingFile->Flush();
+    }
+    
+    // Advise that tiles will be accessed soon. Contiguous runs of tiles in a
+    // backing file are advised as single ranges. In-memory images need nothing.
+    template<typename image_t>
+    void Prefetch(image_t & image, const std::vector<typename image_t::TileInfo *> & tiles) {
+        if(!backingFile)
+            return;
+        const size_t tileBytes = sizeof(typename image_t::Tile);
+        uintptr_t pageMask = ~uintptr_t(sysconf(_SC_PAGESIZE) - 1);
+        size_t j = 0;
+        while(j < tiles.size())
+        {
+            uintptr_t start = reinterpret_cast<uintptr_t>(tiles[j]->pixels), end = start + tileBytes;
+            for(++j; j < tiles.size() && reinterpret_cast<uintptr_t>(tiles[j]->pixels) == end; ++j)
+                end += tileBytes;
+            start &= pageMask;
+            madvise(reinterpret_cast<void *>(start), end - start, MADV_WILLNEED);
+        }
+    }
+    
+    // Called by tile traversal functions before handing a tile to the caller's
+    // function, with the access the traversal declared. Returns false if the
+    // tile should be skipped. All tiles are always present in an array.
+    template<typename image_t>
+    bool PrepareTile(image_t & image, typename image_t::TileInfo & ti, TileAccess access) {return true;}
+    
+    // Called after the caller's function is done with a prepared tile.
+    template<typename image_t>
+    void ReleaseTile(image_t & image, typename image_t::TileInfo & ti, TileAccess access) {}
+};
 
 
 // Images are organized in tiles and blocks.
@@ -36,16 +143,27 @@ const int32_t kBlockTiles = kBlockWidth*kBlockHeight;
 // With 64x64 tiles and 8x8 blocks:
 // 4096 pixels/tile, 16384 B at 32 bpp.
 // 232144 pixels/block, 512x512 pixels, 1 MB at 32 bpp
-// Image dimensions multiple of 64.
+// Image dimensions multiple of 64. Edge blocks may be partial.
 
-class TileBlockManager {
-    std::string backingFilePath;
-    filestore::MappedFile * backingFile;
-    
+class TileBlockManager: public TileArrayManager {
   public:
-    TileBlockManager(const std::string & bfPath): backingFilePath(bfPath) {}
+    TileBlockManager(const std::string & bfPath, TileFileMode mode = kTileFileCreate): TileArrayManager(bfPath, mode) {}
     ~TileBlockManager() {}
     
+    // Memory index of tile at tile coordinates tx, ty. Blocks at the right and
+    // bottom edges of images that aren't a multiple of the block size are
+    // narrower or shorter, and packed without gaps.
+    static int32_t TileIndex(int32_t tx, int32_t ty, int32_t xtiles, int32_t ytiles) {
+        const int32_t kBlockRowTiles = xtiles*kBlockHeight;
+        int32_t by = ty/kBlockHeight;
+        int32_t bx = tx/kBlockWidth;// block coordinates
+        int32_t btx = tx % kBlockWidth;// block-relative tile coordinates
+        int32_t bty = ty % kBlockHeight;
+        int32_t bw = std::min(kBlockWidth, xtiles - bx*kBlockWidth);// block dimensions
+        int32_t bh = std::min(kBlockHeight, ytiles - by*kBlockHeight);
+        return (by*kBlockRowTiles + bx*kBlockWidth*bh) + (bty*bw + btx);
+    }
+    
     // Allocate main image tiles and initialize tinfo entries
     template<typename image_t>
     auto AllocMain(image_t & image) -> typename image_t::Tile *
@@ -55,32 +173,18 @@ class TileBlockManager {
         int32_t xtiles = (width + kTileWidth - 1)/kTileWidth;
         int32_t ytiles = (height + kTileHeight - 1)/kTileHeight;
         
-        typename image_t::Tile * tiles;
-        if(backingFilePath != "") {
-            size_t s = xtiles*ytiles*sizeof(typename image_t::Tile);
-            backingFile = new filestore::MappedFile(backingFilePath.c_str(), s, s);
-            tiles = static_cast<typename image_t::Tile*>(backingFile->baseAddr);
-        }
-        else {
-            tiles = new typename image_t::Tile[xtiles*ytiles];
-        }
+        typename image_t::Tile * tiles = AllocTiles(image, kTileLayoutBlock, kBlockWidth, kBlockHeight);
         std::vector<typename image_t::TileInfo> & tinfo = image.GetTiles();
         std::vector<typename image_t::TileInfo *> & torder = image.GetNaturalOrdering();
         tinfo.resize(xtiles*ytiles);
         torder.resize(xtiles*ytiles);
         
-        const int32_t kBlockRowTiles = xtiles*kBlockHeight;
         // tx and ty are global tile coordinates
         for(int tx = 0; tx < xtiles; ++tx)
         for(int ty = 0; ty < ytiles; ++ty)
         {
             // Map to tiled and blocked pixel data
-            // Which block row are we in?
-            int32_t by = ty/kBlockHeight;
-            int32_t bx = tx/kBlockWidth;// block coordinates
-            int32_t btx = tx % kBlockWidth;// block-relative tile coordinates
-            int32_t bty = ty % kBlockHeight;
-            int32_t tidx = (by*kBlockRowTiles + bx*kBlockTiles) + (bty*kBlockWidth + btx);
+            int32_t tidx = TileIndex(tx, ty, xtiles, ytiles);
             typename image_t::Tile & tile = tiles[tidx];
             tinfo[ty*xtiles + tx] = typename image_t::TileInfo(tx*kTileWidth, ty*kTileHeight, tile);
             torder[tidx] = &tinfo[ty*xtiles + tx];
@@ -88,26 +192,113 @@ class TileBlockManager {
         return tiles;
     }
     
-    template<typename Tile>
-    void FreeMain(Tile * tiles) {
-        if(backingFile) {
-            delete backingFile;
-            backingFile = nullptr;
-        }
-        else {
-            delete[] tiles;
+    // Gather tiles in tile coordinate range [tx0, tx1) x [ty0, ty1), in memory
+    // order: block by block along block rows, and row by row within blocks.
+    template<typename image_t>
+    void GatherTiles(image_t & image, int32_t tx0, int32_t ty0, int32_t tx1, int32_t ty1,
+                     std::vector<typename image_t::TileInfo *> & out)
+    {
+        std::vector<typename image_t::TileInfo> & tinfo = image.GetTiles();
+        int32_t xtiles = (std::get<0>(image.Size()) + kTileWidth - 1)/kTileWidth;
+        out.clear();
+        out.reserve((tx1 - tx0)*(ty1 - ty0));
+        for(int32_t by = ty0/kBlockHeight; by*kBlockHeight < ty1; ++by)
+        for(int32_t bx = tx0/kBlockWidth; bx*kBlockWidth < tx1; ++bx)
+        {
+            // Part of range within this block
+            int32_t bty0 = std::max(ty0, by*kBlockHeight), bty1 = std::min(ty1, (by + 1)*kBlockHeight);
+            int32_t btx0 = std::max(tx0, bx*kBlockWidth), btx1 = std::min(tx1, (bx + 1)*kBlockWidth);
+            for(int32_t ty = bty0; ty < bty1; ++ty)
+            for(int32_t tx = btx0; tx < btx1; ++tx)
+                out.push_back(&tinfo[ty*xtiles + tx]);
         }
     }
+};
+
+
+// *****************************************************************************
+// Quadtree (Z-order/Morton) layout. Each power-of-two square of tiles is
+// contiguous in memory, at every scale, so any neighborhood of tiles is close
+// together in the backing file regardless of where block boundaries would fall.
+// Layout of tiles in memory:
+// 0 1 4 5
+// 2 3 6 7
+// 8 9 C D
+// A B E F
+// Images that aren't a power-of-two square of tiles keep the same relative
+// order with the missing tiles squeezed out, so there are no constraints on
+// image size beyond the tile size and no storage wasted on padding.
+
+// Interleave bits of tile coordinates, x in the low bit of each pair
+inline uint64_t MortonCode(uint32_t x, uint32_t y)
+{
+    auto spread = [](uint64_t v) {
+        v = (v | (v << 16)) & 0x0000FFFF0000FFFFull;
+        v = (v | (v << 8)) & 0x00FF00FF00FF00FFull;
+        v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0Full;
+        v = (v | (v << 2)) & 0x3333333333333333ull;
+        v = (v | (v << 1)) & 0x5555555555555555ull;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+class TileQuadtreeManager: public TileArrayManager {
+  public:
+    TileQuadtreeManager(const std::string & bfPath, TileFileMode mode = kTileFileCreate): TileArrayManager(bfPath, mode) {}
+    ~TileQuadtreeManager() {}
     
+    // Allocate main image tiles and initialize tinfo entries
     template<typename image_t>
-    auto AllocTmp() -> typename image_t::Tile * {return new typename image_t::Tile;}
-    
-    template<typename image_t>
-    void FreeTmp(typename image_t::Tile * tile) {delete tile;}
+    auto AllocMain(image_t & image) -> typename image_t::Tile *
+    {
+        int32_t width, height;
+        std::tie(width, height) = image.Size();
+        int32_t xtiles = (width + kTileWidth - 1)/kTileWidth;
+        int32_t ytiles = (height + kTileHeight - 1)/kTileHeight;
+        
+        typename image_t::Tile * tiles = AllocTiles(image, kTileLayoutQuadtree, 0, 0);
+        std::vector<typename image_t::TileInfo> & tinfo = image.GetTiles();
+        std::vector<typename image_t::TileInfo *> & torder = image.GetNaturalOrdering();
+        tinfo.resize(xtiles*ytiles);
+        torder.resize(xtiles*ytiles);
+        
+        // Memory index of each tile is the rank of its Morton code
+        std::vector<std::pair<uint64_t, int32_t>> codes(xtiles*ytiles);
+        for(int32_t ty = 0; ty < ytiles; ++ty)
+        for(int32_t tx = 0; tx < xtiles; ++tx)
+            codes[ty*xtiles + tx] = std::make_pair(MortonCode(tx, ty), ty*xtiles + tx);
+        std::sort(codes.begin(), codes.end());
+        
+        for(size_t tidx = 0; tidx < codes.size(); ++tidx)
+        {
+            int32_t t = codes[tidx].second;
+            int32_t tx = t % xtiles, ty = t/xtiles;
+            tinfo[t] = typename image_t::TileInfo(tx*kTileWidth, ty*kTileHeight, tiles[tidx]);
+            torder[tidx] = &tinfo[t];
+        }
+        return tiles;
+    }
     
+    // Gather tiles in tile coordinate range [tx0, tx1) x [ty0, ty1), in memory
+    // order.
     template<typename image_t>
-    void MovePixels(typename image_t::TileInfo & dst, typename image_t::TileInfo & src) {
-        memcpy(dst.pixels, src.pixels, sizeof(typename image_t::Tile));
+    void GatherTiles(image_t & image, int32_t tx0, int32_t ty0, int32_t tx1, int32_t ty1,
+                     std::vector<typename image_t::TileInfo *> & out)
+    {
+        std::vector<typename image_t::TileInfo> & tinfo = image.GetTiles();
+        int32_t xtiles = (std::get<0>(image.Size()) + kTileWidth - 1)/kTileWidth;
+        std::vector<std::pair<uint64_t, int32_t>> codes;
+        codes.reserve((tx1 - tx0)*(ty1 - ty0));
+        for(int32_t ty = ty0; ty < ty1; ++ty)
+        for(int32_t tx = tx0; tx < tx1; ++tx)
+            codes.push_back(std::make_pair(MortonCode(tx, ty), ty*xtiles + tx));
+        std::sort(codes.begin(), codes.end());
+        
+        out.clear();
+        out.reserve(codes.size());
+        for(auto & c : codes)
+            out.push_back(&tinfo[c.second]);
     }
 };
 
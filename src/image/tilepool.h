@@ -0,0 +1,158 @@
+
+// Pool of temporary tile buffers, used by tile managers for AllocTmp() and
+// FreeTmp().
+//
+// Each worker thread keeps its own free list, so a multi-pass filter cycling
+// temporary tiles neither fragments the heap nor contends on the global
+// allocator. Threads outside the worker pool share one extra list. A buffer
+// freed on a different thread than it was allocated on simply joins that
+// thread's list. Each list holds at most a high-water mark of free buffers,
+// beyond which freed buffers are returned to the system.
+//
+// Buffers are cache line aligned, and all buffers of a pool have the size of
+// the first one allocated.
+
+#ifndef TILEPOOL_H
+#define TILEPOOL_H
+
+#include <cstdlib>
+#include <new>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <stdexcept>
+
+#include <boost/format.hpp>
+
+#include "workerpool.h"
+
+namespace bigimage {
+
+// Alignment of pooled tile buffers
+const size_t kTileAlign = 64;
+// Default limit on free buffers kept per thread
+const size_t kDefaultPoolHighWater = 256;
+
+class TilePool {
+  public:
+    struct Stats {
+        size_t allocations;// buffers allocated from the system
+        size_t reuses;// allocations served from a free list
+        size_t releases;// frees beyond the high-water mark, returned to the system
+        size_t inUse;// buffers currently allocated
+        size_t peak;// most buffers allocated at once
+    };
+    
+  protected:
+    struct alignas(64) FreeList {
+        std::mutex mtx;
+        std::vector<void *> buffers;
+        size_t allocations, reuses, releases;
+    };
+    
+    WorkerLocal<FreeList> lists;// one per worker, plus one for other threads
+    std::atomic<size_t> bufferBytes;
+    size_t highWater;
+    std::atomic<size_t> inUse, peak;
+    
+    void CountAlloc() {
+        size_t n = ++inUse;
+        size_t p = peak.load(std::memory_order_relaxed);
+        while(n > p && !peak.compare_exchange_weak(p, n, std::memory_order_relaxed)) {}
+    }
+    
+  public:
+    TilePool(): bufferBytes(0), highWater(kDefaultPoolHighWater), inUse(0), peak(0) {
+        for(auto & l : lists)
+            l.allocations = l.reuses = l.releases = 0;
+    }
+    ~TilePool() {Trim();}
+    
+    void * Alloc(size_t bytes);
+    void Free(void * buffer);
+    
+    // Set limit on free buffers kept per thread. Lists over the limit shrink
+    // as buffers are freed.
+    void SetHighWater(size_t buffers) {highWater = buffers;}
+    size_t HighWater() const {return highWater;}
+    
+    // Return all free buffers to the system
+    void Trim();
+    
+    Stats GetStats();
+};
+
+
+// *****************************************************************************
+// TilePool implementation
+// *****************************************************************************
+
+inline void * TilePool::Alloc(size_t bytes)
+{
+    // First allocation sets buffer size
+    size_t expected = 0;
+    if(!bufferBytes.compare_exchange_strong(expected, bytes) && expected != bytes)
+        throw std::runtime_error((boost::format("Tile pool of %d byte buffers asked for %d bytes")% expected % bytes).str());
+    
+    FreeList & list = lists.Local();
+    {
+        std::lock_guard<std::mutex> lock(list.mtx);
+        if(!list.buffers.empty()) {
+            void * buffer = list.buffers.back();
+            list.buffers.pop_back();
+            ++list.reuses;
+            CountAlloc();
+            return buffer;
+        }
+        ++list.allocations;
+    }
+    
+    void * buffer = nullptr;
+    if(posix_memalign(&buffer, kTileAlign, (bytes + kTileAlign - 1)/kTileAlign*kTileAlign) != 0)
+        throw std::bad_alloc();
+    CountAlloc();
+    return buffer;
+}
+
+inline void TilePool::Free(void * buffer)
+{
+    if(!buffer)
+        return;
+    --inUse;
+    FreeList & list = lists.Local();
+    {
+        std::lock_guard<std::mutex> lock(list.mtx);
+        if(list.buffers.size() < highWater) {
+            list.buffers.push_back(buffer);
+            return;
+        }
+        ++list.releases;
+    }
+    free(buffer);
+}
+
+inline void TilePool::Trim()
+{
+    for(auto & list : lists) {
+        std::lock_guard<std::mutex> lock(list.mtx);
+        for(void * buffer : list.buffers)
+            free(buffer);
+        list.buffers.clear();
+        list.buffers.shrink_to_fit();
+    }
+}
+
+inline TilePool::Stats TilePool::GetStats()
+{
+    Stats stats{0, 0, 0, inUse, peak};
+    for(auto & list : lists) {
+        std::lock_guard<std::mutex> lock(list.mtx);
+        stats.allocations += list.allocations;
+        stats.reuses += list.reuses;
+        stats.releases += list.releases;
+    }
+    return stats;
+}
+
+} // namespace bigimage
+#endif // TILEPOOL_H
@@ -0,0 +1,261 @@
+
+// Affine and projective warps. Warp() maps src into dst through a 3x3
+// transform of homogeneous 2D pixel coordinates, with pixel centers at integer
+// coordinates, sampling src at the inverse-mapped center of each destination
+// pixel. Affine transforms may also be given as a mat44 acting on x and y.
+//
+// Destination tiles are warped in parallel. The corners of each tile are
+// mapped back into src first: tiles mapping entirely outside src are filled
+// without sampling, and otherwise only the source region bounding the mapped
+// corners, plus the filter's reach, is gathered and sampled. Tiles crossing
+// the horizon of a projective transform are bounded by mapping every pixel.
+// Source regions grow with the reduction of the warp, so regions are limited
+// to the tiles of one block, which a tile cache always has room to pin for
+// every worker. Tiles needing more, under strong reductions or near a
+// horizon, gather the taps of each pixel separately instead, which is much
+// slower, so strong reductions are best warped from a pyramid level of about
+// the right scale.
+//
+// Sample positions are computed for whole rows at a time, and pixels are
+// filtered in the working types of ConvTraits, as float4 vectors for RGBA.
+
+#ifndef WARP_H
+#define WARP_H
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+
+#include "math3d/vmatrix.h"
+
+#include "pixeltype.h"
+#include "tile.h"
+#include "apron.h"
+#include "tilemanager.h"
+#include "convolve.h"
+#include "workerpool.h"
+
+namespace bigimage {
+
+enum WarpFilter {
+    kWarpBilinear,// 2x2 taps
+    kWarpBicubic// Catmull-Rom, 4x4 taps
+};
+
+// Catmull-Rom weights of the 4 taps around a sample at fraction f past the
+// second tap
+inline void CubicWeights(float f, float * w)
+{
+    float f2 = f*f, f3 = f2*f;
+    w[0] = 0.5f*(-f3 + 2*f2 - f);
+    w[1] = 0.5f*(3*f3 - 5*f2 + 2);
+    w[2] = 0.5f*(-3*f3 + 4*f2 + f);
+    w[3] = 0.5f*(f3 - f2);
+}
+
+// Warp src into dst through transform, which maps source pixel coordinates to
+// destination pixel coordinates. Destination pixels mapping outside src are
+// set to fill. Pixel types must have the same working type. Images must be
+// distinct.
+template<typename dimgT, typename simgT, typename T>
+void Warp(dimgT & dst, simgT & src, const mat33_templ<T> & transform, WarpFilter filter = kWarpBilinear,
+          const typename dimgT::pixel_val_t & fill = typename dimgT::pixel_val_t())
+{
+    typedef typename simgT::pixel_val_t spixel_val_t;
+    typedef ConvTraits<typename dimgT::pixel_t> dtraits;
+    typedef ConvTraits<typename simgT::pixel_t> straits;
+    typedef typename dtraits::work_t work_t;
+    static_assert(std::is_same<work_t, typename straits::work_t>::value,
+                  "source and destination must have the same working type");
+    if(static_cast<void *>(&dst) == static_cast<void *>(&src))
+        throw std::runtime_error("Warp(): source and destination must be distinct images");
+    
+    // Inverse in double precision, as destination coordinates may be large
+    mat33d fwd, inv;
+    for(int j = 0; j < 3; ++j)
+        fwd.rows[j] = mat33d::vec_t{transform.rows[j].x, transform.rows[j].y, transform.rows[j].z, 0};
+    fwd.inverse(inv);
+    
+    const int32_t sw = src.Width(), sh = src.Height();
+    const int32_t reach = (filter == kWarpBicubic)? 2 : 1;// taps beyond floor of sample position
+    
+    // Per-thread sample positions, gathered source region and its working
+    // copy, and a row of output. Regions vary in size, so aren't pooled.
+    struct Buffers {
+        std::vector<float> sx, sy;
+        std::vector<spixel_val_t> pixels;
+        std::vector<work_t> region;
+        std::vector<work_t> row;
+    };
+    WorkerLocal<Buffers> work;
+    dst.EachTile([&](typename dimgT::TileInfo & ti){
+        Buffers & b = work.Local();
+        b.sx.resize(kTilePixels);
+        b.sy.resize(kTilePixels);
+        b.row.resize(kTileWidth);
+        
+        // Source positions of a row of pixels. x, y and the homogeneous
+        // divisor each step linearly along the row, so the division is all
+        // that is left per pixel. Positions behind a projective transform's
+        // horizon are marked as NaN.
+        auto mapRow = [&](int32_t y) {
+            mat33d::vec_t p = inv.trans_pt(mat33d::vec_t{double(ti.x), double(y), 1, 0});
+            float u0 = p.x, v0 = p.y, w0 = p.z;
+            float du = inv.rows[0].x, dv = inv.rows[1].x, dw = inv.rows[2].x;
+            float * sx = &b.sx[(y - ti.y)*kTileWidth], * sy = &b.sy[(y - ti.y)*kTileWidth];
+            for(int32_t x = 0; x < kTileWidth; ++x) {
+                float w = w0 + dw*x;
+                float rw = (w > 0)? 1.0f/w : NAN;
+                sx[x] = (u0 + du*x)*rw;
+                sy[x] = (v0 + dv*x)*rw;
+            }
+        };
+        
+        // Source bounds of the tile from its corners, or from every pixel if
+        // it crosses the horizon
+        double bx0 = INFINITY, by0 = INFINITY, bx1 = -INFINITY, by1 = -INFINITY;
+        int32_t infront = 0;
+        for(int32_t c = 0; c < 4; ++c) {
+            mat33d::vec_t p = inv.trans_pt(mat33d::vec_t{double(ti.x + (c & 1)*(kTileWidth - 1)),
+                                                         double(ti.y + (c >> 1)*(kTileHeight - 1)), 1, 0});
+            if(p.z > 0) {
+                ++infront;
+                bx0 = std::min(bx0, p.x/p.z);
+                bx1 = std::max(bx1, p.x/p.z);
+                by0 = std::min(by0, p.y/p.z);
+                by1 = std::max(by1, p.y/p.z);
+            }
+        }
+        bool mapped = false;
+        if(infront > 0 && infront < 4)
+        {
+            bx0 = by0 = INFINITY;
+            bx1 = by1 = -INFINITY;
+            for(int32_t y = ti.y; y < ti.y + kTileHeight; ++y)
+                mapRow(y);
+            for(int32_t p = 0; p < kTilePixels; ++p)
+                if(!std::isnan(b.sx[p])) {
+                    bx0 = std::min<double>(bx0, b.sx[p]);
+                    bx1 = std::max<double>(bx1, b.sx[p]);
+                    by0 = std::min<double>(by0, b.sy[p]);
+                    by1 = std::max<double>(by1, b.sy[p]);
+                }
+            mapped = true;
+        }
+        
+        // Pixels map inside src within half a pixel of its edge pixels
+        bx0 = std::max(bx0, -0.5);
+        by0 = std::max(by0, -0.5);
+        bx1 = std::min(bx1, sw - 0.5);
+        by1 = std::min(by1, sh - 0.5);
+        if(infront == 0 || !(bx0 < bx1 && by0 < by1)) {
+            std::fill(ti.pixels->begin(), ti.pixels->end(), fill);
+            return;
+        }
+        
+        // Filtered sample at fraction fx, fy past pixel ix, iy of a rw x rh
+        // region. Taps beyond the region are clamped to it, the region being
+        // clamped to src.
+        auto sample = [&](const work_t * region, int32_t rw, int32_t rh, int32_t ix, int32_t iy, float fx, float fy) {
+            work_t v = work_t();
+            if(filter == kWarpBicubic)
+            {
+                float wx[4], wy[4];
+                CubicWeights(fx, wx);
+                CubicWeights(fy, wy);
+                if(ix >= 1 && ix + 2 < rw && iy >= 1 && iy + 2 < rh) {
+                    const work_t * in = region + (iy - 1)*rw + ix - 1;
+                    for(int32_t j = 0; j < 4; ++j, in += rw)
+                        v += wy[j]*(wx[0]*in[0] + wx[1]*in[1] + wx[2]*in[2] + wx[3]*in[3]);
+                }
+                else {
+                    for(int32_t j = 0; j < 4; ++j) {
+                        const work_t * in = region + std::min(std::max(iy + j - 1, 0), rh - 1)*rw;
+                        work_t h = work_t();
+                        for(int32_t i = 0; i < 4; ++i)
+                            h += wx[i]*in[std::min(std::max(ix + i - 1, 0), rw - 1)];
+                        v += wy[j]*h;
+                    }
+                }
+            }
+            else
+            {
+                int32_t x0 = std::max(ix, 0), x1 = std::min(ix + 1, rw - 1);
+                const work_t * in0 = region + std::max(iy, 0)*rw, * in1 = region + std::min(iy + 1, rh - 1)*rw;
+                v = (1 - fy)*((1 - fx)*in0[x0] + fx*in0[x1]) + fy*((1 - fx)*in1[x0] + fx*in1[x1]);
+            }
+            return v;
+        };
+        
+        // Source region within reach of the bounds, gathered whole if it
+        // spans no more tiles than a block
+        int32_t rx0 = std::max(int32_t(std::floor(bx0)) - reach + 1, 0);
+        int32_t ry0 = std::max(int32_t(std::floor(by0)) - reach + 1, 0);
+        int32_t rx1 = std::min(int32_t(std::floor(bx1)) + reach + 1, sw);
+        int32_t ry1 = std::min(int32_t(std::floor(by1)) + reach + 1, sh);
+        int32_t rtiles = ((rx1 - 1)/kTileWidth - rx0/kTileWidth + 1)*((ry1 - 1)/kTileHeight - ry0/kTileHeight + 1);
+        const bool whole = rtiles <= kBlockTiles;
+        if(!whole) {
+            // Taps of a single pixel, gathered per pixel
+            rx1 = rx0 + 2*reach;
+            ry1 = ry0 + 2*reach;
+        }
+        int32_t rw = rx1 - rx0, rh = ry1 - ry0;
+        b.pixels.resize(size_t(rw)*rh);
+        b.region.resize(size_t(rw)*rh);
+        const work_t * region = &b.region[0];
+        if(whole) {
+            GatherRect(src, rx0, ry0, rw, rh, kEdgeClamp, spixel_val_t(), &b.pixels[0]);
+            straits::Load(&b.region[0], &b.pixels[0], size_t(rw)*rh);
+        }
+        
+        for(int32_t y = 0; y < kTileHeight; ++y)
+        {
+            if(!mapped)
+                mapRow(ti.y + y);
+            const float * sx = &b.sx[y*kTileWidth], * sy = &b.sy[y*kTileWidth];
+            for(int32_t x = 0; x < kTileWidth; ++x)
+            {
+                // Positions outside src, including NaN, fail these tests
+                if(!(sx[x] >= -0.5f && sx[x] < sw - 0.5f && sy[x] >= -0.5f && sy[x] < sh - 0.5f)) {
+                    b.row[x] = work_t();
+                    continue;
+                }
+                float fx = std::floor(sx[x]), fy = std::floor(sy[x]);
+                int32_t ix = int32_t(fx), iy = int32_t(fy);
+                fx = sx[x] - fx;
+                fy = sy[x] - fy;
+                if(whole) {
+                    b.row[x] = sample(region, rw, rh, ix - rx0, iy - ry0, fx, fy);
+                }
+                else {
+                    // Edge clamping of the gather matches clamping to the region
+                    int32_t tx0 = ix - reach + 1, ty0 = iy - reach + 1;
+                    GatherRect(src, tx0, ty0, rw, rh, kEdgeClamp, spixel_val_t(), &b.pixels[0]);
+                    straits::Load(&b.region[0], &b.pixels[0], size_t(rw)*rh);
+                    b.row[x] = sample(region, rw, rh, ix - tx0, iy - ty0, fx, fy);
+                }
+            }
+            dtraits::Store(&(*ti.pixels)[y*kTileWidth], &b.row[0], kTileWidth);
+            for(int32_t x = 0; x < kTileWidth; ++x)
+                if(!(sx[x] >= -0.5f && sx[x] < sw - 0.5f && sy[x] >= -0.5f && sy[x] < sh - 0.5f))
+                    (*ti.pixels)[y*kTileWidth + x] = fill;
+        }
+    });
+}
+
+// Affine warp through the x and y rows of a mat44, with z ignored
+template<typename dimgT, typename simgT, typename T>
+void Warp(dimgT & dst, simgT & src, const mat44_templ<T> & transform, WarpFilter filter = kWarpBilinear,
+          const typename dimgT::pixel_val_t & fill = typename dimgT::pixel_val_t())
+{
+    mat33_templ<T> m;
+    m.rows[0] = typename mat33_templ<T>::vec_t{transform.rows[0].x, transform.rows[0].y, transform.rows[0].w, 0};
+    m.rows[1] = typename mat33_templ<T>::vec_t{transform.rows[1].x, transform.rows[1].y, transform.rows[1].w, 0};
+    m.rows[2] = typename mat33_templ<T>::vec_t{0, 0, 1, 0};
+    Warp(dst, src, m, filter, fill);
+}
+
+} // namespace bigimage
+#endif // WARP_H
@@ -0,0 +1,328 @@
+// *****************************************************************************
+// A persistent pool of worker threads, shared by all images.
+//
+// Each worker owns a deque of tasks. Workers take work from the front of their
+// own deque, and when it runs dry, steal from the back of other workers' deques.
+//
+// Parallel loops, ParallelForGuided(), queue one claimer task per worker.
+// Claimers take ranges from a shared atomic cursor with a fetch-add, with no
+// locks held per range, so workers walk the loop in order, and the range size
+// shrinks as the loop nears its end (guided scheduling) so the last few ranges
+// even out the finishing times.
+//
+// Tasks are plain function pointer/context pairs, so submitting work does not
+// allocate.
+
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <algorithm>
+#include <vector>
+#include <deque>
+
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+namespace bigimage {
+
+// Maximum number of worker threads. The pool is sized to the machine, up to
+// this limit. Per-thread context arrays passed to EachTile() and friends must
+// have kNThreads entries, and are indexed by worker ID.
+const int kNThreads = 64;
+
+class WorkerPool {
+  public:
+    // Work item: calls fn(ctx, workerID, begin, end)
+    struct Task {
+        void (*fn)(void * ctx, int workerID, size_t begin, size_t end);
+        void * ctx;
+        size_t begin, end;
+    };
+    
+  protected:
+    struct Worker {
+        std::mutex mtx;
+        std::deque<Task> tasks;
+        std::thread thread;
+    };
+    
+    std::vector<Worker *> workers;
+    std::mutex sleepMtx;
+    std::condition_variable wake;
+    std::atomic<size_t> pending;// tasks submitted but not yet taken
+    bool stopping;
+    
+    // Worker ID of the current thread, or -1 for threads outside the pool
+    static int & CurrentWorker() {
+        static thread_local int workerID = -1;
+        return workerID;
+    }
+    
+    void Start(int nthreads);
+    void Stop();
+    void Run(int workerID);
+    
+    // Take a task from own deque, or steal one. Returns false if none found.
+    bool TryTake(int workerID, Task & task);
+    bool TryRunOne(int workerID);
+    
+    template<typename fnT>
+    static void CallClaimer(void * ctx, int workerID, size_t begin, size_t end);
+    
+    template<typename batchT>
+    void Wait(batchT & batch);
+    
+  public:
+    // nthreads == 0 sizes pool to the machine
+    WorkerPool(int nthreads = 0): pending(0), stopping(false) {Start(nthreads);}
+    ~WorkerPool() {Stop();}
+    
+    // Pool shared by all images
+    static WorkerPool & Shared() {
+        static WorkerPool pool;
+        return pool;
+    }
+    
+    int NumWorkers() const {return workers.size();}
+    
+    // Worker ID of the calling thread, or -1 for threads outside the pool
+    static int ThisWorker() {return CurrentWorker();}
+    
+    // Replace worker threads with a new set. Must not be called while work is
+    // in progress.
+    void Resize(int nthreads) {Stop(); Start(nthreads);}
+    
+    // Queue tasks on a worker's deque, or spread across all deques if workerID
+    // is negative.
+    void Submit(int workerID, const Task * tasks, size_t ntasks);
+    
+    // Call fn(int workerID, size_t begin, size_t end) over [0, n), with workers
+    // claiming ranges in order from a shared atomic cursor, blocking until all
+    // are complete. Ranges start at around n/(2*NumWorkers()) and shrink with
+    // the remaining work, but never below minChunk (0 is treated as 1).
+    // May be called from inside a task: the calling worker helps out with
+    // queued work while waiting.
+    template<typename fnT>
+    void ParallelForGuided(size_t n, size_t minChunk, const fnT & fn);
+};
+
+// One T per worker, plus one shared by threads outside the pool, for scratch
+// buffers kept across the tasks of a loop or traversal
+template<typename T>
+class WorkerLocal {
+  protected:
+    T items[kNThreads + 1];
+    
+  public:
+    // T of the calling thread
+    T & Local() {
+        int w = WorkerPool::ThisWorker();
+        return items[(w < 0)? kNThreads : w];
+    }
+    
+    T * begin() {return items;}
+    T * end() {return items + kNThreads + 1;}
+};
+
+
+// *****************************************************************************
+// WorkerPool implementation
+// *****************************************************************************
+
+inline void WorkerPool::Start(int nthreads)
+{
+    if(nthreads <= 0)
+        nthreads = std::thread::hardware_concurrency();
+    nthreads = std::max(1, std::min(nthreads, kNThreads));
+    
+    stopping = false;
+    workers.resize(nthreads);
+    for(auto & w : workers)
+        w = new Worker;
+    for(int tid = 0; tid < nthreads; ++tid)
+        workers[tid]->thread = std::thread([this](int workerID){Run(workerID);}, tid);
+}
+
+inline void WorkerPool::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleepMtx);
+        stopping = true;
+    }
+    wake.notify_all();
+    // All threads must be gone before any deque is, as they steal from each other
+    for(auto & w : workers)
+        w->thread.join();
+    for(auto & w : workers)
+        delete w;
+    workers.clear();
+}
+
+inline void WorkerPool::Run(int workerID)
+{
+    CurrentWorker() = workerID;
+    while(true)
+    {
+        if(TryRunOne(workerID))
+            continue;
+        
+        std::unique_lock<std::mutex> lock(sleepMtx);
+        if(stopping)
+            break;
+        wake.wait(lock, [this]{return pending > 0 || stopping;});
+    }
+}
+
+inline bool WorkerPool::TryTake(int workerID, Task & task)
+{
+    // Own deque first, from the front...
+    Worker & self = *workers[workerID];
+    {
+        std::lock_guard<std::mutex> lock(self.mtx);
+        if(!self.tasks.empty()) {
+            task = self.tasks.front();
+            self.tasks.pop_front();
+            --pending;
+            return true;
+        }
+    }
+    // ...then steal from the back of the others, starting with the next worker
+    // over so thieves spread out instead of all hitting worker 0.
+    int nworkers = workers.size();
+    for(int j = 1; j < nworkers; ++j)
+    {
+        Worker & victim = *workers[(workerID + j) % nworkers];
+        std::lock_guard<std::mutex> lock(victim.mtx);
+        if(!victim.tasks.empty()) {
+            task = victim.tasks.back();
+            victim.tasks.pop_back();
+            --pending;
+            return true;
+        }
+    }
+    return false;
+}
+
+inline bool WorkerPool::TryRunOne(int workerID)
+{
+    Task task;
+    if(!TryTake(workerID, task))
+        return false;
+    task.fn(task.ctx, workerID, task.begin, task.end);
+    return true;
+}
+
+inline void WorkerPool::Submit(int workerID, const Task * tasks, size_t ntasks)
+{
+    if(ntasks == 0)
+        return;
+    
+    // Count tasks before they become visible so the pending count can't go
+    // negative. A worker woken early just spins until the push lands.
+    {
+        std::lock_guard<std::mutex> lock(sleepMtx);
+        pending += ntasks;
+    }
+    
+    if(workerID >= 0) {
+        Worker & w = *workers[workerID];
+        std::lock_guard<std::mutex> lock(w.mtx);
+        w.tasks.insert(w.tasks.end(), tasks, tasks + ntasks);
+    }
+    else {
+        // Contiguous runs of tasks to each worker, preserving order
+        size_t nworkers = workers.size();
+        for(size_t wid = 0; wid < nworkers; ++wid)
+        {
+            size_t t0 = wid*ntasks/nworkers, t1 = (wid + 1)*ntasks/nworkers;
+            if(t0 == t1)
+                continue;
+            Worker & w = *workers[wid];
+            std::lock_guard<std::mutex> lock(w.mtx);
+            w.tasks.insert(w.tasks.end(), tasks + t0, tasks + t1);
+        }
+    }
+    wake.notify_all();
+}
+
+
+// Shared state for one ParallelForGuided() call, lives on the caller's stack.
+template<typename fnT>
+struct ParallelForBatch {
+    const fnT * fn;
+    std::atomic<size_t> cursor;// next unclaimed index
+    size_t n, minChunk, nclaimers;
+    std::atomic<size_t> remaining;// claimers not yet finished
+    std::mutex mtx;
+    std::condition_variable done;
+    bool finished;// set under mtx by the last claimer, after which batch is untouched
+};
+
+template<typename fnT>
+void WorkerPool::CallClaimer(void * ctx, int workerID, size_t, size_t)
+{
+    ParallelForBatch<fnT> & batch = *static_cast<ParallelForBatch<fnT> *>(ctx);
+    const size_t n = batch.n;
+    while(true)
+    {
+        // The size estimate may be stale by the time the fetch-add lands, which
+        // only makes the range a little larger than ideal.
+        size_t left = n - std::min(n, batch.cursor.load(std::memory_order_relaxed));
+        size_t chunk = std::max(batch.minChunk, left/(2*batch.nclaimers));
+        size_t begin = batch.cursor.fetch_add(chunk, std::memory_order_relaxed);
+        if(begin >= n)
+            break;
+        (*batch.fn)(workerID, begin, std::min(n, begin + chunk));
+    }
+    if(--batch.remaining == 0) {
+        std::lock_guard<std::mutex> lock(batch.mtx);
+        batch.finished = true;
+        batch.done.notify_all();
+    }
+}
+
+template<typename batchT>
+void WorkerPool::Wait(batchT & batch)
+{
+    // Nested call from a task: help out rather than block a worker
+    int workerID = CurrentWorker();
+    if(workerID >= 0)
+        while(batch.remaining > 0)
+            if(!TryRunOne(workerID))
+                std::this_thread::yield();
+    
+    std::unique_lock<std::mutex> lock(batch.mtx);
+    batch.done.wait(lock, [&]{return batch.finished;});
+}
+
+template<typename fnT>
+void WorkerPool::ParallelForGuided(size_t n, size_t minChunk, const fnT & fn)
+{
+    if(n == 0)
+        return;
+    
+    ParallelForBatch<fnT> batch;
+    batch.fn = &fn;
+    batch.cursor = 0;
+    batch.n = n;
+    batch.minChunk = std::max<size_t>(1, minChunk);
+    batch.nclaimers = std::min(workers.size(), (n + batch.minChunk - 1)/batch.minChunk);
+    batch.remaining = batch.nclaimers;
+    batch.finished = false;
+    
+    // One claimer per worker; any worker that is busy elsewhere just has its
+    // claimer stolen by one that isn't.
+    Task tasks[kNThreads];
+    for(size_t c = 0; c < batch.nclaimers; ++c)
+        tasks[c] = Task{&CallClaimer<fnT>, &batch, 0, 0};
+    Submit(-1, tasks, batch.nclaimers);
+    Wait(batch);
+}
+
+} // namespace bigimage
+#endif // WORKERPOOL_H
@@ -139,6 +139,18 @@ template<typename T> T & accum_mean_var(T & m, T & s, const T & x, int n) {
     return m;
 }
 
+// Merge mean and variance m2, s2 of n2 samples into m, s of n samples, returning
+// mean. (Chan et al.)
+template<typename T, typename N> T & merge_mean_var(T & m, T & s, N n, const T & m2, const T & s2, N n2) {
+    if(n2 == 0)
+        return m;
+    double f = double(n2)/double(n + n2);
+    T d = m2 - m;
+    m += d*f;
+    s = s*(1.0 - f) + s2*f + d*d*(f*(1.0 - f));
+    return m;
+}
+
 
 
 //************************************************************************************************
@@ -45,6 +45,12 @@ struct mat33_templ {
     }
     
     void transpose(mat33_templ<T> & result) const;
+    
+    // Points are 2D homogeneous coordinates: pt.z is taken as 1, and the
+    // result is left undivided, with the divisor in z.
+    vec_t trans_pt(vec_t pt) const;
+    
+    void inverse(mat33_templ<T> & result) const;
 };
 
 template<typename T>
@@ -157,6 +163,33 @@ void mat33_templ<T>::transpose(mat33_templ<T> & result) const
     result.rows[2] = (mat33_templ<T>::vec_t){rows[0].z, rows[1].z, rows[2].z, 0};
 }
 
+template<typename T>
+vec4<T> mat33_templ<T>::trans_pt(vec4<T> pt) const
+{
+    pt.z = 1;
+    return mat33_templ<T>::vec_t{
+        vdot3(pt, rows[0]),
+        vdot3(pt, rows[1]),
+        vdot3(pt, rows[2]),
+        0
+    };
+}
+
+// Invert as adjugate over determinant
+template<typename T>
+void mat33_templ<T>::inverse(mat33_templ<T> & result) const
+{
+    const vec_t & a = rows[0], & b = rows[1], & c = rows[2];
+    result.rows[0] = (vec_t){b.y*c.z - b.z*c.y, a.z*c.y - a.y*c.z, a.y*b.z - a.z*b.y, 0};
+    result.rows[1] = (vec_t){b.z*c.x - b.x*c.z, a.x*c.z - a.z*c.x, a.z*b.x - a.x*b.z, 0};
+    result.rows[2] = (vec_t){b.x*c.y - b.y*c.x, a.y*c.x - a.x*c.y, a.x*b.y - a.y*b.x, 0};
+    
+    T det = 1.0/(a.x*result.rows[0].x + a.y*result.rows[1].x + a.z*result.rows[2].x);
+    result.rows[0] *= det;
+    result.rows[1] *= det;
+    result.rows[2] *= det;
+}
+
 template<typename T>
 void mat44_templ<T>::transpose(mat44_templ<T> & result) const
 {